@@ -3,12 +3,20 @@
 */
 
 #include <string.h>
+#include <stdio.h>
 #include <unistd.h>
+#include <sys/time.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include "processing.hpp"
 #include "interactive-processor.hpp"
 
 #define MEASURE_PASS1_TIME	0
 #define MEASURE_PASS2_TIME	0
+#define USE_PIPELINE_LUT_FOR_FULLRES	(PHOTOPROC_QUANTUM_BITS > 8)
+		// with 8-bit quantums pipeline_lut_t differs from the exact
+		//   pipeline by several codes; check with -verify-lut
 
 	/*	processing pipeline:
 
@@ -121,6 +129,293 @@ void *SyncQueue::Read(uint &len,const uint no_wait)
 	return NULL;
 	}
 
+/***************************************************************************/
+/******************************               ******************************/
+/****************************** spsc_ring_t:: ******************************/
+/******************************               ******************************/
+/***************************************************************************/
+
+	// counts are read and written without the mutex, so they need
+	//   acquire/release ordering, and a sleeper and its waker need a full
+	//   barrier between publishing their own state and checking the other's;
+	//   see the helpers in processing.hpp
+
+spsc_ring_t::spsc_ring_t(const uint _slot_size,const uint min_nr_of_slots) :
+			slot_size((_slot_size + 15) & ~15U),
+			nr_of_slots(get_power_of_2_at_least(min_nr_of_slots)),
+			write_count(0), read_count(0), peek_count(0), nr_of_sleepers(0)
+{
+	const long nr_of_cpus=sysconf(_SC_NPROCESSORS_ONLN);
+	spin_count=(nr_of_cpus > 1) ? 2000 : 1;
+
+	slots=new char [slot_size * nr_of_slots];
+	lens=new uint [nr_of_slots];
+	}
+
+spsc_ring_t::~spsc_ring_t(void)
+{
+	delete [] slots;
+	delete [] lens;
+	}
+
+uint spsc_ring_t::get_power_of_2_at_least(const uint value)
+{
+	uint result=1;
+	while (result < value)
+		result<<=1;
+	return result;
+	}
+
+void spsc_ring_t::wait_while_equal(const volatile uint &count,
+															const uint value)
+{
+		// spin a little first, as the other thread is often just about
+		//   to change count; on a single CPU that could not happen
+
+	for (uint i=spin_count;i;i--) {
+		if (load_acquire(count) != value)
+			return;
+#if defined(__SSE2__)
+		_mm_pause();
+#endif
+		}
+
+	mutex_locker_t rm(&mutex);
+	nr_of_sleepers++;
+	full_barrier();
+	while (load_acquire(count) == value)
+		cond.wait(&mutex);
+	nr_of_sleepers--;
+	}
+
+void spsc_ring_t::wake_sleepers(void)
+{
+	full_barrier();
+	if (nr_of_sleepers) {
+		mutex_locker_t rm(&mutex);
+		cond.wakeAll();
+		}
+	}
+
+void spsc_ring_t::Write(const void *ptr,uint len)
+{
+	const uint w=write_count;
+	wait_while_equal(read_count,w - nr_of_slots);		// while full
+
+	const uint slot=w & (nr_of_slots-1);
+	if (len > slot_size)
+		len=slot_size;
+	if (len)
+		memcpy(slots + slot*slot_size,ptr,len);
+	lens[slot]=len;
+
+	store_release(write_count,w+1);
+	wake_sleepers();
+	}
+
+void *spsc_ring_t::Read(uint &len,const uint no_wait)
+{
+	if (no_wait) {
+		if (load_acquire(write_count) == peek_count)
+			return NULL;
+		}
+	  else
+		wait_while_equal(write_count,peek_count);			// while empty
+
+	const uint slot=peek_count & (nr_of_slots-1);
+	peek_count++;
+	len=lens[slot];
+	return slots + slot*slot_size;
+	}
+
+void spsc_ring_t::Release(void *)
+{
+	store_release(read_count,read_count+1);
+	wake_sleepers();
+	}
+
+/***************************************************************************/
+/****************************                   ****************************/
+/**************************** decoded_image_t:: ****************************/
+/****************************                   ****************************/
+/***************************************************************************/
+
+decoded_image_t::decoded_image_t(const char * const _shooting_info_fname,
+				const char * const _cache_key) :
+											decoder(NULL), is_image_valid(0)
+{
+	decoder=new ppm_image_decoder_t(img);
+
+	shooting_info_fname[0]='\0';
+	if (_shooting_info_fname != NULL) {
+		strncpy(shooting_info_fname,_shooting_info_fname,
+												sizeof(shooting_info_fname));
+		shooting_info_fname[sizeof(shooting_info_fname)-1]='\0';
+		}
+
+	cache_key[0]='\0';
+	if (_cache_key != NULL) {
+		strncpy(cache_key,_cache_key,sizeof(cache_key));
+		cache_key[sizeof(cache_key)-1]='\0';
+		}
+	}
+
+decoded_image_t::~decoded_image_t(void)
+{
+	if (decoder != NULL)
+		delete decoder;
+	}
+
+void decoded_image_t::feed(const void * const data,const uint len)
+{
+	if (decoder != NULL)
+		decoder->feed(data,len);
+	}
+
+void decoded_image_t::finish(void)
+{
+	mutex_locker_t req(&mutex);
+
+	if (decoder == NULL)
+		return;
+
+	is_image_valid=decoder->is_complete();
+	delete decoder;
+	decoder=NULL;
+
+	cond.wakeAll();
+	}
+
+uint decoded_image_t::is_finished(void)
+{
+	mutex_locker_t req(&mutex);
+	return decoder == NULL;
+	}
+
+uint decoded_image_t::is_valid(void)
+{
+	mutex_locker_t req(&mutex);
+	return decoder == NULL && is_image_valid;
+	}
+
+uint decoded_image_t::wait_until_finished(void)
+{			// returns nonzero if a complete image was decoded
+
+	mutex_locker_t req(&mutex);
+	while (decoder != NULL)
+		cond.wait(&mutex);
+
+	return is_image_valid;
+	}
+
+/***************************************************************************/
+/**************************                      ***************************/
+/************************** band_thread_pool_t:: ***************************/
+/**************************                      ***************************/
+/***************************************************************************/
+
+band_thread_pool_t::band_thread_pool_t(uint nr_of_threads) :
+					workers(NULL), nr_of_workers(0), is_shutting_down(0),
+					job(NULL), job_id(0), nr_of_rows(0), rows_per_band(1),
+					next_row(0), nr_of_busy_workers(0)
+{
+	if (!nr_of_threads) {
+		const long nr_of_cpus=sysconf(_SC_NPROCESSORS_ONLN);
+		nr_of_threads=(nr_of_cpus > 0) ? (uint)nr_of_cpus : 1;
+		}
+
+	nr_of_workers=nr_of_threads - 1;
+	if (!nr_of_workers)
+		return;
+
+	workers=new worker_t * [nr_of_workers];
+	for (uint i=0;i < nr_of_workers;i++) {
+		workers[i]=new worker_t(*this);
+		workers[i]->start();
+		}
+	}
+
+band_thread_pool_t::~band_thread_pool_t(void)
+{
+	if (workers == NULL)
+		return;
+
+	mutex.lock();
+	is_shutting_down=1;
+	job_cond.wakeAll();
+	mutex.unlock();
+
+	for (uint i=0;i < nr_of_workers;i++) {
+		workers[i]->wait();
+		delete workers[i];
+		}
+	delete [] workers;
+	workers=NULL;
+	}
+
+void band_thread_pool_t::process_bands(void)
+{			// mutex must be locked; unlocks it while processing each band
+
+	while (job != NULL && next_row < nr_of_rows) {
+		job_t * const cur_job=job;
+		const uint beg_row=next_row;
+		const uint end_row=min(beg_row + rows_per_band,nr_of_rows);
+		next_row=end_row;
+
+		mutex.unlock();
+		cur_job->process_band(beg_row,end_row);
+		mutex.lock();
+		}
+	}
+
+void band_thread_pool_t::worker_t::run(void)
+{
+	mutex_locker_t rm(&pool.mutex);
+
+	uint last_job_id=0;
+	while (1) {
+		while (!pool.is_shutting_down && pool.job_id == last_job_id)
+			pool.job_cond.wait(&pool.mutex);
+		if (pool.is_shutting_down)
+			break;
+
+		last_job_id=pool.job_id;
+		pool.nr_of_busy_workers++;
+		pool.process_bands();
+		if (!--pool.nr_of_busy_workers)
+			pool.done_cond.wakeAll();
+		}
+	}
+
+void band_thread_pool_t::run(job_t &_job,const uint _nr_of_rows,
+												const uint min_rows_per_band)
+{			// returns when all rows 0.._nr_of_rows-1 have been processed
+
+	if (!nr_of_workers || _nr_of_rows < 2*min_rows_per_band) {
+		_job.process_band(0,_nr_of_rows);
+		return;
+		}
+
+	mutex_locker_t rm(&mutex);
+
+		// several bands per thread, so that threads which get slower
+		//   bands do not hold up the others
+
+	job=&_job;
+	nr_of_rows=_nr_of_rows;
+	next_row=0;
+	rows_per_band=max(_nr_of_rows / (4 * get_nr_of_threads()),
+													max(min_rows_per_band,1U));
+	job_id++;
+	job_cond.wakeAll();
+
+	process_bands();
+	while (nr_of_busy_workers)
+		done_cond.wait(&mutex);
+
+	job=NULL;
+	}
+
 /***************************************************************************/
 /*********************                                 *********************/
 /********************* interactive_image_processor_t:: *********************/
@@ -137,14 +432,42 @@ void interactive_image_processor_t::set_enh_shadows(
 void interactive_image_processor_t::set_crop(
 					const uint top_pixels,const uint bottom_pixels,
 					const uint left_pixels,const uint right_pixels)
-{
-	params.top_crop=top_pixels;
-	params.bottom_crop=bottom_pixels;
-	params.left_crop=left_pixels;
-	params.right_crop=right_pixels;
+{			// in full-res pixels
+	fullres_top_crop=top_pixels;
+	fullres_bottom_crop=bottom_pixels;
+	fullres_left_crop=left_pixels;
+	fullres_right_crop=right_pixels;
+	apply_crop();
 	ensure_processing_level(PASS1);
 	}
 
+void interactive_image_processor_t::set_loaded_image_divisor(
+														const uint divisor)
+{
+	loaded_image_divisor=max(divisor,1U);
+	apply_crop();
+	}
+
+void interactive_image_processor_t::apply_crop(void)
+{			// rounds each edge to the nearest pixel of the loaded image
+
+	const uint d=loaded_image_divisor;
+	params.top_crop   =(fullres_top_crop    + d/2) / d;
+	params.bottom_crop=(fullres_bottom_crop + d/2) / d;
+	params.left_crop  =(fullres_left_crop   + d/2) / d;
+	params.right_crop =(fullres_right_crop  + d/2) / d;
+	}
+
+void interactive_image_processor_t::get_crop(
+					uint &top_pixels,uint &bottom_pixels,
+					uint &left_pixels,uint &right_pixels) const
+{
+	top_pixels=params.top_crop;
+	bottom_pixels=params.bottom_crop;
+	left_pixels=params.left_crop;
+	right_pixels=params.right_crop;
+	}
+
 void interactive_image_processor_t::set_color_and_levels_params(
 					const color_and_levels_processing_t::params_t &_params)
 {
@@ -163,11 +486,25 @@ void interactive_image_processor_t::set_fullres_processing_params(
 interactive_image_processor_t::interactive_image_processor_t(
 		notification_receiver_t * const _notification_receiver) :
 			notification_receiver(_notification_receiver),
-			lowres_phase1_image(NULL),
-			operation_pending_count(0), is_processing_necessary(0),
-			is_file_loaded(0)
+			lowres_phase1_image(NULL), fullres_lut(NULL),
+			cmd_queue(sizeof(cmd_packet_t),MAX_PENDING_OPERATIONS),
+			results_queue(sizeof(result_t),MAX_PENDING_OPERATIONS),
+			processing_generation(0), nr_of_pyramid_levels(0),
+			pyramid_undo_enh_shadows(0), cancelled_level(PASS2),
+			fullres_top_crop(0), fullres_bottom_crop(0),
+			fullres_left_crop(0), fullres_right_crop(0),
+			loaded_image_divisor(1),
+			ready_output_buf(1), back_output_buf(2), front_output_buf(0),
+			tile_use_count(0), tile_pass2(NULL),
+			operation_pending_count(0), processing_pending_count(0),
+			is_processing_necessary(0), is_file_loaded(0)
 {
+	for (uint i=0;i < MAX_PHASE1_TILES;i++)
+		phase1_tiles[i].img=NULL;
+
 	params.required_level=NEW_LOWRES_BUF;
+	for (uint i=0;i < NR_OF_OUTPUT_BUFS;i++)
+		params.output_bufs[i]=NULL;
 	params.output_buf=NULL;
 	params.output_in_BGR_format=0;
 	params.dest_bytes_per_pixel=0;
@@ -183,11 +520,18 @@ interactive_image_processor_t::interactive_image_processor_t(
 
 interactive_image_processor_t::~interactive_image_processor_t(void)
 {
-	Write(NULL,0);
+	end_stream();		// in case a LOAD_FROM_STREAM is still waiting for data
+	cmd_queue.Write(NULL,0);
 	wait(20*1000);
 
 	if (lowres_phase1_image != NULL)
 		delete [] lowres_phase1_image;
+	free_pyramid();
+	free_phase1_tiles();
+	if (tile_pass2 != NULL)
+		delete tile_pass2;
+	if (fullres_lut != NULL)
+		delete fullres_lut;
 	}
 
 void interactive_image_processor_t::ensure_processing_level(
@@ -199,18 +543,51 @@ void interactive_image_processor_t::ensure_processing_level(
 	is_processing_necessary=1;
 	}
 
+uint interactive_image_processor_t::is_processing_superseded(
+													const uint generation)
+{
+	mutex_locker_t req(&generation_mutex);
+	return generation != processing_generation;
+	}
+
 void interactive_image_processor_t::set_working_res(
-			const uint x_size,const uint y_size,uchar * const output_buf,
+			const uint x_size,const uint y_size,
+			uchar * const output_bufs[NR_OF_OUTPUT_BUFS],
 			const uint output_in_BGR_format,const uint dest_bytes_per_pixel)
-{
+{			// only when no operations are pending
+
 	params.working_x_size=x_size;
 	params.working_y_size=y_size;
-	params.output_buf=output_buf;
+	for (uint i=0;i < NR_OF_OUTPUT_BUFS;i++)
+		params.output_bufs[i]=output_bufs[i];
+
+	front_output_buf=0;			// the new frames have no images yet
+	back_output_buf=2;
+	store_release(ready_output_buf,1);
+
 	params.output_in_BGR_format=output_in_BGR_format;
 	params.dest_bytes_per_pixel=dest_bytes_per_pixel;
 	ensure_processing_level(NEW_LOWRES_BUF);
 	}
 
+void interactive_image_processor_t::publish_output_buf(void)
+{			// called in interactive_image_processor_t's thread when a
+			//   frame has been completed in back_output_buf
+
+	back_output_buf=exchange(ready_output_buf,
+								back_output_buf | NEW_FRAME_FLAG) &
+														~NEW_FRAME_FLAG;
+	}
+
+uint interactive_image_processor_t::get_output_buf_to_display(void)
+{
+	if (load_acquire(ready_output_buf) & NEW_FRAME_FLAG)
+		front_output_buf=exchange(ready_output_buf,front_output_buf) &
+														~NEW_FRAME_FLAG;
+
+	return front_output_buf;
+	}
+
 void interactive_image_processor_t::start_operation(
 				const operation_type_t operation_type,const char * const fname,
 				void * const param_ptr,const uint param_uint)
@@ -220,6 +597,10 @@ void interactive_image_processor_t::start_operation(
 	packet.params=params;
 	packet.param_ptr=param_ptr;
 	packet.param_uint=param_uint;
+	if (operation_type == PROCESSING) {
+		mutex_locker_t req(&generation_mutex);
+		packet.param_uint=++processing_generation;
+		}
 	packet.fname[0]='\0';
 	if (fname != NULL) {
 		memcpy(packet.fname,fname,
@@ -228,62 +609,162 @@ void interactive_image_processor_t::start_operation(
 		packet.fname[sizeof(packet.fname)-1]='\0';
 		}
 
-	Write(&packet,sizeof(packet));
+	cmd_queue.Write(&packet,sizeof(packet));
 
 	if (operation_type == PROCESSING) {
 		params.required_level=PASS2;
 		is_processing_necessary=0;
+		processing_pending_count++;
 		}
 
 	operation_pending_count++;
 	}
 
+void interactive_image_processor_t::write_stream_data(
+										const void * const data,const uint len)
+{
+	if (len)			// zero-length chunk marks the end of stream
+		stream_queue.Write(data,len);
+	}
+
+uint interactive_image_processor_t::read_stream_data(const void * &data)
+{
+	uint len;
+	void * const ptr=stream_queue.Read(len);
+	if (!len) {
+		stream_queue.Release(ptr);
+		return 0;
+		}
+
+	data=ptr;
+	return len;
+	}
+
+void interactive_image_processor_t::release_stream_data(
+												const void * const data)
+{
+	stream_queue.Release((void *)data);
+	}
+
 void interactive_image_processor_t::run(void)
 {
 	while (1) {
 		uint len;
-		void *ptr=Read(len);
+		void *ptr=cmd_queue.Read(len,1);
+
+			// while no command is waiting, the rest of a stream is read
+			//   a chunk at a time. A streamed PASS1 may not have needed
+			//   the last rows of the image, e.g. with a bottom crop; they
+			//   are read after the preview has been delivered, so that
+			//   the image gets complete, and a new command waits for at
+			//   most one chunk
+
+		while (ptr == NULL)
+			if (image_reader.is_loading_complete())
+				ptr=cmd_queue.Read(len);
+			  else {
+				image_reader.continue_loading();
+				ptr=cmd_queue.Read(len,1);
+				}
 
 		const cmd_packet_t * const packet=(const cmd_packet_t *)ptr;
 		if (len != sizeof(*packet)) {
-			Release(ptr);
+			cmd_queue.Release(ptr);
 			break;
 			}
 
 		result_t result;
 		result.operation_type=packet->operation_type;
 		result.error_text=NULL;
+		result.histogram=NULL;
+
+		if (packet->operation_type != PROCESSING &&
+							packet->operation_type != FULLRES_PROCESSING &&
+							packet->operation_type != RENDER_TILE) {
+			free_pyramid();			// the image is replaced
+			free_phase1_tiles();
+
+				// the rest of the previous stream is read without
+				//   image_load_mutex, as it may take long to arrive
+
+			image_reader.finish_loading();
+			}
 
 		if (packet->operation_type == LOAD_FILE) {
 			mutex_locker_t req(&image_load_mutex);
 			image_reader.load_file(packet->fname);
 			}
-		if (packet->operation_type == LOAD_FROM_MEMORY ||
-				packet->operation_type == LOAD_FROM_MEMORY_AND_DELETE_FILE) {
+		if (packet->operation_type == LOAD_DECODED_IMAGE) {
+			decoded_image_t * const decoded=
+									(decoded_image_t *)packet->param_ptr;
+
+			if (decoded->wait_until_finished()) {
+				mutex_locker_t req(&image_load_mutex);
+				image_reader.load_decoded_image(decoded->img,
+						decoded->shooting_info_fname,decoded->cache_key);
+				}
+			  else {
+				const char * const text="Background image decoding failed";
+				result.error_text=new char [strlen(text)+1];
+				strcpy(result.error_text,text);
+				}
+
+			delete decoded;		// this also frees the previous image
+			}
+		if (packet->operation_type == LOAD_FROM_CACHE) {
+			const char * const cache_key=(const char *)packet->param_ptr;
 			mutex_locker_t req(&image_load_mutex);
 
-			image_reader.load_from_memory(packet->param_ptr,
-									packet->param_uint,packet->fname);
+			if (!image_reader.load_from_cache(cache_key,packet->fname)) {
+				const char * const text="Cached image could not be read";
+				result.error_text=new char [strlen(text)+1];
+				strcpy(result.error_text,text);
+				}
+
+			delete [] cache_key;
+			}
+		if (packet->operation_type == LOAD_FROM_STREAM) {
+			const char * const cache_key=(const char *)packet->param_ptr;
+
+				// the GUI thread feeds stream_queue, and it locks
+				//   image_load_mutex itself, so the header is waited for
+				//   without the mutex
 
-			if (packet->operation_type == LOAD_FROM_MEMORY_AND_DELETE_FILE)
-				unlink(packet->fname);
+			if (image_reader.read_stream_header(this,cache_key)) {
+				mutex_locker_t req(&image_load_mutex);
+				image_reader.load_from_stream(packet->fname);
+				}
+			  else {
+				const char * const text=
+							"External image reader produced no valid image";
+				result.error_text=new char [strlen(text)+1];
+				strcpy(result.error_text,text);
+				}
+
+			if (cache_key != NULL)
+				delete [] cache_key;
 			}
 		else
 		if (packet->operation_type == PROCESSING)
-			do_processing(packet->params);
+			result.histogram=do_processing(packet->params,packet->param_uint);
 		else
 		if (packet->operation_type == FULLRES_PROCESSING)
 			do_fullres_processing(packet->params,packet->fname);
+		else
+		if (packet->operation_type == RENDER_TILE)
+			do_render_tile(packet->params,packet->param_uint,
+											(uchar *)packet->param_ptr);
 
 		results_queue.Write(&result,sizeof(result));
 		notification_receiver->operation_completed();
 
-		Release(ptr);
+		cmd_queue.Release(ptr);
 		}
 	}
 
 uint interactive_image_processor_t::get_operation_results(
-						operation_type_t &operation_type,char * &error_text)
+						operation_type_t &operation_type,char * &error_text,
+						histogram_t ** const histogram)
 {			// returns 0 if no operation results are available
 			// error_text has to be delete []'d by caller
 
@@ -295,132 +776,328 @@ uint interactive_image_processor_t::get_operation_results(
 	const result_t * const result=(const result_t *)ptr;
 	operation_type=result->operation_type;
 	error_text=result->error_text;
+	if (histogram != NULL)
+		*histogram=result->histogram;
+	  else
+	if (result->histogram != NULL)
+		delete result->histogram;
+	results_queue.Release(ptr);
 
 	operation_pending_count--;
-	if (operation_type == LOAD_FILE || operation_type == LOAD_FROM_MEMORY ||
-						operation_type == LOAD_FROM_MEMORY_AND_DELETE_FILE) {
+	if (operation_type == PROCESSING)
+		processing_pending_count--;
+	if (operation_type == LOAD_FILE || operation_type == LOAD_FROM_STREAM) {
 		is_file_loaded=(error_text == NULL);
 		if (is_file_loaded)
 			ensure_processing_level(PASS1);
 		}
+	if ((operation_type == LOAD_DECODED_IMAGE ||
+				operation_type == LOAD_FROM_CACHE) && error_text == NULL) {
+		is_file_loaded=1;				// previous image remains on error
+		ensure_processing_level(PASS1);
+		}
 
 	return 1;
 	}
 
-void interactive_image_processor_t::resize_line(
-					quantum_type *dest_p,const uint dest_size,
-					const uint *src_p,const uint src_size)
-{
-		//!!! mis siis kui src_size <= dest_size
-
-	uint  src_mult_value=0;		// src_x * dest_size
-	uint dest_mult_value=0;		// dest_x * src_size
-	for (const quantum_type * const dest_p_end=dest_p + 3*dest_size;
-											dest_p < dest_p_end;dest_p+=3) {
-		dest_mult_value+=src_size;
-		uint count=0;
-		uint dest_c0=0,dest_c1=0,dest_c2=0;
-		while (src_mult_value < dest_mult_value) {
-			dest_c0+=src_p[0];
-			dest_c1+=src_p[1];
-			dest_c2+=src_p[2];
-			src_p+=3;
-			src_mult_value+=dest_size;
-			count++;
-			}
-		if (count >= 2) {
-							//!!! optimeerida shifti ja muli/tabeliga
-			dest_p[0]=(quantum_type)(dest_c0 / count);
-			dest_p[1]=(quantum_type)(dest_c1 / count);
-			dest_p[2]=(quantum_type)(dest_c2 / count);
-			}
-		  else {
-			dest_p[0]=(quantum_type)dest_c0;
-			dest_p[1]=(quantum_type)dest_c1;
-			dest_p[2]=(quantum_type)dest_c2;
-			}
+void interactive_image_processor_t::average_2x2(quantum_type * const dest,
+				const quantum_type * const row0,
+				const quantum_type * const row1,const uint src_x_size)
+{			// dest has (src_x_size+1)/2 pixels; an odd last column is
+			//   averaged with itself
+
+	const uint dest_x_size=src_x_size / 2;
+	quantum_type *d=dest;
+	for (uint i=0;i < 3*2*dest_x_size;i+=6,d+=3) {
+		d[0]=(quantum_type)((row0[i  ] + row0[i+3] +
+									row1[i  ] + row1[i+3] + 2) >> 2);
+		d[1]=(quantum_type)((row0[i+1] + row0[i+4] +
+									row1[i+1] + row1[i+4] + 2) >> 2);
+		d[2]=(quantum_type)((row0[i+2] + row0[i+5] +
+									row1[i+2] + row1[i+5] + 2) >> 2);
+		}
+	if (src_x_size & 1) {
+		const uint i=3*(src_x_size-1);
+		d[0]=(quantum_type)((row0[i  ] + row1[i  ] + 1) >> 1);
+		d[1]=(quantum_type)((row0[i+1] + row1[i+1] + 1) >> 1);
+		d[2]=(quantum_type)((row0[i+2] + row1[i+2] + 1) >> 1);
+		}
+	}
+
+struct interactive_image_processor_t::pyramid_job_t :
+										public band_thread_pool_t::job_t {
+	interactive_image_processor_t &processor;
+	const uint undo_enh_shadows,generation;
+
+	pyramid_job_t(interactive_image_processor_t &_processor,
+				const uint _undo_enh_shadows,const uint _generation) :
+						processor(_processor),
+						undo_enh_shadows(_undo_enh_shadows),
+						generation(_generation) {}
+	virtual void process_band(const uint beg_row,const uint end_row)
+	{
+		processor.do_pyramid_rows(undo_enh_shadows,generation,
+															beg_row,end_row);
+		}
+	};
+
+void interactive_image_processor_t::do_pyramid_rows(
+				const uint undo_enh_shadows,const uint generation,
+				const uint beg_dest_y,const uint end_dest_y)
+{			// makes rows of pyramid level 0 from full-resolution rows;
+			//   returns early if the operation has been superseded
+
+	const pyramid_level_t &level=pyramid[0];
+	const uint src_x_size=image_reader.img.columns();
+	const uint src_y_size=image_reader.img.rows();
+
+	processing_phase1_t phase1(image_reader,undo_enh_shadows);
+	quantum_type * const row0=new quantum_type [src_x_size * 3];
+
+	for (uint dest_y=beg_dest_y;dest_y < end_dest_y;dest_y++) {
+		if (is_processing_superseded(generation))
+			break;
+
+		phase1.get_line(2*dest_y);
+		memcpy(row0,phase1.output_line,src_x_size * 3 * sizeof(*row0));
+		if (2*dest_y + 1 < src_y_size)
+			phase1.get_line(2*dest_y + 1);
+
+		average_2x2(level.img + dest_y*level.size.x*3,
+									row0,phase1.output_line,src_x_size);
+		}
+
+	delete [] row0;
+	}
+
+uint interactive_image_processor_t::build_pyramid(
+						const uint undo_enh_shadows,const uint generation)
+{			// returns 0 if the operation has been superseded
+
+	free_pyramid();
+
+	const vec<uint> src_size={image_reader.img.columns(),
+												image_reader.img.rows()};
+	if (src_size.x < 2*MIN_PYRAMID_LEVEL_SIZE ||
+									src_size.y < 2*MIN_PYRAMID_LEVEL_SIZE)
+		return 1;
+
+	pyramid_level_t &level0=pyramid[0];
+	level0.size.x=(src_size.x + 1) / 2;
+	level0.size.y=(src_size.y + 1) / 2;
+	level0.img=new quantum_type [level0.size.x * level0.size.y * 3];
+
+	pyramid_job_t job(*this,undo_enh_shadows,generation);
+	band_pool.run(job,level0.size.y,4);
+
+	if (is_processing_superseded(generation)) {
+		delete [] level0.img;
+		return 0;
+		}
+
+	nr_of_pyramid_levels=1;
+	pyramid_undo_enh_shadows=undo_enh_shadows;
+
+	while (nr_of_pyramid_levels < MAX_PYRAMID_LEVELS) {
+		const pyramid_level_t &src=pyramid[nr_of_pyramid_levels-1];
+		if (src.size.x < 2*MIN_PYRAMID_LEVEL_SIZE ||
+									src.size.y < 2*MIN_PYRAMID_LEVEL_SIZE)
+			break;
+
+		pyramid_level_t &dest=pyramid[nr_of_pyramid_levels++];
+		dest.size.x=(src.size.x + 1) / 2;
+		dest.size.y=(src.size.y + 1) / 2;
+		dest.img=new quantum_type [dest.size.x * dest.size.y * 3];
+
+		const uint src_row_len=src.size.x * 3;
+		for (uint y=0;y < dest.size.y;y++)
+			average_2x2(dest.img + y*dest.size.x*3,
+							src.img + 2*y*src_row_len,
+							src.img + min(2*y + 1,src.size.y - 1)*src_row_len,
+							src.size.x);
 		}
+
+	return 1;
 	}
 
-void interactive_image_processor_t::do_processing(const params_t par)
+void interactive_image_processor_t::free_pyramid(void)
 {
-	if ((sint)par.required_level >= (sint)NEW_LOWRES_BUF) {
+	for (uint k=0;k < nr_of_pyramid_levels;k++)
+		delete [] pyramid[k].img;
+	nr_of_pyramid_levels=0;
+	}
+
+struct interactive_image_processor_t::pass1_job_t :
+										public band_thread_pool_t::job_t {
+	interactive_image_processor_t &processor;
+	const params_t &par;
+	const resampler_t &resampler;
+	const uint generation;
+
+	pass1_job_t(interactive_image_processor_t &_processor,
+				const params_t &_par,const resampler_t &_resampler,
+				const uint _generation) :
+					processor(_processor), par(_par), resampler(_resampler),
+					generation(_generation) {}
+	virtual void process_band(const uint beg_row,const uint end_row)
+	{
+		processor.do_pass1_rows(par,resampler,generation,beg_row,end_row);
+		}
+	};
+
+struct interactive_image_processor_t::pass2_job_t :
+										public band_thread_pool_t::job_t {
+	const params_t &par;		// output_buf is rendered
+	const color_and_levels_processing_t &pass2;
+	const quantum_type * const src;
+	QMutex histogram_mutex;
+	histogram_t histogram;		// of all bands
+
+	pass2_job_t(const params_t &_par,
+				const color_and_levels_processing_t &_pass2,
+				const quantum_type * const _src) :
+									par(_par), pass2(_pass2), src(_src)
+		{ histogram.clear(); }
+	virtual void process_band(const uint beg_row,const uint end_row)
+	{			// each band has its own histogram, so the threads only
+				//   share one when adding theirs to it at the end
+
+		histogram_t band_histogram;
+		band_histogram.clear();
+
+		for (uint y=beg_row;y < end_row;y++)
+			pass2.process_pixels(par.output_buf +
+						y * par.working_x_size * par.dest_bytes_per_pixel,
+					src + y * par.working_x_size * 3,par.working_x_size,
+					par.output_in_BGR_format,par.dest_bytes_per_pixel,y,
+					&band_histogram);
+
+		mutex_locker_t req(&histogram_mutex);
+		histogram.add(band_histogram);
+		}
+	};
+
+void interactive_image_processor_t::do_pass1_rows(const params_t &par,
+				const resampler_t &resampler,const uint generation,
+				const uint beg_dest_y,const uint end_dest_y)
+{			// returns early if the operation has been superseded
+
+	struct phase1_row_source_t :
+						public resampler_t::row_source_t<quantum_type> {
+		interactive_image_processor_t &processor;
+		const params_t &par;
+		const uint generation;
+		processing_phase1_t phase1;
+
+		phase1_row_source_t(interactive_image_processor_t &_processor,
+						const params_t &_par,const uint _generation) :
+				processor(_processor), par(_par), generation(_generation),
+				phase1(_processor.image_reader,_par.undo_enh_shadows) {}
+
+		virtual const quantum_type *get_row(const uint y)
+		{
+			if (processor.is_processing_superseded(generation))
+				return NULL;
+			phase1.get_line(par.top_crop + y);
+			return phase1.output_line + par.left_crop*3;
+			}
+		} source(*this,par,generation);
+
+	resampler.resample_rows(lowres_phase1_image,source,
+													beg_dest_y,end_dest_y);
+	}
+
+histogram_t *interactive_image_processor_t::do_processing(params_t par,
+												const uint generation)
+{			// returns the histogram of the new frame, or NULL if superseded
+
+	required_level_t level=par.required_level;
+	if ((sint)level < (sint)cancelled_level)
+		level=cancelled_level;
+
+	if (is_processing_superseded(generation)) {
+		cancelled_level=level;
+		return NULL;
+		}
+	cancelled_level=PASS2;
+
+	if ((sint)level >= (sint)NEW_LOWRES_BUF) {
 		if (lowres_phase1_image != NULL)
 			delete [] lowres_phase1_image;
 		lowres_phase1_image=
 			new quantum_type [par.working_x_size * par.working_y_size * 3];
 		}
 
-	if ((sint)par.required_level >= (sint)PASS1) {
+	if ((sint)level >= (sint)PASS1) {
 #if MEASURE_PASS1_TIME
 		const clock_t tim=get_ms();
 #endif
-		processing_phase1_t phase1(image_reader,par.undo_enh_shadows);
-
+		const vec<uint> working_size={par.working_x_size,par.working_y_size};
 		const vec<uint> src_size=get_image_size(&par);
 
-		uint * const sum_buf=new uint [src_size.x * 3];
-		const uint * const sum_buf_end=sum_buf + (src_size.x * 3);
-
-			//!!! mis siis kui src_size.y <= par.working_y_size
-
-		phase1.skip_lines(par.top_crop);
-
-		uint  src_mult_value=0;		// src_y * dest_size
-		uint dest_mult_value=0;		// dest_y * src_size
-		for (uint dest_y=0;dest_y < par.working_y_size;dest_y++) {
-			dest_mult_value+=src_size.y;
-
-			memset(sum_buf,'\0',src_size.x * 3 * sizeof(*sum_buf));
-			uint count=0;
-			while (src_mult_value < dest_mult_value) {
-				phase1.get_line();
-				const quantum_type * const output_line_start=
-										phase1.output_line + par.left_crop*3;
-				const quantum_type * const output_line_end=
-										output_line_start + src_size.x*3;
-				uint *q=sum_buf;
-				for (const quantum_type *p=output_line_start;
-											p < output_line_end;p+=3,q+=3) {
-					q[0]+=p[0];
-					q[1]+=p[1];
-					q[2]+=p[2];
-					}
-
-				src_mult_value+=par.working_y_size;
-				count++;
-				}
-			if (count >= 2) {
-				if (!(count & (count-1))) {
-					uint shift=0;
-					for (;(1U << shift) < count;shift++)
-						;
-					for (uint *q=sum_buf;q < sum_buf_end;q+=3) {
-						q[0]>>=shift;
-						q[1]>>=shift;
-						q[2]>>=shift;
-						}
-					}
-				  else
-					for (uint *q=sum_buf;q < sum_buf_end;q+=3) {
-						q[0]/=count;		//!!! optimeerida muli ja tabeliga
-						q[1]/=count;
-						q[2]/=count;
-						}
-				}
-
-			resize_line(lowres_phase1_image + (dest_y*par.working_x_size*3),
-									par.working_x_size,sum_buf,src_size.x);
+			// the pyramid is only built when level 0 would be used, as
+			//   building it takes a full-resolution pass
+
+		if (image_reader.is_loading_complete() &&
+					(!nr_of_pyramid_levels ||
+						pyramid_undo_enh_shadows != par.undo_enh_shadows) &&
+					src_size.x >= 2*working_size.x &&
+					src_size.y >= 2*working_size.y &&
+					!build_pyramid(par.undo_enh_shadows,generation)) {
+			cancelled_level=PASS1;
+			return NULL;
 			}
 
-		delete [] sum_buf;
+			// the smallest pyramid level which still has at least
+			//   working_size pixels in the cropped area
+
+		uint k=nr_of_pyramid_levels;
+		while (k && (src_size.x < (2U << (k-1)) * working_size.x ||
+							src_size.y < (2U << (k-1)) * working_size.y))
+			k--;
+
+		if (k) {
+			const pyramid_level_t &pyramid_level=pyramid[k-1];
+			const uint f=2U << (k-1);		// level pixel size
+			const uint left=min((par.left_crop + f/2) / f,
+												pyramid_level.size.x - 1);
+			const uint top=min((par.top_crop + f/2) / f,
+												pyramid_level.size.y - 1);
+			const vec<uint> level_src_size={
+					max(min((par.left_crop + src_size.x + f/2) / f,
+								pyramid_level.size.x),left + 1) - left,
+					max(min((par.top_crop + src_size.y + f/2) / f,
+								pyramid_level.size.y),top + 1) - top};
+
+			const resampler_t resampler(level_src_size,working_size);
+			resampler_t::image_row_source_t<quantum_type> source(
+					pyramid_level.img + (top*pyramid_level.size.x + left)*3,
+					pyramid_level.size.x * 3);
+			resampler.resample_rows(lowres_phase1_image,source,
+													0,working_size.y);
+			}
+		  else {
+			const resampler_t resampler(src_size,working_size);
+			pass1_job_t job(*this,par,resampler,generation);
+			if (image_reader.is_loading_complete())
+				band_pool.run(job,par.working_y_size,4);
+			  else
+				job.process_band(0,par.working_y_size);
+					// rows still arrive from the stream, in order
+			}
 
 #if MEASURE_PASS1_TIME
 		printf("pass1: processing time %dms\n",(int)(get_ms() - tim));
 #endif
 		}
 
-	if ((sint)par.required_level >= (sint)PASS2) {
+	if (is_processing_superseded(generation)) {
+		if ((sint)level >= (sint)PASS1)
+			cancelled_level=PASS1;	// lowres_phase1_image is incomplete
+		return NULL;
+		}
+
+	if ((sint)level >= (sint)PASS2) {
 #if MEASURE_PASS2_TIME
 		const clock_t tim=get_ms();
 #endif
@@ -428,17 +1105,21 @@ void interactive_image_processor_t::do_processing(const params_t par)
 #if MEASURE_PASS2_TIME
 		const clock_t init_time=get_ms();
 #endif
-		pass2.process_pixels(par.output_buf,lowres_phase1_image,
-					par.working_x_size * par.working_y_size,
-					par.output_in_BGR_format,par.dest_bytes_per_pixel);
+		par.output_buf=par.output_bufs[back_output_buf];
+		pass2_job_t job(par,pass2,lowres_phase1_image);
+		band_pool.run(job,par.working_y_size,16);
 		// draw_gamma_test_image(par);
 		// draw_processing_curve(par);
+		publish_output_buf();
 
 #if MEASURE_PASS2_TIME
 		printf("pass2: init time: %dms processing time: %dms\n",
 						(int)(init_time - tim),(int)(get_ms() - init_time));
 #endif
+		return new histogram_t(job.histogram);
 		}
+
+	return NULL;
 	}
 
 void interactive_image_processor_t::draw_gamma_test_image(const params_t par) const
@@ -511,6 +1192,66 @@ void interactive_image_processor_t::draw_processing_curve(const params_t par) co
 		}
 	}
 
+struct interactive_image_processor_t::fullres_job_t :
+										public band_thread_pool_t::job_t {
+	image_reader_t &image_reader;
+	const params_t &par;
+	const color_and_levels_processing_t * const pass2;	// NULL if lut is used
+	const pipeline_lut_t * const lut;
+	uchar * const buf;
+	const uint x_size;
+
+	fullres_job_t(image_reader_t &_image_reader,const params_t &_par,
+				const color_and_levels_processing_t * const _pass2,
+				const pipeline_lut_t * const _lut,
+				uchar * const _buf,const uint _x_size) :
+						image_reader(_image_reader), par(_par),
+						pass2(_pass2), lut(_lut), buf(_buf), x_size(_x_size) {}
+
+	virtual void process_band(const uint beg_row,const uint end_row)
+	{
+		if (pass2 == NULL) {
+			const image_buffer_t &img=image_reader.img;
+			const uint step=img.pixel_step();
+			for (uint y=beg_row;y < end_row;y++) {
+				const uint k=par.left_crop * step;
+				lut->process_pixels(buf + y*x_size*3,
+						img.channel_row(0,par.top_crop + y) + k,
+						img.channel_row(1,par.top_crop + y) + k,
+						img.channel_row(2,par.top_crop + y) + k,
+						step,x_size,1,3,y);
+				}
+			return;
+			}
+
+		processing_phase1_t phase1(image_reader,par.undo_enh_shadows);
+		phase1.skip_lines(par.top_crop + beg_row);
+
+		for (uint y=beg_row;y < end_row;y++) {
+			phase1.get_line();
+			pass2->process_pixels(buf + y*x_size*3,
+							phase1.output_line + 3*par.left_crop,x_size,1,3,y);
+			}
+		}
+	};
+
+struct interactive_image_processor_t::resize_job_t :
+										public band_thread_pool_t::job_t {
+	const resampler_t &resampler;
+	const uchar * const src;
+	uchar * const dest;
+
+	resize_job_t(const resampler_t &_resampler,
+							const uchar * const _src,uchar * const _dest) :
+						resampler(_resampler), src(_src), dest(_dest) {}
+	virtual void process_band(const uint beg_row,const uint end_row)
+	{
+		resampler_t::image_row_source_t<uchar> source(src,
+												resampler.src_size.x * 3);
+		resampler.resample_rows(dest,source,beg_row,end_row);
+		}
+	};
+
 void interactive_image_processor_t::do_fullres_processing(
 							const params_t par,const char * const fname)
 {
@@ -522,35 +1263,70 @@ void interactive_image_processor_t::do_fullres_processing(
 
 	const vec<uint> image_size=get_image_size(&par);
 
-	uchar * const buf=new uchar[image_size.x*image_size.y*3];
+	uchar *buf=new uchar[image_size.x*image_size.y*3];
 
-	processing_phase1_t phase1(image_reader,par.undo_enh_shadows);
-	const color_and_levels_processing_t pass2(par.color_and_levels_params);
+		// the rows can then be read in any order; those of a bottom crop
+		//   are left to be read between commands
+
+	image_reader.ensure_rows_loaded(par.top_crop + image_size.y);
+
+	color_and_levels_processing_t::params_t color_and_levels_params=
+												par.color_and_levels_params;
+	color_and_levels_params.show_clipping=0;	// the overlay is for previews
 
-	phase1.skip_lines(par.top_crop);
+	color_and_levels_processing_t *pass2=NULL;
 
-	for (uint y=0;y < image_size.y;y++) {
-		phase1.get_line();
-		pass2.process_pixels(buf + y*image_size.x*3,
-					phase1.output_line + 3*par.left_crop,image_size.x,1);
+#if USE_PIPELINE_LUT_FOR_FULLRES
+		// the table is kept for the next image, as batch saving uses the
+		//   same parameters for every image
+
+	if (fullres_lut != NULL && !fullres_lut->is_built_for(image_reader,
+						par.undo_enh_shadows,color_and_levels_params)) {
+		delete fullres_lut;
+		fullres_lut=NULL;
 		}
 
-	Magick::Image output_img(image_size.x,image_size.y,
-												"BGR",Magick::CharPixel,buf);
-	delete [] buf;
+	if (fullres_lut == NULL &&
+				pipeline_lut_t::is_supported(color_and_levels_params)) {
+		pass2=new color_and_levels_processing_t(color_and_levels_params);
+		fullres_lut=new pipeline_lut_t(image_reader,par.undo_enh_shadows,
+																	*pass2);
+		}
+	if (fullres_lut != NULL && pass2 != NULL) {
+		delete pass2;
+		pass2=NULL;
+		}
+#endif
 
-	if (par.fullres_resize_size.x && par.fullres_resize_size.y) {
-		vec<uint> resize_size=par.fullres_resize_size;
-		if ((resize_size.x < resize_size.y) != (image_size.x < image_size.y))
-			resize_size.exchange_components();
+	if (fullres_lut == NULL && pass2 == NULL)
+		pass2=new color_and_levels_processing_t(color_and_levels_params);
+
+	fullres_job_t job(image_reader,par,pass2,fullres_lut,buf,image_size.x);
+	band_pool.run(job,image_size.y,16);
 
-		Magick::Geometry resize_geo(resize_size.x,resize_size.y);
-		resize_geo.aspect((bool)1);
+	if (pass2 != NULL)
+		delete pass2;
 
-		output_img.filterType(Magick::LanczosFilter);
-		output_img.zoom(resize_geo);
+	vec<uint> output_size=image_size;
+	if (par.fullres_resize_size.x && par.fullres_resize_size.y) {
+		output_size=par.fullres_resize_size;
+		if ((output_size.x < output_size.y) != (image_size.x < image_size.y))
+			output_size.exchange_components();
+
+		const resampler_t resampler(image_size,output_size,
+													resampler_t::LANCZOS3);
+		uchar * const resized_buf=new uchar[output_size.x*output_size.y*3];
+		resize_job_t resize_job(resampler,buf,resized_buf);
+		band_pool.run(resize_job,output_size.y,16);
+
+		delete [] buf;
+		buf=resized_buf;
 		}
 
+	Magick::Image output_img(output_size.x,output_size.y,
+												"BGR",Magick::CharPixel,buf);
+	delete [] buf;
+
 	if (par.unsharp_mask_radius > 0) {
 		float amount=0.7f;
 		float threshold=5.0f / 255;
@@ -568,6 +1344,113 @@ void interactive_image_processor_t::do_fullres_processing(
 	output_img.write(fname);
 	}
 
+struct interactive_image_processor_t::tile_phase1_job_t :
+										public band_thread_pool_t::job_t {
+	image_reader_t &image_reader;
+	const phase1_tile_t &tile;
+	const vec<uint> beg;		// tile position in the image
+
+	tile_phase1_job_t(image_reader_t &_image_reader,
+					const phase1_tile_t &_tile,const vec<uint> &_beg) :
+				image_reader(_image_reader), tile(_tile), beg(_beg) {}
+	virtual void process_band(const uint beg_row,const uint end_row)
+	{
+		processing_phase1_t phase1(image_reader,tile.undo_enh_shadows);
+		for (uint y=beg_row;y < end_row;y++) {
+			phase1.get_line_part(beg.y + y,beg.x,tile.size.x);
+			memcpy(tile.img + y * tile.size.x * 3,phase1.output_line,
+						tile.size.x * 3 * sizeof(*phase1.output_line));
+			}
+		}
+	};
+
+const interactive_image_processor_t::phase1_tile_t &
+			interactive_image_processor_t::get_phase1_tile(
+						const uint tile_pos,const uint undo_enh_shadows)
+{			// the tile must be within the image, and its rows loaded
+
+	tile_use_count++;
+
+	uint lru_i=0;
+	for (uint i=0;i < MAX_PHASE1_TILES;i++) {
+		phase1_tile_t &tile=phase1_tiles[i];
+		if (tile.img != NULL && tile.tile_pos == tile_pos &&
+								tile.undo_enh_shadows == undo_enh_shadows) {
+			tile.last_use=tile_use_count;
+			return tile;
+			}
+		if (phase1_tiles[lru_i].img != NULL && (tile.img == NULL ||
+							tile.last_use < phase1_tiles[lru_i].last_use))
+			lru_i=i;
+		}
+
+	phase1_tile_t &tile=phase1_tiles[lru_i];
+	if (tile.img != NULL)
+		delete [] tile.img;
+
+	const vec<uint> beg={	(tile_pos & 0xffff) * TILE_SIZE,
+							(tile_pos >> 16)    * TILE_SIZE};
+	tile.size.x=min((uint)TILE_SIZE,image_reader.img.columns() - beg.x);
+	tile.size.y=min((uint)TILE_SIZE,image_reader.img.rows()    - beg.y);
+	tile.img=new quantum_type [tile.size.x * tile.size.y * 3];
+	tile.tile_pos=tile_pos;
+	tile.undo_enh_shadows=undo_enh_shadows;
+	tile.last_use=tile_use_count;
+
+	tile_phase1_job_t job(image_reader,tile,beg);
+	band_pool.run(job,tile.size.y,16);
+
+	return tile;
+	}
+
+void interactive_image_processor_t::free_phase1_tiles(void)
+{
+	for (uint i=0;i < MAX_PHASE1_TILES;i++)
+		if (phase1_tiles[i].img != NULL) {
+			delete [] phase1_tiles[i].img;
+			phase1_tiles[i].img=NULL;
+			}
+	}
+
+void interactive_image_processor_t::do_render_tile(const params_t &par,
+							const uint tile_pos,uchar * const dest)
+{
+	const vec<uint> beg={	(tile_pos & 0xffff) * TILE_SIZE,
+							(tile_pos >> 16)    * TILE_SIZE};
+	if (beg.x >= image_reader.img.columns() ||
+									beg.y >= image_reader.img.rows())
+		return;
+
+		// rows of the tile can then be read in any order; the ones below
+		//   it are left to be read between commands. image_load_mutex is
+		//   not needed, as other threads only see the completion through
+		//   is_loading_complete()
+
+	image_reader.ensure_rows_loaded(
+						min(beg.y + TILE_SIZE,image_reader.img.rows()));
+
+	const phase1_tile_t &tile=get_phase1_tile(tile_pos,par.undo_enh_shadows);
+
+	if (tile_pass2 != NULL && memcmp(&tile_pass2->params,
+							&par.color_and_levels_params,
+							sizeof(par.color_and_levels_params))) {
+		delete tile_pass2;
+		tile_pass2=NULL;
+		}
+	if (tile_pass2 == NULL)
+		tile_pass2=new color_and_levels_processing_t(
+											par.color_and_levels_params);
+
+		// tiles start at multiples of TILE_SIZE, so position dithering
+		//   matches across tile borders
+
+	for (uint y=0;y < tile.size.y;y++)
+		tile_pass2->process_pixels(
+				dest + y * TILE_SIZE * par.dest_bytes_per_pixel,
+				tile.img + y * tile.size.x * 3,tile.size.x,
+				par.output_in_BGR_format,par.dest_bytes_per_pixel,beg.y + y);
+	}
+
 vec<uint> interactive_image_processor_t::get_image_size(const params_t *par)
 {
 	if (par == NULL)
@@ -585,6 +1468,15 @@ vec<uint> interactive_image_processor_t::get_image_size(const params_t *par)
 	return image_size;
 	}
 
+vec<uint> interactive_image_processor_t::get_uncropped_image_size(void)
+{
+	mutex_locker_t req(&image_load_mutex);
+
+	const vec<uint> image_size={image_reader.img.columns(),
+												image_reader.img.rows()};
+	return image_size;
+	}
+
 vec<float> interactive_image_processor_t::get_full_frame_pos_fraction(
 											const vec<float> pos_fraction)
 {
@@ -660,3 +1552,84 @@ image_reader_t::shooting_info_t interactive_image_processor_t::
 	mutex_locker_t req(&image_load_mutex);
 	return image_reader.shooting_info;
 	}
+
+static double get_time_s(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv,NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+	}
+
+template <class queue_t> class queue_sink_thread_t : public QThread {
+		// reads messages until an empty one, echoing them if echo_out is
+		//   not NULL
+
+	queue_t &in;
+	queue_t * const echo_out;
+
+	virtual void run(void)
+	{
+		while (1) {
+			uint len;
+			void * const ptr=in.Read(len);
+			if (echo_out != NULL)
+				echo_out->Write(ptr,len);
+			in.Release(ptr);
+			if (!len)
+				break;
+			}
+		}
+
+	public:
+	queue_sink_thread_t(queue_t &_in,queue_t * const _echo_out=NULL) :
+											in(_in), echo_out(_echo_out) {}
+	};
+
+template <class queue_t> static void benchmark_queue(const char * const name,
+						queue_t &queue1,queue_t &queue2,const uint msg_size)
+{
+	char * const msg=new char [msg_size];
+	memset(msg,'\0',msg_size);
+
+	const uint nr_of_messages=100000;
+	queue_sink_thread_t<queue_t> sink(queue1);
+	sink.start();
+	double start_time=get_time_s();
+	for (uint i=0;i < nr_of_messages;i++)
+		queue1.Write(msg,msg_size);
+	queue1.Write(NULL,0);
+	sink.wait();
+	const double throughput=nr_of_messages / (get_time_s() - start_time);
+
+	const uint nr_of_round_trips=20000;
+	queue_sink_thread_t<queue_t> echo(queue1,&queue2);
+	echo.start();
+	uint len;
+	start_time=get_time_s();
+	for (uint i=0;i < nr_of_round_trips;i++) {
+		queue1.Write(msg,msg_size);
+		queue2.Release(queue2.Read(len));
+		}
+	const double round_trip_us=
+					(get_time_s() - start_time) * 1e6 / nr_of_round_trips;
+	queue1.Write(NULL,0);
+	queue2.Release(queue2.Read(len));
+	echo.wait();
+
+	printf("%-12s %u-byte messages: %8.0f messages/s, "
+						"%6.2f us per round trip\n",
+						name,msg_size,throughput,round_trip_us);
+	delete [] msg;
+	}
+
+void interactive_image_processor_t::benchmark_queues(void)
+{
+	{
+	SyncQueue queue1,queue2;
+	benchmark_queue("SyncQueue",queue1,queue2,sizeof(cmd_packet_t));
+	}
+
+	spsc_ring_t queue1(sizeof(cmd_packet_t),MAX_PENDING_OPERATIONS);
+	spsc_ring_t queue2(sizeof(cmd_packet_t),MAX_PENDING_OPERATIONS);
+	benchmark_queue("spsc_ring_t",queue1,queue2,sizeof(cmd_packet_t));
+	}
@@ -27,11 +27,143 @@ class SyncQueue {
 	void Release(void *ptr) {delete [] (char *)ptr;}
 };
 
-class interactive_image_processor_t : public QThread, public SyncQueue {
+class spsc_ring_t {
+		// fixed-capacity message queue for exactly one writer thread and
+		//   one reader thread, with the interface of SyncQueue; slots are
+		//   preallocated and their indices are updated without locking,
+		//   so the mutex is only taken by a thread which has to sleep
+		//   (reader on an empty ring, writer on a full one) and by the
+		//   thread which then wakes it up
+
+	const uint slot_size;
+	const uint nr_of_slots;		// power of 2
+	char *slots;
+	uint *lens;
+
+	volatile uint write_count;	// wraps around; written by writer only
+	char write_count_padding[64];	// keeps the counts in separate cache lines
+	volatile uint read_count;	// wraps around; written by reader only
+	char read_count_padding[64];
+	uint peek_count;			// read_count + nr of unreleased messages
+
+	uint spin_count;			// checks before sleeping
+	volatile uint nr_of_sleepers;	// 0..1
+	QMutex mutex;
+	QWaitCondition cond;
+
+	static uint get_power_of_2_at_least(const uint value);
+	void wait_while_equal(const volatile uint &count,const uint value);
+	void wake_sleepers(void);
+
+	public:
+	spsc_ring_t(const uint _slot_size,const uint min_nr_of_slots);
+	~spsc_ring_t(void);
+	void Write(const void *ptr,uint len);
+		// len must be at most slot_size; waits while the ring is full
+	void *Read(uint &len,const uint no_wait=0);
+		// returns a pointer into the message's slot, or NULL if no_wait
+		//   is set and the ring is empty
+	void Release(void *ptr);
+		// frees the slot of the oldest unreleased message; messages are
+		//   released in the order they were read
+	};
+
+class decoded_image_t {
+		// image decoded from PPM data outside interactive_image_processor_t,
+		//   for example from a low-priority background dcraw process
+
+	QMutex mutex;
+	QWaitCondition cond;
+	ppm_image_decoder_t *decoder;	// NULL when decoding has finished
+	uint is_image_valid;			// 0 or 1
+
 	public:
 
-	enum operation_type_t {LOAD_FILE=0,LOAD_FROM_MEMORY,
-			LOAD_FROM_MEMORY_AND_DELETE_FILE,PROCESSING,FULLRES_PROCESSING};
+	image_buffer_t img;
+	char shooting_info_fname[300];
+	char cache_key[image_cache_t::KEY_SIZE];	// empty if not to be saved
+
+	decoded_image_t(const char * const _shooting_info_fname,
+										const char * const _cache_key=NULL);
+	~decoded_image_t(void);
+
+	void feed(const void * const data,const uint len);
+	void finish(void);
+		// called once when there is no more data; if the image is not
+		//   complete by then, it is not valid
+	uint is_finished(void);
+	uint is_valid(void);
+	uint get_size_in_bytes(void) const { return img.get_size_in_bytes(); }
+			// only in the thread which calls feed()
+	uint wait_until_finished(void);
+		// returns nonzero if a complete image was decoded
+	};
+
+class band_thread_pool_t {
+		// runs a job on bands of rows in several threads at once; the
+		//   thread which calls run() processes bands as well
+
+	public:
+
+	struct job_t {
+		virtual void process_band(const uint beg_row,const uint end_row)=0;
+			// called concurrently for disjoint ranges of rows
+		};
+
+	private:
+
+	class worker_t : public QThread {
+		band_thread_pool_t &pool;
+		virtual void run(void);
+		public:
+		worker_t(band_thread_pool_t &_pool) : pool(_pool) {}
+		};
+
+	QMutex mutex;
+	QWaitCondition job_cond,done_cond;
+	worker_t **workers;
+	uint nr_of_workers;
+	uint is_shutting_down;		// 0 or 1
+
+	job_t *job;					// NULL if no job is running
+	uint job_id;				// incremented for every job
+	uint nr_of_rows,rows_per_band,next_row;
+	uint nr_of_busy_workers;
+
+	void process_bands(void);
+		// mutex must be locked; unlocks it while processing each band
+
+	public:
+
+	band_thread_pool_t(uint nr_of_threads=0);
+		// 0 means one thread per online CPU
+	~band_thread_pool_t(void);
+
+	uint get_nr_of_threads(void) const { return nr_of_workers + 1; }
+	void run(job_t &_job,const uint _nr_of_rows,
+										const uint min_rows_per_band=1);
+		// returns when all rows 0.._nr_of_rows-1 have been processed
+	};
+
+class interactive_image_processor_t : public QThread,
+								private image_reader_t::stream_source_t {
+	public:
+
+	enum operation_type_t {LOAD_FILE=0,LOAD_FROM_STREAM,LOAD_DECODED_IMAGE,
+						LOAD_FROM_CACHE,PROCESSING,FULLRES_PROCESSING,
+						RENDER_TILE};
+			// LOAD_DECODED_IMAGE takes a decoded_image_t as param_ptr; it
+			//   waits until the image is finished, swaps it in and then
+			//   deletes the decoded_image_t
+			// LOAD_FROM_STREAM and LOAD_FROM_CACHE take a new []'d
+			//   image_cache_t key, or NULL, as param_ptr
+			// RENDER_TILE renders full-resolution tile column
+			//   param_uint & 0xffff, row param_uint >> 16 of the uncropped
+			//   image into param_ptr, which has TILE_SIZE rows of TILE_SIZE
+			//   pixels in the working res output format; tiles at the
+			//   right and bottom edges only fill part of it
+	enum {TILE_SIZE=256};
+	enum {NR_OF_OUTPUT_BUFS=3};		// working res frames, triple buffered
 	struct notification_receiver_t {
 		virtual void operation_completed(void)=0;
 			// called in interactive_image_processor_t's thread
@@ -43,13 +175,21 @@ class interactive_image_processor_t : public QThread, public SyncQueue {
 	QMutex image_load_mutex;
 	image_reader_t image_reader;
 	quantum_type *lowres_phase1_image;		// 2.0-gamma RGB quantums
-	SyncQueue results_queue;
+	band_thread_pool_t band_pool;
+	pipeline_lut_t *fullres_lut;	// NULL if none has been built
+	spsc_ring_t cmd_queue;		// of cmd_packet_t, from the GUI thread
+	spsc_ring_t results_queue;	// of result_t, to the GUI thread
+	SyncQueue stream_queue;		// PPM data chunks for LOAD_FROM_STREAM
+	QMutex generation_mutex;
+	uint processing_generation;	// of the latest PROCESSING operation
 
 	enum required_level_t {PASS2=0,PASS1,NEW_LOWRES_BUF};
 
 	struct params_t {
 		required_level_t required_level;
-		uchar *output_buf;
+		uchar *output_bufs[NR_OF_OUTPUT_BUFS];
+		uchar *output_buf;			// the frame being rendered; set by
+									//   do_processing()
 		uint output_in_BGR_format;	// 0 or 1
 		uint dest_bytes_per_pixel;	// usually 3 or 4
 		uint working_x_size,working_y_size;
@@ -60,6 +200,58 @@ class interactive_image_processor_t : public QThread, public SyncQueue {
 		float unsharp_mask_radius;			// <=0 if no unsharp mask
 		} params;
 
+	struct pyramid_level_t {
+		quantum_type *img;		// 2.0-gamma RGB quantums, as from PASS1
+		vec<uint> size;
+		};
+	enum {MAX_PYRAMID_LEVELS=12,MIN_PYRAMID_LEVEL_SIZE=32};
+	pyramid_level_t pyramid[MAX_PYRAMID_LEVELS];
+		// level k is the uncropped image at 1/2^(k+1) of its size; PASS1
+		//   builds the levels once the image has been loaded, and takes
+		//   new working sizes and crops from them until the next load
+	uint nr_of_pyramid_levels;		// 0 if there is no pyramid
+	uint pyramid_undo_enh_shadows;
+
+	required_level_t cancelled_level;
+		// work left undone by superseded PROCESSING operations; only
+		//   accessed in interactive_image_processor_t's thread
+
+	uint fullres_top_crop,fullres_bottom_crop;
+	uint fullres_left_crop,fullres_right_crop;
+			// as given to set_crop(); params has them divided by
+			//   loaded_image_divisor, so that a crop can be edited on a
+			//   half-res image and still applies exactly to the full-res
+			//   one. Only accessed by the GUI thread
+	uint loaded_image_divisor;		// 2 for a half-res image, otherwise 1
+	void apply_crop(void);
+
+		// output_bufs are triple buffered: PROCESSING renders a frame into
+		//   the back buffer and then exchanges it with the ready one, and
+		//   the GUI thread exchanges its front buffer with the ready one
+		//   when that has a new frame. Neither thread waits for the other,
+		//   and the frame being displayed is never written to
+
+	enum {NEW_FRAME_FLAG=0x100};
+	volatile uint ready_output_buf;	// index | NEW_FRAME_FLAG if not taken
+	uint back_output_buf;			// accessed by the worker thread, and
+									//   reset by set_working_res()
+	uint front_output_buf;			// only accessed by the GUI thread
+
+	struct phase1_tile_t {
+		quantum_type *img;		// 2.0-gamma RGB quantums, rows of
+								//   size.x pixels; NULL if slot is free
+		vec<uint> size;
+		uint tile_pos;			// param_uint of RENDER_TILE
+		uint undo_enh_shadows;
+		uint last_use;			// tile_use_count when last used
+		};
+	enum {MAX_PHASE1_TILES=64};
+	phase1_tile_t phase1_tiles[MAX_PHASE1_TILES];
+		// RENDER_TILE keeps the phase1 data of recently rendered tiles,
+		//   so that new color and levels params only take a PASS2 of them
+	uint tile_use_count;
+	color_and_levels_processing_t *tile_pass2;	// NULL if none built yet
+
 	struct cmd_packet_t {
 		operation_type_t operation_type;
 		params_t params;
@@ -71,22 +263,51 @@ class interactive_image_processor_t : public QThread, public SyncQueue {
 	struct result_t {
 		operation_type_t operation_type;
 		char *error_text;
+		histogram_t *histogram;		// of a new PROCESSING frame, or NULL
 		};
 
+	enum { MAX_PENDING_OPERATIONS=64 };
+		// size of both rings; the GUI thread would block in
+		//   start_operation() if more operations were pending
+
 	void ensure_processing_level(const required_level_t level);
+	uint is_processing_superseded(const uint generation);
 
 	virtual void run(void);
+	virtual uint read_stream_data(const void * &data);
+	virtual void release_stream_data(const void * const data);
 
-	void do_processing(const params_t par);
+	struct pyramid_job_t;
+	static void average_2x2(quantum_type * const dest,
+				const quantum_type * const row0,
+				const quantum_type * const row1,const uint src_x_size);
+	void do_pyramid_rows(const uint undo_enh_shadows,const uint generation,
+							const uint beg_dest_y,const uint end_dest_y);
+	uint build_pyramid(const uint undo_enh_shadows,const uint generation);
+	void free_pyramid(void);
+	struct pass1_job_t;
+	struct pass2_job_t;
+	void do_pass1_rows(const params_t &par,
+				const resampler_t &resampler,const uint generation,
+				const uint beg_dest_y,const uint end_dest_y);
+	histogram_t *do_processing(params_t par,const uint generation);
+	struct fullres_job_t;
+	struct resize_job_t;
 	void do_fullres_processing(const params_t par,const char * const fname);
+	struct tile_phase1_job_t;
+	const phase1_tile_t &get_phase1_tile(const uint tile_pos,
+											const uint undo_enh_shadows);
+	void free_phase1_tiles(void);
+	void do_render_tile(const params_t &par,const uint tile_pos,
+											uchar * const dest);
+	void publish_output_buf(void);
 	void draw_processing_curve(const params_t par) const;
 	void draw_gamma_test_image(const params_t par) const;
-	static void resize_line(quantum_type *dest_p,const uint dest_size,
-							const uint *src_p,const uint src_size);
 	vec<float> get_full_frame_pos_fraction(const vec<float> pos_fraction);
 	public:
 
 	uint operation_pending_count;	// 0..
+	uint processing_pending_count;	// 0..operation_pending_count
 	uint is_processing_necessary;	// 0 or 1
 	uint is_file_loaded;			// 0 or 1
 
@@ -95,11 +316,28 @@ class interactive_image_processor_t : public QThread, public SyncQueue {
 	~interactive_image_processor_t(void);
 
 	void set_working_res(const uint x_size,const uint y_size,
-				uchar * const output_buf,const uint output_in_BGR_format=0,
+				uchar * const output_bufs[NR_OF_OUTPUT_BUFS],
+				const uint output_in_BGR_format=0,
 				const uint dest_bytes_per_pixel=3);
+			// only when no operations are pending, as the frames in
+			//   output_bufs are then replaced
+	uint get_output_buf_to_display(void);
+			// returns the index of the output_bufs frame which has the
+			//   latest completed PROCESSING output; it is not written to
+			//   until the next call. Only called in the GUI thread
 	void set_enh_shadows(const uint _undo_enh_shadows);
 	void set_crop(	const uint top_pixels,const uint bottom_pixels,
 					const uint left_pixels,const uint right_pixels);
+			// in full-res pixels
+	void get_crop(	uint &top_pixels,uint &bottom_pixels,
+					uint &left_pixels,uint &right_pixels) const;
+			// in pixels of the loaded image, as the crop is applied to it
+	void set_loaded_image_divisor(const uint divisor);
+			// 2 if the image whose load operation is started next is in
+			//   half resolution, otherwise 1; operations started after
+			//   this call get the crop scaled for that image
+	uint get_loaded_image_divisor(void) const
+										{ return loaded_image_divisor; }
 	void set_color_and_levels_params(
 					const color_and_levels_processing_t::params_t &_params);
 	void set_fullres_processing_params(
@@ -109,11 +347,29 @@ class interactive_image_processor_t : public QThread, public SyncQueue {
 	void start_operation(const operation_type_t operation_type,
 				const char * const fname=NULL,void * const param_ptr=NULL,
 				const uint param_uint=0);
+			// starting a PROCESSING operation cancels the PROCESSING
+			//   operations still pending; they complete early without
+			//   a new frame to display
+	uint is_processing_supersedable(void) const
+			{ return operation_pending_count == processing_pending_count &&
+									processing_pending_count < 2; }
+			// nonzero if a new PROCESSING operation can be started now
+			//   although others are pending; at most one waits behind
+			//   the one being cancelled
+	void write_stream_data(const void * const data,const uint len);
+	void end_stream(void) { stream_queue.Write(NULL,0); }
+			// LOAD_FROM_STREAM reads a PPM image from data written here;
+			//   it completes as soon as the PPM header has been read, and
+			//   rows are then read on demand until end_stream() is called
 	uint get_operation_results(operation_type_t &operation_type,
-														char * &error_text);
+						char * &error_text,histogram_t ** const histogram=NULL);
 			// returns 0 if no operation results are available
 			// error_text has to be delete []'d by caller
+			// if histogram is not NULL, it is set to the histogram of the
+			//   frame made by a PROCESSING operation, or to NULL if there
+			//   is none; the histogram has to be deleted by caller
 	vec<uint> get_image_size(const params_t *par=NULL);
+	vec<uint> get_uncropped_image_size(void);
 	void get_spot_values(const vec<float> pos_fraction,
 													uint values_in_file[3]);
 	uint get_rectilinear_angles(const vec<float> pos_fraction,
@@ -121,4 +377,8 @@ class interactive_image_processor_t : public QThread, public SyncQueue {
 			// returns nonzero and sets dest if angles can be calculated;
 			//   otherwise returns 0
 	image_reader_t::shooting_info_t get_shooting_info(void);
+
+	static void benchmark_queues(void);
+		// prints message latency and throughput of SyncQueue and
+		//   spsc_ring_t, for messages of sizeof(cmd_packet_t)
 	};
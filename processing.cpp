@@ -3,14 +3,45 @@
 */
 
 #include <string.h>
+#include <stdlib.h>
 #include <stdio.h>
 #include <float.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <utime.h>
+#include <pthread.h>
+#include <new>
+#include <vector>
+#include <algorithm>
 #include "processing.hpp"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define AVX2_KERNELS	1
+#define AVX2_FUNCTION	__attribute__((target("avx2")))
+#else
+#define AVX2_KERNELS	0
+#endif
+
+#if AVX2_KERNELS
+static inline uint has_avx2(void)
+{			// the AVX2 kernels are compiled also without -mavx2, and are
+			//   only called if the CPU has it; SSE2 loops take over otherwise
+#if defined(__AVX2__)
+	return 1;
+#else
+	static const uint is_supported=(__builtin_cpu_init(),
+								__builtin_cpu_supports("avx2") ? 1 : 0);
+	return is_supported;
+#endif
+	}
+#endif
+
 static double determinant3(	const vec3d<double> &col1,
 							const vec3d<double> &col2,
 							const vec3d<double> &col3)
@@ -375,333 +406,1366 @@ uint crw_reader_t::open_file(const char * const fname)
 
 /***************************************************************************/
 /****************************                  *****************************/
-/**************************** image_reader_t:: *****************************/
+/**************************** image_buffer_t:: *****************************/
 /****************************                  *****************************/
 /***************************************************************************/
 
-image_reader_t::image_reader_t(void) :
-									Lab_converter(NULL), gamma_table(NULL) {}
+#define IMAGE_BUFFER_LAYOUT			image_buffer_t::INTERLEAVED
+#define IMAGE_BUFFER_ROW_ALIGNMENT	64		// bytes
 
-image_reader_t::image_reader_t(const char * const fname) :
-									Lab_converter(NULL), gamma_table(NULL)
-{
-	load_file(fname);
+void image_buffer_t::allocate(const uint _x_size,const uint _y_size,
+												const layout_t _layout)
+{			// contents of the allocated image are undefined
+	release();
+
+	x_size=_x_size;
+	y_size=_y_size;
+	layout=_layout;
+
+	const uint row_alignment=IMAGE_BUFFER_ROW_ALIGNMENT / sizeof(*buf);
+	row_stride=x_size * ((layout == PLANAR) ? 1 : 3);
+	row_stride=(row_stride + row_alignment-1) & ~(row_alignment-1);
+
+		// Extra IMAGE_BUFFER_ROW_ALIGNMENT bytes at the end allow vector
+		//   loads to read slightly past the last pixel
+
+	void *ptr;
+	if (posix_memalign(&ptr,IMAGE_BUFFER_ROW_ALIGNMENT,
+				sizeof(*buf) * row_stride * y_size * ((layout == PLANAR) ? 3 : 1)
+										+ IMAGE_BUFFER_ROW_ALIGNMENT))
+		throw std::bad_alloc();
+	buf=(ushort *)ptr;
 	}
 
-void image_reader_t::load_file(const char * const fname)
-{
-	try {
-		img.read(fname);
-		} catch (Magick::Exception &e) {
-			printf("Exception caught in Magick::Image::read(): %s\n",e.what());
-			throw;
-			}
-	load_postprocess(fname);
+void image_buffer_t::attach_mapped_file(void * const addr,const uint len,
+				const uint data_offset,const uint _x_size,const uint _y_size,
+				const layout_t _layout,const uint _row_stride)
+{			// data_offset has to be a multiple of IMAGE_BUFFER_ROW_ALIGNMENT,
+			//   and the mapping has to extend IMAGE_BUFFER_ROW_ALIGNMENT
+			//   bytes past the image data
+	release();
+
+	mapped_addr=addr;
+	mapped_len=len;
+	buf=(ushort *)((char *)addr + data_offset);
+	x_size=_x_size;
+	y_size=_y_size;
+	layout=_layout;
+	row_stride=_row_stride;
 	}
 
-void image_reader_t::load_from_memory(const void * const buf,const uint len,
-								const char * const shooting_info_fname)
+void image_buffer_t::swap(image_buffer_t &other)
 {
-	Magick::Blob blob;
-	blob.updateNoCopy((void *)buf,len,Magick::Blob::MallocAllocator);
-	try {
-		img.read(blob);
-		} catch (Magick::Exception &e) {
-			printf("Exception caught in Magick::Image::read(): %s\n",e.what());
-			throw;
-			}
-	load_postprocess(shooting_info_fname);
+	ushort * const tmp_buf=buf;
+	buf=other.buf;
+	other.buf=tmp_buf;
+
+	const uint tmp_x_size=x_size;
+	x_size=other.x_size;
+	other.x_size=tmp_x_size;
+
+	const uint tmp_y_size=y_size;
+	y_size=other.y_size;
+	other.y_size=tmp_y_size;
+
+	const layout_t tmp_layout=layout;
+	layout=other.layout;
+	other.layout=tmp_layout;
+
+	const uint tmp_row_stride=row_stride;
+	row_stride=other.row_stride;
+	other.row_stride=tmp_row_stride;
+
+	void * const tmp_mapped_addr=mapped_addr;
+	mapped_addr=other.mapped_addr;
+	other.mapped_addr=tmp_mapped_addr;
+
+	const uint tmp_mapped_len=mapped_len;
+	mapped_len=other.mapped_len;
+	other.mapped_len=tmp_mapped_len;
+
+	volatile uint * const tmp_share_count=share_count;
+	share_count=other.share_count;
+	other.share_count=tmp_share_count;
 	}
 
-void image_reader_t::load_postprocess(const char * const shooting_info_fname)
+void image_buffer_t::share(image_buffer_t &other)
 {
-	gamma=2.2;
+	if (&other == this)
+		return;
+	release();
+	if (other.buf == NULL)
+		return;
 
-	if (shooting_info_fname != NULL)
-		if (*shooting_info_fname) {
-			crw_reader_t crw_reader;
-			if (crw_reader.open_file(shooting_info_fname)) {
-				shooting_info=crw_reader.shooting_info;
-				gamma=1;
-				}
+	if (other.share_count == NULL)
+		other.share_count=new uint(1);
+	add_and_fetch(*other.share_count,1);
+
+	buf=other.buf;
+	x_size=other.x_size;
+	y_size=other.y_size;
+	layout=other.layout;
+	row_stride=other.row_stride;
+	mapped_addr=other.mapped_addr;
+	mapped_len=other.mapped_len;
+	share_count=other.share_count;
+	}
+
+void image_buffer_t::release(void)
+{
+	if (share_count != NULL) {
+		if (add_and_fetch(*share_count,(uint)-1)) {
+			buf=NULL;					// still used by another one
+			mapped_addr=NULL;
+			mapped_len=0;
+			share_count=NULL;
+			x_size=y_size=row_stride=0;
+			return;
 			}
+		delete share_count;
+		share_count=NULL;
+		}
 
-	img_buf=img.getConstPixels(0,0,img.columns(),img.rows());
+	if (mapped_addr != NULL) {
+		munmap(mapped_addr,mapped_len);
+		mapped_addr=NULL;
+		mapped_len=0;
+		}
+	  else
+		if (buf != NULL)
+			free(buf);
 
-	reset_read_pointer();
+	buf=NULL;
+	x_size=y_size=row_stride=0;
+	}
 
-	if (0 /*!!! img.ColorSpace == IMAGE::CIELAB */)
-		Lab_converter=new Lab_to_sRGB_converter_t;
-	  else {
-		const uint nr_of_values=1U << QuantumDepth;
-		if (gamma_table == NULL)
-			gamma_table=new float[nr_of_values];
+/***************************************************************************/
+/*****************************                 *****************************/
+/***************************** image_cache_t:: *****************************/
+/*****************************                 *****************************/
+/***************************************************************************/
 
-		const double max_value=nr_of_values-1;
-		for (uint i=0;i < nr_of_values;i++)
-			gamma_table[i]=pow(i / max_value,gamma);
+#define IMAGE_CACHE_MAGIC		"PPCACHE1"
+#define IMAGE_CACHE_DATA_OFFSET	4096	// multiple of IMAGE_BUFFER_ROW_ALIGNMENT
+
+static uint write_all(const sint fd,const void *data,uint len)
+{			// returns 0 on error
+	while (len > 0) {
+		const ssize_t written_len=write(fd,data,len);
+		if (written_len <= 0)
+			return 0;
+		data=(const char *)data + written_len;
+		len-=(uint)written_len;
 		}
 
-	R_nonlinear_transfer_coeff=B_nonlinear_transfer_coeff=0;
-	float R_nonlinear_mult=0,B_nonlinear_mult=0;
+	return 1;
+	}
 
-	vec3d<double> R_data=vec3d<double>::make(1,0,0);
-	vec3d<double> G_data=vec3d<double>::make(0,1,0);
-	vec3d<double> B_data=vec3d<double>::make(0,0,1);
-	vec3d<double> white_balance_mult=vec3d<double>::make(1,1,1);
+const char *image_cache_t::get_dir(void)
+{			// returns NULL if cache is not in use
 
-	if (!strcmp(shooting_info.camera_type,"Canon EOS D30")) {
-		// new matrix for dcraw 7.93 -m, but without normalising
-		R_data=vec3d<double>::make(1    ,0.093,0.010);
-		G_data=vec3d<double>::make(0.315,1    ,0.357);
-		B_data=vec3d<double>::make(0.003,0.332,1    );
-		}
+	const char * const dir=getenv("PHOTOPROC_CACHE_DIR");
+	if (dir == NULL || !*dir || strlen(dir) > PATH_MAX)
+		return NULL;
 
-	if (!strcmp(shooting_info.camera_type,"Canon EOS 10D")) {
-		// new matrix for dcraw 7.93 -m, with normalising
-		R_data=vec3d<double>::make(1    ,0.104 ,0.047);
-		G_data=vec3d<double>::make(0.383,1     ,0.386);
-		B_data=vec3d<double>::make(0.039,0.301 ,  1  );
-		}
+	return dir;
+	}
 
-	if (!strcmp(shooting_info.camera_type,"Canon EOS 20D")) {
-		// new matrix for dcraw 7.93 -m, with normalising
-		R_data=vec3d<double>::make(1    ,0.120 ,0.040);
-		G_data=vec3d<double>::make(0.468,1     ,0.269);
-		B_data=vec3d<double>::make(0.043,0.243 ,  1  );
-		/*
-		R_data=vec3d<double>::make(1    ,0.BBB ,0.FFF);
-		G_data=vec3d<double>::make(0.AAA,1     ,0.DDD);
-		B_data=vec3d<double>::make(0.EEE,0.CCC ,  1  );
-		*/
-		}
+uint image_cache_t::get_fname(char * const dest,const uint dest_size,
+													const char * const key)
+{			// returns 0 if cache is not in use
 
-	if (!strcmp(shooting_info.camera_type,"Canon EOS 77D")) {
-		R_data=vec3d<double>::make(1    ,0.380 ,0.157);
-		G_data=vec3d<double>::make(0.336,1     ,0.338);
-		B_data=vec3d<double>::make(0.085,0.482,   1  );
-		white_balance_mult=vec3d<double>::make(1,7.5,1.7);
+	const char * const dir=get_dir();
+	if (dir == NULL || strlen(dir) + 50 > dest_size)
+		return 0;
+
+	uint hash=2166136261U;			// FNV-1a; the whole key is stored in
+	for (const uchar *p=(const uchar *)key;*p;p++) {	//   the file anyway
+		hash^=*p;
+		hash*=16777619U;
 		}
 
-	R_nonlinear_scaling=1.0 / (1-R_nonlinear_transfer_coeff*R_nonlinear_mult);
-	B_nonlinear_scaling=1.0 / (1-B_nonlinear_transfer_coeff*B_nonlinear_mult);
+	sprintf(dest,"%s/%08x.photoproc-cache",dir,hash);
+	return 1;
+	}
 
-	const double D=determinant3(R_data,G_data,B_data);
-	const vec3d<double> vabaliige=vec3d<double>::make(
-				(1 - R_nonlinear_transfer_coeff) * R_nonlinear_scaling,
-				1,
-				(1 - B_nonlinear_transfer_coeff) * B_nonlinear_scaling);
-	const double normalize_mult[3]={
-						determinant3(vabaliige,G_data,B_data) / D,
-						determinant3(R_data,vabaliige,B_data) / D,
-						determinant3(R_data,G_data,vabaliige) / D,
-						};
+uint image_cache_t::make_key(char * const dest,const char * const fname,
+											const char * const decode_flags)
+{
+	*dest='\0';
 
-	m.x_vec=(R_data * normalize_mult[0] * white_balance_mult.x).tofloat();
-	m.y_vec=(G_data * normalize_mult[1] * white_balance_mult.y).tofloat();
-	m.z_vec=(B_data * normalize_mult[2] * white_balance_mult.z).tofloat();
+	char cache_fname[PATH_MAX + 100];
+	if (!get_fname(cache_fname,sizeof(cache_fname),""))
+		return 0;
 
-	m.inverse();
+	char abs_fname[PATH_MAX + 1];
+	struct stat st;
+	if (realpath(fname,abs_fname) == NULL || stat(abs_fname,&st))
+		return 0;
 
-	/*
-	printf("%.4f %.4f %.4f\n",m.x_vec.x,m.x_vec.y,m.x_vec.z);
-	printf("%.4f %.4f %.4f\n",m.y_vec.x,m.y_vec.y,m.y_vec.z);
-	printf("%.4f %.4f %.4f\n",m.z_vec.x,m.z_vec.y,m.z_vec.z);
-	*/
+	if (strlen(abs_fname) + strlen(decode_flags) + 50 > KEY_SIZE)
+		return 0;
+
+	sprintf(dest,"%s\n%lu\n%lu\n%s",abs_fname,(unsigned long)st.st_size,
+										(unsigned long)st.st_mtime,decode_flags);
+	return 1;
 	}
 
-image_reader_t::~image_reader_t(void)
-{
-	if (Lab_converter != NULL) {
-		delete Lab_converter;
-		Lab_converter=NULL;
+sint image_cache_t::open_entry(const char * const key,header_t &header)
+{			// returns -1 if there is no valid entry for key
+
+	char fname[PATH_MAX + 100];
+	if (!*key || !get_fname(fname,sizeof(fname),key))
+		return -1;
+
+	const sint fd=open(fname,O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	struct stat st;
+	if (read(fd,&header,sizeof(header)) != (ssize_t)sizeof(header) ||
+															fstat(fd,&st)) {
+		close(fd);
+		return -1;
 		}
 
-	if (gamma_table != NULL) {
-		delete [] gamma_table;
-		gamma_table=NULL;
+	const uint nr_of_planes=
+					(header.layout == image_buffer_t::PLANAR) ? 3 : 1;
+
+	if (memcmp(header.magic,IMAGE_CACHE_MAGIC,sizeof(header.magic)) ||
+				strncmp(header.key,key,sizeof(header.key)) ||
+				(header.layout != image_buffer_t::INTERLEAVED &&
+								header.layout != image_buffer_t::PLANAR) ||
+				header.row_stride < header.x_size * 3 / nr_of_planes ||
+				header.data_len != sizeof(ushort) * header.row_stride *
+											header.y_size * nr_of_planes ||
+				(uint)st.st_size < IMAGE_CACHE_DATA_OFFSET +
+								header.data_len + IMAGE_BUFFER_ROW_ALIGNMENT) {
+		close(fd);				// other version, hash collision or
+		return -1;				//   truncated file
 		}
-	}
 
-void image_reader_t::reset_read_pointer(void)
-{
-	p=img_buf;
-	end_p=p + img.columns()*img.rows();
+	return fd;
 	}
 
-void image_reader_t::skip_pixels(const uint nr_of_pixels)
+uint image_cache_t::contains(const char * const key)
 {
-	p+=nr_of_pixels;
+	header_t header;
+	const sint fd=open_entry(key,header);
+	if (fd < 0)
+		return 0;
+
+	close(fd);
+	return 1;
 	}
 
-uint image_reader_t::get_linear_RGB(float dest_rgb[3])
-{			// returns 0 when image data ends
+uint image_cache_t::load(image_buffer_t &img,const char * const key)
+{			// returns 0 if there is no valid entry for key
 
-	if (p >= end_p)
+	header_t header;
+	const sint fd=open_entry(key,header);
+	if (fd < 0)
 		return 0;
 
-	float r,g,b;
-	/*!!! if (img.ColorSpace == IMAGE::CIELAB)
-		Lab_converter->convert_to_sRGB(v,p[0],
-						*(const schar *)&p[1],*(const schar *)&p[2]);
-	  else */ {
-		r=gamma_table[p->red];
-		g=gamma_table[p->green];
-		b=gamma_table[p->blue];
-		}
-
-		// Correct sensor nonlinear bleed
+		// private writable mapping, as img does not promise to leave
+		//   its contents unchanged
 
-	{ const float orig_R=(r-R_nonlinear_transfer_coeff*g) * R_nonlinear_scaling;
-	r=min(r,orig_R); }
-	{ const float orig_B=(b-B_nonlinear_transfer_coeff*g) * B_nonlinear_scaling;
-	b=min(b,orig_B); }
-
-		// Remap sensor primaries to sRGB
+	const uint len=IMAGE_CACHE_DATA_OFFSET + header.data_len +
+												IMAGE_BUFFER_ROW_ALIGNMENT;
+	void * const addr=mmap(NULL,len,PROT_READ | PROT_WRITE,MAP_PRIVATE,fd,0);
+	close(fd);
+	if (addr == MAP_FAILED)
+		return 0;
 
-	dest_rgb[0]=m.x_vec.x*r + m.y_vec.x*g + m.z_vec.x*b;
-	dest_rgb[1]=m.x_vec.y*r + m.y_vec.y*g + m.z_vec.y*b;
-	dest_rgb[2]=m.x_vec.z*r + m.y_vec.z*g + m.z_vec.z*b;
+	char fname[PATH_MAX + 100];			// prune() deletes the files with
+	if (get_fname(fname,sizeof(fname),key))	//   oldest modification time
+		utime(fname,NULL);
 
-	p++;
+	img.attach_mapped_file(addr,len,IMAGE_CACHE_DATA_OFFSET,
+				header.x_size,header.y_size,
+				(image_buffer_t::layout_t)header.layout,header.row_stride);
 	return 1;
 	}
 
-void image_reader_t::get_spot_values(
-			const float x_fraction,const float y_fraction,uint dest[3]) const
+void image_cache_t::save(const image_buffer_t &img,const char * const key)
 {
-	if (!img.columns() || !img.rows()) {
-		dest[0]=dest[1]=dest[2]=0;
+	char fname[PATH_MAX + 100];
+	if (!*key || !img.rows() || !get_fname(fname,sizeof(fname),key))
 		return;
-		}
 
-	sint x=(sint)(x_fraction * img.columns());
-	if (x < 0)
-		x = 0;
-	if ((uint)x > img.columns()-1)
-		x = img.columns()-1;
+	header_t header;
+	memset(&header,0,sizeof(header));
+	memcpy(header.magic,IMAGE_CACHE_MAGIC,sizeof(header.magic));
+	header.x_size=img.columns();
+	header.y_size=img.rows();
+	header.layout=img.get_layout();
+	header.row_stride=img.get_row_stride();
+	header.data_len=img.get_size_in_bytes();
+	strncpy(header.key,key,sizeof(header.key)-1);
 
-	sint y=(sint)(y_fraction * img.rows());
-	if (y < 0)
-		y = 0;
-	if ((uint)y > img.rows()-1)
-		y = img.rows()-1;
+	prune(IMAGE_CACHE_DATA_OFFSET + header.data_len);
 
-	uint values[3];
-	float best_variation=-1;
-	for (uint size=4;size <= 40;size++) {
-		const float variation=
-					get_spot_averages((uint)x,(uint)y,values,size) / size;
-		if (best_variation > variation || best_variation < 0) {
-			best_variation = variation;
-			dest[0]=values[0];
-			dest[1]=values[1];
-			dest[2]=values[2];
-			}
-		}
+		// written under a temporary name, so that other photoproc
+		//   processes never see a partially written file; the name is
+		//   unique also among threads and hosts sharing the directory
+
+	char temp_fname[PATH_MAX + 150];
+	sprintf(temp_fname,"%s.XXXXXX",fname);
+
+	const sint fd=mkstemp(temp_fname);
+	if (fd < 0)
+		return;
+	fchmod(fd,0644);		// mkstemp() gives 0600
+
+	uint is_ok=write_all(fd,&header,sizeof(header)) &&
+			lseek(fd,IMAGE_CACHE_DATA_OFFSET,SEEK_SET) ==
+										(off_t)IMAGE_CACHE_DATA_OFFSET &&
+			write_all(fd,img.get_data(),header.data_len) &&
+			!ftruncate(fd,IMAGE_CACHE_DATA_OFFSET + header.data_len +
+												IMAGE_BUFFER_ROW_ALIGNMENT);
+	if (close(fd))
+		is_ok=0;
+
+	if (!is_ok || rename(temp_fname,fname))
+		unlink(temp_fname);
 	}
 
-float image_reader_t::get_spot_averages(uint x,uint y,uint dest[3],
-													const uint size) const
-{
-	uint sum[3];
-	float squares_sum[3];
-	uint N=0;
+struct image_cache_file_t {
+	time_t mtime;
+	off_t size;
+	char fname[PATH_MAX + 100];
 
-	uint i;
-	for (i=0;i < 3;i++) {
-		sum[i]=0;
-		squares_sum[i]=0;
-		}
+	bool operator<(const image_cache_file_t &other) const
+										{ return mtime < other.mtime; }
+	};
 
-	const uint beg_x=(x < size/2) ? 0 : (x - size/2);
-	const uint end_x=min(beg_x + size,img.columns());
+void image_cache_t::prune(const double size_to_add)
+{			// deletes the least recently used files, so that size_to_add
+			//   more bytes fit under the size limit
 
-	const uint beg_y=(y < size/2) ? 0 : (y - size/2);
-	const uint end_y=min(beg_y + size,img.rows());
+	const char * const dir=get_dir();
+	if (dir == NULL)
+		return;
 
-	for (y=beg_y;y < end_y;y++)
-		for (x=beg_x;x < end_x;x++) {
-			const Magick::PixelPacket * const p=img_buf + x + y*img.columns();
+	double max_size=4096.0 * 1024*1024;
+	const char * const max_mb=getenv("PHOTOPROC_CACHE_MAX_MB");
+	if (max_mb != NULL && *max_mb)
+		max_size=atof(max_mb) * 1024*1024;
 
-			uint value[3];
-			value[0]=p->red;
-			value[1]=p->green;
-			value[2]=p->blue;
+	DIR * const d=opendir(dir);
+	if (d == NULL)
+		return;
 
-			for (uint i=0;i < 3;i++) {
-				sum[i]+=value[i];
-				squares_sum[i]+=value[i] * value[i];
-				}
+	const char * const suffix=".photoproc-cache";
+	const uint suffix_len=strlen(suffix);
 
-			N++;
-			}
+	std::vector<image_cache_file_t> files;
+	double total_size=0;
+	const struct dirent *entry;
+	while ((entry=readdir(d)) != NULL) {
+		const uint len=strlen(entry->d_name);
+		if (len <= suffix_len || len > 50 ||
+								strcmp(entry->d_name + len-suffix_len,suffix))
+			continue;
 
-	float population_variance=0;
-	for (i=0;i < 3;i++) {
-		dest[i]=(sum[i] + N/2) / N;
-		population_variance+=(squares_sum[i] - sum[i]*(float)sum[i]/N) / (N-1);
+		image_cache_file_t file;
+		sprintf(file.fname,"%s/%s",dir,entry->d_name);
+		struct stat st;
+		if (stat(file.fname,&st))
+			continue;
+		file.mtime=st.st_mtime;
+		file.size=st.st_size;
+		total_size+=st.st_size;
+		files.push_back(file);
 		}
+	closedir(d);
 
-	return population_variance;
+	std::sort(files.begin(),files.end());
+	for (uint i=0;i < files.size() && total_size + size_to_add > max_size;i++)
+		if (!unlink(files[i].fname))
+			total_size-=files[i].size;
 	}
 
 /***************************************************************************/
 /**************************                       **************************/
-/************************** processing_phase1_t:: **************************/
+/************************** ppm_stream_parser_t:: **************************/
 /**************************                       **************************/
 /***************************************************************************/
 
-processing_phase1_t::processing_phase1_t(image_reader_t &_image_reader,
-										const uint _undo_enh_shadows) :
-		image_reader(_image_reader), undo_enh_shadows(_undo_enh_shadows),
-		output_line(new quantum_type [_image_reader.img.columns() * 3 + 1]),
-		output_line_end(output_line + _image_reader.img.columns() * 3)
-{
-	image_reader.reset_read_pointer();
-	}
+ppm_stream_parser_t::ppm_stream_parser_t(receiver_t * const _receiver) :
+					receiver(_receiver),
+					header_pos(0), header_field_nr(0), header_field_value(0),
+					is_in_header_token(0), is_in_header_comment(0),
+					is_invalid(0), row_buf(NULL), row_len(0),
+					row_buf_used_len(0), x_size(0), y_size(0), maxval(0),
+					nr_of_rows_parsed(0) {}
 
-processing_phase1_t::~processing_phase1_t(void)
-{
-	delete [] output_line;
-	}
+uint ppm_stream_parser_t::parse_header_char(const uchar c)
+{		// returns 0 if c is not valid at this point of header
 
-#if PHOTOPROC_QUANTUM_BITS == 8
+	const uint pos=header_pos++;
 
-/* The 8-bit sqrt optimization tables are calculated by this Perl script:
+	if (pos == 0)
+		return (c == 'P');
+	if (pos == 1) {
+		header_field_nr=1;
+		return (c == '6');
+		}
 
-#!/usr/bin/perl
+	if (is_in_header_comment) {
+		if (c == '\n' || c == '\r')
+			is_in_header_comment=0;
+		return 1;
+		}
 
-use POSIX;
-$FIXED_POINT_BITS=24;
+	if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+		if (!is_in_header_token)
+			return 1;
 
-sub calc_output_value($$$)
-{
-	my $i=shift;
-	my $highest_bit_nr=shift;
-	my $table_size_bits=shift;
+		is_in_header_token=0;
+		switch (header_field_nr++) {
+			case 1:	x_size=header_field_value;	break;
+			case 2:	y_size=header_field_value;	break;
+			case 3:	maxval=header_field_value;	break;
+			}
+		header_field_value=0;
 
-	my $input_float_value=
-			(2**($highest_bit_nr-$FIXED_POINT_BITS)) + 
-			(2**($highest_bit_nr-$FIXED_POINT_BITS-$table_size_bits)) * $i;
-	my $output_value=sqrt($input_float_value) * 255;
-	$output_value=255 if ($output_value > 255);
-	return $output_value;
-	}
+		if (header_field_nr < 4)
+			return 1;
 
-my $total_table_len=0;
-$sqrt_data_string='';
+			// the whitespace char after maxval was the last char of header
 
-for my $highest_bit_nr (0..31) {
-	$avgerror=0;
-	$table_string='';
+		if (!x_size || !y_size || !maxval || maxval > 0xffffU ||
+									x_size > (1U << 16) || y_size > (1U << 16))
+			return 0;
 
-	TABLESIZEBITS: for ($table_size_bits=0;
-				$table_size_bits < $FIXED_POINT_BITS;$table_size_bits++) {
+		if (!receiver->ppm_header_parsed(x_size,y_size,maxval))
+			return 0;
 
-		$table_string="\n\n";
-		$avgerror=0;
-		my $tablesize=1 << $table_size_bits;
+		row_len=x_size * 3 * ((maxval < 0x100) ? 1 : 2);
+		row_buf=new uchar [row_len];
+		return 1;
+		}
+
+	if (c == '#' && !is_in_header_token) {
+		is_in_header_comment=1;
+		return 1;
+		}
+
+	if (c < '0' || c > '9' || header_field_value > 0xfffffffU)
+		return 0;
+
+	is_in_header_token=1;
+	header_field_value=header_field_value*10 + (c - '0');
+	return 1;
+	}
+
+uint ppm_stream_parser_t::feed(const void *data,uint len)
+{			// returns 0 if the stream is not a valid P6 PPM image;
+			//   data after the last row is ignored
+
+	const uchar *p=(const uchar *)data;
+
+	while (len && !is_invalid && !row_len) {
+		if (!parse_header_char(*p)) {
+			is_invalid=1;
+			break;
+			}
+		p++;
+		len--;
+		}
+
+	if (is_invalid)
+		return 0;
+
+	while (len && nr_of_rows_parsed < y_size) {
+		if (!row_buf_used_len && len >= row_len) {
+			receiver->ppm_row_parsed(nr_of_rows_parsed++,p);
+			p+=row_len;
+			len-=row_len;
+			continue;
+			}
+
+		const uint copy_len=min(len,row_len - row_buf_used_len);
+		memcpy(row_buf + row_buf_used_len,p,copy_len);
+		row_buf_used_len+=copy_len;
+		p+=copy_len;
+		len-=copy_len;
+
+		if (row_buf_used_len == row_len) {
+			receiver->ppm_row_parsed(nr_of_rows_parsed++,row_buf);
+			row_buf_used_len=0;
+			}
+		}
+
+	return 1;
+	}
+
+/***************************************************************************/
+/**************************                       **************************/
+/************************** ppm_image_decoder_t:: **************************/
+/**************************                       **************************/
+/***************************************************************************/
+
+uint ppm_image_decoder_t::ppm_header_parsed(const uint x_size,
+										const uint y_size,const uint maxval)
+{
+	try {
+		img->allocate(x_size,y_size,IMAGE_BUFFER_LAYOUT);
+		} catch (std::bad_alloc &) {
+			printf("Out of memory for %ux%u image\n",x_size,y_size);
+			return 0;
+			}
+
+	if (maxval != 0xffffU) {
+		sample_conversion_table=new ushort [maxval + 1];
+		for (uint i=0;i <= maxval;i++)
+			sample_conversion_table[i]=(ushort)((i*0xffffU + maxval/2) / maxval);
+		}
+
+	return 1;
+	}
+
+void ppm_image_decoder_t::ppm_row_parsed(const uint y,const uchar * const data)
+{
+	const ushort * const table=sample_conversion_table;
+	const uint step=img->pixel_step();
+	const uint end_i=img->columns() * step;
+	ushort * const r=img->channel_row(0,y);
+	ushort * const g=img->channel_row(1,y);
+	ushort * const b=img->channel_row(2,y);
+
+	const uchar *s=data;
+	if (parser.maxval < 0x100)
+		for (uint i=0;i < end_i;i+=step,s+=3) {
+			r[i]=table[s[0]];
+			g[i]=table[s[1]];
+			b[i]=table[s[2]];
+			}
+	  else
+	if (table != NULL)
+		for (uint i=0;i < end_i;i+=step,s+=6) {
+			r[i]=table[(s[0] << 8) + s[1]];
+			g[i]=table[(s[2] << 8) + s[3]];
+			b[i]=table[(s[4] << 8) + s[5]];
+			}
+	  else
+		for (uint i=0;i < end_i;i+=step,s+=6) {
+			r[i]=(s[0] << 8) + s[1];
+			g[i]=(s[2] << 8) + s[3];
+			b[i]=(s[4] << 8) + s[5];
+			}
+	}
+
+void ppm_image_decoder_t::clear_missing_rows(void)
+{			// sets rows not received to black
+
+	if (!is_header_parsed())
+		return;
+
+	const uint step=img->pixel_step();
+	for (uint y=parser.nr_of_rows_parsed;y < img->rows();y++)
+		for (uint c=0;c < 3;c++) {
+			ushort * const p=img->channel_row(c,y);
+			for (uint i=0;i < img->columns()*step;i+=step)
+				p[i]=0;
+			}
+	}
+
+/***************************************************************************/
+/*************************                        **************************/
+/************************* summed_area_tables_t:: **************************/
+/*************************                        **************************/
+/***************************************************************************/
+
+void summed_area_tables_t::clear(void)
+{
+	if (tiles != NULL) {
+		for (uint i=0;i < nr_of_tiles_x*nr_of_tiles_y;i++)
+			if (tiles[i] != NULL)
+				delete tiles[i];
+		delete [] tiles;
+		tiles=NULL;
+		}
+
+	nr_of_tiles_x=nr_of_tiles_y=0;
+	}
+
+summed_area_tables_t::tile_t *summed_area_tables_t::build_tile(
+			const image_buffer_t &img,const uint tile_x,const uint tile_y)
+{
+	tile_t * const tile=new tile_t;
+
+	const uint beg_x=tile_x * TILE_SIZE;
+	const uint beg_y=tile_y * TILE_SIZE;
+	const uint x_size=min(img.columns() - beg_x,(uint)TILE_SIZE);
+	const uint y_size=min(img.rows()    - beg_y,(uint)TILE_SIZE);
+	const uint step=img.pixel_step();
+
+	uint i;
+	for (i=0;i < TILE_STRIDE;i++) {		// first row and column are zero
+		tile->sums[i][0]=tile->sums[i][1]=tile->sums[i][2]=0;
+		tile->squares_sums[i]=0;
+		tile->sums[i*TILE_STRIDE][0]=tile->sums[i*TILE_STRIDE][1]=
+										tile->sums[i*TILE_STRIDE][2]=0;
+		tile->squares_sums[i*TILE_STRIDE]=0;
+		}
+
+	for (uint y=0;y < y_size;y++) {
+		const ushort * const r=img.channel_row(0,beg_y + y) + beg_x*step;
+		const ushort * const g=img.channel_row(1,beg_y + y) + beg_x*step;
+		const ushort * const b=img.channel_row(2,beg_y + y) + beg_x*step;
+
+		uint row_sums[3]={0,0,0};
+		double row_squares_sum=0;
+
+		for (uint x=0;x < x_size;x++) {
+			const uint value[3]={r[x*step],g[x*step],b[x*step]};
+			const uint pos=(y+1)*TILE_STRIDE + x+1;
+
+			for (i=0;i < 3;i++) {
+				row_sums[i]+=value[i];
+				tile->sums[pos][i]=tile->sums[pos - TILE_STRIDE][i] +
+																row_sums[i];
+				row_squares_sum+=value[i] * (double)value[i];
+				}
+			tile->squares_sums[pos]=tile->squares_sums[pos - TILE_STRIDE] +
+															row_squares_sum;
+			}
+		}
+
+	return tile;
+	}
+
+void summed_area_tables_t::get_sums(const image_buffer_t &img,
+						const uint beg_x,const uint beg_y,
+						const uint end_x,const uint end_y,
+						uint sums[3],double &squares_sum)
+{			// for pixels beg_x <= x < end_x, beg_y <= y < end_y
+
+	if (tiles == NULL) {
+		nr_of_tiles_x=(img.columns() + TILE_SIZE-1) / TILE_SIZE;
+		nr_of_tiles_y=(img.rows()    + TILE_SIZE-1) / TILE_SIZE;
+		tiles=new tile_t * [nr_of_tiles_x*nr_of_tiles_y];
+		for (uint i=0;i < nr_of_tiles_x*nr_of_tiles_y;i++)
+			tiles[i]=NULL;
+		}
+
+	sums[0]=sums[1]=sums[2]=0;
+	squares_sum=0;
+
+	for (uint tile_y=beg_y / TILE_SIZE;tile_y*TILE_SIZE < end_y;tile_y++)
+		for (uint tile_x=beg_x / TILE_SIZE;tile_x*TILE_SIZE < end_x;tile_x++) {
+			tile_t * &tile=tiles[tile_y*nr_of_tiles_x + tile_x];
+			if (tile == NULL)
+				tile=build_tile(img,tile_x,tile_y);
+
+				// rectangle within tile
+
+			const uint x0=max(beg_x,tile_x*TILE_SIZE) - tile_x*TILE_SIZE;
+			const uint y0=max(beg_y,tile_y*TILE_SIZE) - tile_y*TILE_SIZE;
+			const uint x1=min(end_x,(tile_x+1)*TILE_SIZE) - tile_x*TILE_SIZE;
+			const uint y1=min(end_y,(tile_y+1)*TILE_SIZE) - tile_y*TILE_SIZE;
+
+			const uint a=y0*TILE_STRIDE + x0,b=y0*TILE_STRIDE + x1;
+			const uint c=y1*TILE_STRIDE + x0,d=y1*TILE_STRIDE + x1;
+
+			for (uint i=0;i < 3;i++)
+				sums[i]+=tile->sums[d][i] - tile->sums[b][i] -
+										tile->sums[c][i] + tile->sums[a][i];
+			squares_sum+=tile->squares_sums[d] - tile->squares_sums[b] -
+							tile->squares_sums[c] + tile->squares_sums[a];
+			}
+	}
+
+/***************************************************************************/
+/****************************                  *****************************/
+/**************************** image_reader_t:: *****************************/
+/****************************                  *****************************/
+/***************************************************************************/
+
+static inline ushort quantum_to_ushort(const Magick::Quantum q)
+{
+#if QuantumDepth == 8
+	return (ushort)(q * 0x101U);
+#elif QuantumDepth == 16
+	return (ushort)q;
+#else
+	return (ushort)(q >> (QuantumDepth - 16));
+#endif
+	}
+
+image_reader_t::image_reader_t(void) :
+				Lab_converter(NULL), gamma_table(NULL),
+				stream_source(NULL), ppm_decoder(NULL), loading_complete(1),
+				is_cache_save_running(0)
+{
+	*stream_cache_key='\0';
+	}
+
+image_reader_t::image_reader_t(const char * const fname) :
+				Lab_converter(NULL), gamma_table(NULL),
+				stream_source(NULL), ppm_decoder(NULL), loading_complete(1),
+				is_cache_save_running(0)
+{
+	*stream_cache_key='\0';
+	load_file(fname);
+	}
+
+void image_reader_t::load_file(const char * const fname)
+{			// uses ImageMagick for decoding, and copies the result to img
+
+	finish_loading();
+
+	Magick::Image magick_img;
+	try {
+		magick_img.read(fname);
+		} catch (Magick::Exception &e) {
+			printf("Exception caught in Magick::Image::read(): %s\n",e.what());
+			throw;
+			}
+
+	const uint x_size=magick_img.columns();
+	const uint y_size=magick_img.rows();
+	img.allocate(x_size,y_size,IMAGE_BUFFER_LAYOUT);
+
+	const uint step=img.pixel_step();
+	for (uint y=0;y < y_size;y++) {
+		const Magick::PixelPacket *p=
+								magick_img.getConstPixels(0,y,x_size,1);
+		ushort * const r=img.channel_row(0,y);
+		ushort * const g=img.channel_row(1,y);
+		ushort * const b=img.channel_row(2,y);
+
+		for (uint i=0;i < x_size*step;i+=step,p++) {
+			r[i]=quantum_to_ushort(p->red);
+			g[i]=quantum_to_ushort(p->green);
+			b[i]=quantum_to_ushort(p->blue);
+			}
+		}
+
+	load_postprocess(fname);
+	}
+
+uint image_reader_t::read_stream_header(stream_source_t * const source,
+												const char * const cache_key)
+{		// returns after reading the PPM header into stream_img; img is
+		//   not touched. Returns 0 if the stream does not start with
+		//   a valid PPM header
+
+	finish_loading();
+
+	stream_source=source;
+	ppm_decoder=new ppm_image_decoder_t(stream_img);
+
+	*stream_cache_key='\0';
+	if (cache_key != NULL) {
+		strncpy(stream_cache_key,cache_key,sizeof(stream_cache_key));
+		stream_cache_key[sizeof(stream_cache_key)-1]='\0';
+		}
+
+	while (!ppm_decoder->is_header_parsed())
+		if (!read_stream_chunk()) {		// the stream has ended
+			*stream_cache_key='\0';
+			delete ppm_decoder;
+			ppm_decoder=NULL;
+			stream_source=NULL;
+			stream_img.release();
+			return 0;
+			}
+
+	return 1;
+	}
+
+void image_reader_t::load_from_stream(const char * const shooting_info_fname)
+{
+	if (ppm_decoder == NULL)
+		return;
+
+	store_release(loading_complete,0);
+	ppm_decoder->move_image_to(img);
+	stream_img.release();			// the previous image
+	load_postprocess(shooting_info_fname);
+	}
+
+void image_reader_t::load_decoded_image(image_buffer_t &decoded_img,
+				const char * const shooting_info_fname,const char * const cache_key)
+{
+	finish_loading();
+	img.swap(decoded_img);
+	load_postprocess(shooting_info_fname);
+
+	if (cache_key != NULL)
+		start_cache_save(cache_key);
+	}
+
+uint image_reader_t::load_from_cache(const char * const cache_key,
+									const char * const shooting_info_fname)
+{			// returns 0 if the image is not in image_cache_t
+
+	finish_loading();
+	if (!image_cache_t::load(img,cache_key))
+		return 0;
+
+	load_postprocess(shooting_info_fname);
+	return 1;
+	}
+
+uint image_reader_t::read_stream_chunk(void)
+{			// returns 0 at the end of stream
+
+	const void *data;
+	const uint len=stream_source->read_stream_data(data);
+	if (!len)
+		return 0;
+
+	ppm_decoder->feed(data,len);
+	stream_source->release_stream_data(data);
+	return 1;
+	}
+
+void image_reader_t::ensure_rows_loaded(const uint nr_of_rows)
+{
+	if (stream_source == NULL)
+		return;
+
+	while (ppm_decoder->nr_of_rows_decoded() < nr_of_rows)
+		if (!read_stream_chunk()) {
+			end_stream_loading();
+			return;
+			}
+
+	if (ppm_decoder->is_complete())
+		finish_loading();
+	}
+
+void image_reader_t::continue_loading(void)
+{			// reads the next chunk of the stream, if any
+
+	if (stream_source == NULL)
+		return;
+
+	if (!read_stream_chunk())
+		end_stream_loading();
+	}
+
+void image_reader_t::finish_loading(void)
+{			// reads the rest of the stream, if any
+
+	if (stream_source == NULL)
+		return;
+
+	while (read_stream_chunk())
+		;
+
+	end_stream_loading();
+	}
+
+void image_reader_t::end_stream_loading(void)
+{			// called once the end of stream has been read
+
+	if (ppm_decoder->is_complete())
+		start_cache_save(stream_cache_key);
+	  else
+		ppm_decoder->clear_missing_rows();
+	*stream_cache_key='\0';
+
+	delete ppm_decoder;
+	ppm_decoder=NULL;
+	stream_source=NULL;
+	store_release(loading_complete,1);		// after the last row of img
+	}
+
+void *image_reader_t::cache_save_thread_main(void * const arg)
+{
+	image_reader_t * const reader=(image_reader_t *)arg;
+	image_cache_t::save(reader->cache_save_img,reader->cache_save_key);
+	reader->cache_save_img.release();	// frees the image if img has
+	return NULL;						//   been replaced meanwhile
+	}
+
+void image_reader_t::start_cache_save(const char * const cache_key)
+{			// the thread writes its own reference to the image, so img
+			//   may be replaced while the image is being written
+
+	wait_for_cache_save();		// only the latest save may be unfinished
+	if (!*cache_key)
+		return;
+
+	strncpy(cache_save_key,cache_key,sizeof(cache_save_key));
+	cache_save_key[sizeof(cache_save_key)-1]='\0';
+	cache_save_img.share(img);
+
+	if (!pthread_create(&cache_save_thread,NULL,
+										&cache_save_thread_main,this))
+		is_cache_save_running=1;
+	  else
+		cache_save_img.release();
+	}
+
+void image_reader_t::wait_for_cache_save(void)
+{
+	if (!is_cache_save_running)
+		return;
+
+	pthread_join(cache_save_thread,NULL);
+	is_cache_save_running=0;
+	}
+
+void image_reader_t::load_postprocess(const char * const shooting_info_fname)
+{
+	spot_sums.clear();
+	gamma=2.2;
+
+	if (shooting_info_fname != NULL)
+		if (*shooting_info_fname) {
+			crw_reader_t crw_reader;
+			if (crw_reader.open_file(shooting_info_fname)) {
+				shooting_info=crw_reader.shooting_info;
+				gamma=1;
+				}
+			}
+
+	if (0 /*!!! img.ColorSpace == IMAGE::CIELAB */)
+		Lab_converter=new Lab_to_sRGB_converter_t;
+	  else {
+		const uint nr_of_values=0x10000;		// img holds 16-bit samples
+		if (gamma_table == NULL)
+			gamma_table=new float[nr_of_values];
+
+		const double max_value=nr_of_values-1;
+		for (uint i=0;i < nr_of_values;i++)
+			gamma_table[i]=pow(i / max_value,gamma);
+		}
+
+	R_nonlinear_transfer_coeff=B_nonlinear_transfer_coeff=0;
+	float R_nonlinear_mult=0,B_nonlinear_mult=0;
+
+	vec3d<double> R_data=vec3d<double>::make(1,0,0);
+	vec3d<double> G_data=vec3d<double>::make(0,1,0);
+	vec3d<double> B_data=vec3d<double>::make(0,0,1);
+	vec3d<double> white_balance_mult=vec3d<double>::make(1,1,1);
+
+	if (!strcmp(shooting_info.camera_type,"Canon EOS D30")) {
+		// new matrix for dcraw 7.93 -m, but without normalising
+		R_data=vec3d<double>::make(1    ,0.093,0.010);
+		G_data=vec3d<double>::make(0.315,1    ,0.357);
+		B_data=vec3d<double>::make(0.003,0.332,1    );
+		}
+
+	if (!strcmp(shooting_info.camera_type,"Canon EOS 10D")) {
+		// new matrix for dcraw 7.93 -m, with normalising
+		R_data=vec3d<double>::make(1    ,0.104 ,0.047);
+		G_data=vec3d<double>::make(0.383,1     ,0.386);
+		B_data=vec3d<double>::make(0.039,0.301 ,  1  );
+		}
+
+	if (!strcmp(shooting_info.camera_type,"Canon EOS 20D")) {
+		// new matrix for dcraw 7.93 -m, with normalising
+		R_data=vec3d<double>::make(1    ,0.120 ,0.040);
+		G_data=vec3d<double>::make(0.468,1     ,0.269);
+		B_data=vec3d<double>::make(0.043,0.243 ,  1  );
+		/*
+		R_data=vec3d<double>::make(1    ,0.BBB ,0.FFF);
+		G_data=vec3d<double>::make(0.AAA,1     ,0.DDD);
+		B_data=vec3d<double>::make(0.EEE,0.CCC ,  1  );
+		*/
+		}
+
+	if (!strcmp(shooting_info.camera_type,"Canon EOS 77D")) {
+		R_data=vec3d<double>::make(1    ,0.380 ,0.157);
+		G_data=vec3d<double>::make(0.336,1     ,0.338);
+		B_data=vec3d<double>::make(0.085,0.482,   1  );
+		white_balance_mult=vec3d<double>::make(1,7.5,1.7);
+		}
+
+	R_nonlinear_scaling=1.0 / (1-R_nonlinear_transfer_coeff*R_nonlinear_mult);
+	B_nonlinear_scaling=1.0 / (1-B_nonlinear_transfer_coeff*B_nonlinear_mult);
+
+	const double D=determinant3(R_data,G_data,B_data);
+	const vec3d<double> vabaliige=vec3d<double>::make(
+				(1 - R_nonlinear_transfer_coeff) * R_nonlinear_scaling,
+				1,
+				(1 - B_nonlinear_transfer_coeff) * B_nonlinear_scaling);
+	const double normalize_mult[3]={
+						determinant3(vabaliige,G_data,B_data) / D,
+						determinant3(R_data,vabaliige,B_data) / D,
+						determinant3(R_data,G_data,vabaliige) / D,
+						};
+
+	m.x_vec=(R_data * normalize_mult[0] * white_balance_mult.x).tofloat();
+	m.y_vec=(G_data * normalize_mult[1] * white_balance_mult.y).tofloat();
+	m.z_vec=(B_data * normalize_mult[2] * white_balance_mult.z).tofloat();
+
+	m.inverse();
+
+	/*
+	printf("%.4f %.4f %.4f\n",m.x_vec.x,m.x_vec.y,m.x_vec.z);
+	printf("%.4f %.4f %.4f\n",m.y_vec.x,m.y_vec.y,m.y_vec.z);
+	printf("%.4f %.4f %.4f\n",m.z_vec.x,m.z_vec.y,m.z_vec.z);
+	*/
+	}
+
+image_reader_t::~image_reader_t(void)
+{
+	wait_for_cache_save();
+
+	if (ppm_decoder != NULL) {
+		delete ppm_decoder;
+		ppm_decoder=NULL;
+		}
+
+	if (Lab_converter != NULL) {
+		delete Lab_converter;
+		Lab_converter=NULL;
+		}
+
+	if (gamma_table != NULL) {
+		delete [] gamma_table;
+		gamma_table=NULL;
+		}
+	}
+
+#if AVX2_KERNELS
+
+static AVX2_FUNCTION uint get_linear_values_avx2(float * const dest_r,
+				float * const dest_g,float * const dest_b,
+				const ushort * const src_r,const ushort * const src_g,
+				const ushort * const src_b,const uint step,
+				const uint nr_of_pixels,const float * const gamma_table)
+{			// returns the number of pixels converted, a multiple of 8
+	uint i=0;
+
+	if (step == 1)
+		for (;i+8 <= nr_of_pixels;i+=8) {
+			const __m256i r=_mm256_cvtepu16_epi32(
+					_mm_loadu_si128((const __m128i *)(src_r + i)));
+			const __m256i g=_mm256_cvtepu16_epi32(
+					_mm_loadu_si128((const __m128i *)(src_g + i)));
+			const __m256i b=_mm256_cvtepu16_epi32(
+					_mm_loadu_si128((const __m128i *)(src_b + i)));
+			_mm256_storeu_ps(dest_r + i,
+								_mm256_i32gather_ps(gamma_table,r,4));
+			_mm256_storeu_ps(dest_g + i,
+								_mm256_i32gather_ps(gamma_table,g,4));
+			_mm256_storeu_ps(dest_b + i,
+								_mm256_i32gather_ps(gamma_table,b,4));
+			}
+	  else {		// interleaved: gather 32 bits at each sample and
+					//   keep the low 16; rows have slack at the end
+		const __m256i offsets=_mm256_setr_epi32(0,6,12,18,24,30,36,42);
+		const __m256i low_mask=_mm256_set1_epi32(0xffff);
+		for (;i+8 <= nr_of_pixels;i+=8) {
+			const __m256i r=_mm256_and_si256(low_mask,_mm256_i32gather_epi32(
+							(const int *)(src_r + i*3),offsets,1));
+			const __m256i g=_mm256_and_si256(low_mask,_mm256_i32gather_epi32(
+							(const int *)(src_g + i*3),offsets,1));
+			const __m256i b=_mm256_and_si256(low_mask,_mm256_i32gather_epi32(
+							(const int *)(src_b + i*3),offsets,1));
+			_mm256_storeu_ps(dest_r + i,
+								_mm256_i32gather_ps(gamma_table,r,4));
+			_mm256_storeu_ps(dest_g + i,
+								_mm256_i32gather_ps(gamma_table,g,4));
+			_mm256_storeu_ps(dest_b + i,
+								_mm256_i32gather_ps(gamma_table,b,4));
+			}
+		}
+
+	return i;
+	}
+
+#endif
+
+uint image_reader_t::get_linear_RGB_row(const uint y,float * const dest_r,
+						float * const dest_g,float * const dest_b,
+						const uint beg_x,uint nr_of_pixels)
+{			// converts row y, or nr_of_pixels of it from beg_x on, to
+			//   planar linear sRGB floats; returns 0 if there is no such row
+
+	if (y >= img.rows() || beg_x >= img.columns())
+		return 0;
+
+	if (!nr_of_pixels || nr_of_pixels > img.columns() - beg_x)
+		nr_of_pixels=img.columns() - beg_x;
+
+	ensure_rows_loaded(y + 1);		// no-op once loading is complete
+
+	const uint step=img.pixel_step();
+	const ushort * const src_r=img.channel_row(0,y) + beg_x*step;
+	const ushort * const src_g=img.channel_row(1,y) + beg_x*step;
+	const ushort * const src_b=img.channel_row(2,y) + beg_x*step;
+
+	uint i=0;
+
+	/*!!! if (img.ColorSpace == IMAGE::CIELAB)
+		Lab_converter->convert_to_sRGB(v,p[0],
+						*(const schar *)&p[1],*(const schar *)&p[2]);
+	  else */ {
+#if AVX2_KERNELS
+		if (has_avx2())
+			i=get_linear_values_avx2(dest_r,dest_g,dest_b,src_r,src_g,src_b,
+										step,nr_of_pixels,gamma_table);
+#endif
+		for (uint k=i*step;i < nr_of_pixels;i++,k+=step) {
+			dest_r[i]=gamma_table[src_r[k]];
+			dest_g[i]=gamma_table[src_g[k]];
+			dest_b[i]=gamma_table[src_b[k]];
+			}
+		}
+
+	convert_to_sRGB(dest_r,dest_g,dest_b,nr_of_pixels);
+
+	return 1;
+	}
+
+#if AVX2_KERNELS
+
+static AVX2_FUNCTION uint convert_to_sRGB_avx2(float * const dest_r,
+				float * const dest_g,float * const dest_b,
+				const uint nr_of_pixels,const matrix &m,
+				const float R_nonlinear_transfer_coeff,
+				const float R_nonlinear_scaling,
+				const float B_nonlinear_transfer_coeff,
+				const float B_nonlinear_scaling)
+{			// the vector loop of image_reader_t::convert_to_sRGB(); returns
+			//   the number of pixels converted, a multiple of 8
+	uint i=0;
+
+	const __m256 R_coeff=_mm256_set1_ps(R_nonlinear_transfer_coeff);
+	const __m256 R_scaling=_mm256_set1_ps(R_nonlinear_scaling);
+	const __m256 B_coeff=_mm256_set1_ps(B_nonlinear_transfer_coeff);
+	const __m256 B_scaling=_mm256_set1_ps(B_nonlinear_scaling);
+	const __m256 m_xx=_mm256_set1_ps(m.x_vec.x),m_yx=_mm256_set1_ps(m.y_vec.x),
+										m_zx=_mm256_set1_ps(m.z_vec.x);
+	const __m256 m_xy=_mm256_set1_ps(m.x_vec.y),m_yy=_mm256_set1_ps(m.y_vec.y),
+										m_zy=_mm256_set1_ps(m.z_vec.y);
+	const __m256 m_xz=_mm256_set1_ps(m.x_vec.z),m_yz=_mm256_set1_ps(m.y_vec.z),
+										m_zz=_mm256_set1_ps(m.z_vec.z);
+
+	for (;i+8 <= nr_of_pixels;i+=8) {
+		__m256 r=_mm256_loadu_ps(dest_r + i);
+		const __m256 g=_mm256_loadu_ps(dest_g + i);
+		__m256 b=_mm256_loadu_ps(dest_b + i);
+
+		r=_mm256_min_ps(r,_mm256_mul_ps(
+					_mm256_sub_ps(r,_mm256_mul_ps(R_coeff,g)),R_scaling));
+		b=_mm256_min_ps(b,_mm256_mul_ps(
+					_mm256_sub_ps(b,_mm256_mul_ps(B_coeff,g)),B_scaling));
+
+		_mm256_storeu_ps(dest_r + i,_mm256_add_ps(_mm256_add_ps(
+						_mm256_mul_ps(m_xx,r),_mm256_mul_ps(m_yx,g)),
+												_mm256_mul_ps(m_zx,b)));
+		_mm256_storeu_ps(dest_g + i,_mm256_add_ps(_mm256_add_ps(
+						_mm256_mul_ps(m_xy,r),_mm256_mul_ps(m_yy,g)),
+												_mm256_mul_ps(m_zy,b)));
+		_mm256_storeu_ps(dest_b + i,_mm256_add_ps(_mm256_add_ps(
+						_mm256_mul_ps(m_xz,r),_mm256_mul_ps(m_yz,g)),
+												_mm256_mul_ps(m_zz,b)));
+		}
+
+	return i;
+	}
+
+#endif
+
+void image_reader_t::convert_to_sRGB(float * const dest_r,
+				float * const dest_g,float * const dest_b,
+				const uint nr_of_pixels) const
+{			// corrects sensor bleed and remaps linear camera RGB to linear
+			//   sRGB, in place
+
+	uint i=0;
+
+		// Correct sensor nonlinear bleed and remap sensor primaries to sRGB.
+		//   The vector loops below compute exactly the same as the scalar
+		//   loop at the end, which also handles the leftover pixels
+
+#if AVX2_KERNELS
+	if (has_avx2())
+		i=convert_to_sRGB_avx2(dest_r,dest_g,dest_b,nr_of_pixels,m,
+						R_nonlinear_transfer_coeff,R_nonlinear_scaling,
+						B_nonlinear_transfer_coeff,B_nonlinear_scaling);
+#endif
+#if defined(__SSE2__)
+	{ const __m128 R_coeff=_mm_set1_ps(R_nonlinear_transfer_coeff);
+	const __m128 R_scaling=_mm_set1_ps(R_nonlinear_scaling);
+	const __m128 B_coeff=_mm_set1_ps(B_nonlinear_transfer_coeff);
+	const __m128 B_scaling=_mm_set1_ps(B_nonlinear_scaling);
+	const __m128 m_xx=_mm_set1_ps(m.x_vec.x),m_yx=_mm_set1_ps(m.y_vec.x),
+										m_zx=_mm_set1_ps(m.z_vec.x);
+	const __m128 m_xy=_mm_set1_ps(m.x_vec.y),m_yy=_mm_set1_ps(m.y_vec.y),
+										m_zy=_mm_set1_ps(m.z_vec.y);
+	const __m128 m_xz=_mm_set1_ps(m.x_vec.z),m_yz=_mm_set1_ps(m.y_vec.z),
+										m_zz=_mm_set1_ps(m.z_vec.z);
+
+	for (;i+4 <= nr_of_pixels;i+=4) {
+		__m128 r=_mm_loadu_ps(dest_r + i);
+		const __m128 g=_mm_loadu_ps(dest_g + i);
+		__m128 b=_mm_loadu_ps(dest_b + i);
+
+		r=_mm_min_ps(r,_mm_mul_ps(_mm_sub_ps(r,_mm_mul_ps(R_coeff,g)),
+																R_scaling));
+		b=_mm_min_ps(b,_mm_mul_ps(_mm_sub_ps(b,_mm_mul_ps(B_coeff,g)),
+																B_scaling));
+
+		_mm_storeu_ps(dest_r + i,_mm_add_ps(_mm_add_ps(
+						_mm_mul_ps(m_xx,r),_mm_mul_ps(m_yx,g)),
+												_mm_mul_ps(m_zx,b)));
+		_mm_storeu_ps(dest_g + i,_mm_add_ps(_mm_add_ps(
+						_mm_mul_ps(m_xy,r),_mm_mul_ps(m_yy,g)),
+												_mm_mul_ps(m_zy,b)));
+		_mm_storeu_ps(dest_b + i,_mm_add_ps(_mm_add_ps(
+						_mm_mul_ps(m_xz,r),_mm_mul_ps(m_yz,g)),
+												_mm_mul_ps(m_zz,b)));
+		}}
+#endif
+
+	for (;i < nr_of_pixels;i++) {
+		float r=dest_r[i];
+		const float g=dest_g[i];
+		float b=dest_b[i];
+
+		{ const float orig_R=(r-R_nonlinear_transfer_coeff*g) * R_nonlinear_scaling;
+		r=min(r,orig_R); }
+		{ const float orig_B=(b-B_nonlinear_transfer_coeff*g) * B_nonlinear_scaling;
+		b=min(b,orig_B); }
+
+		dest_r[i]=m.x_vec.x*r + m.y_vec.x*g + m.z_vec.x*b;
+		dest_g[i]=m.x_vec.y*r + m.y_vec.y*g + m.z_vec.y*b;
+		dest_b[i]=m.x_vec.z*r + m.y_vec.z*g + m.z_vec.z*b;
+		}
+	}
+
+void image_reader_t::get_conversion_coeffs(
+							float dest[NR_OF_CONVERSION_COEFFS]) const
+{			// everything that get_linear_RGB_row() depends on besides img
+
+	dest[0]=(float)gamma;
+	dest[1]=m.x_vec.x;	dest[2]=m.x_vec.y;	dest[3]=m.x_vec.z;
+	dest[4]=m.y_vec.x;	dest[5]=m.y_vec.y;	dest[6]=m.y_vec.z;
+	dest[7]=m.z_vec.x;	dest[8]=m.z_vec.y;	dest[9]=m.z_vec.z;
+	dest[10]=R_nonlinear_transfer_coeff;
+	dest[11]=R_nonlinear_scaling;
+	dest[12]=B_nonlinear_transfer_coeff;
+	dest[13]=B_nonlinear_scaling;
+	}
+
+void image_reader_t::get_spot_values(
+			const float x_fraction,const float y_fraction,uint dest[3]) const
+{
+	if (!img.columns() || !img.rows() || !is_loading_complete()) {
+		dest[0]=dest[1]=dest[2]=0;
+		return;
+		}
+
+	sint x=(sint)(x_fraction * img.columns());
+	if (x < 0)
+		x = 0;
+	if ((uint)x > img.columns()-1)
+		x = img.columns()-1;
+
+	sint y=(sint)(y_fraction * img.rows());
+	if (y < 0)
+		y = 0;
+	if ((uint)y > img.rows()-1)
+		y = img.rows()-1;
+
+	uint values[3];
+	float best_variation=-1;
+	for (uint size=4;size <= 40;size++) {
+		const float variation=
+					get_spot_averages((uint)x,(uint)y,values,size) / size;
+		if (best_variation > variation || best_variation < 0) {
+			best_variation = variation;
+			dest[0]=values[0];
+			dest[1]=values[1];
+			dest[2]=values[2];
+			}
+		}
+	}
+
+float image_reader_t::get_spot_averages(uint x,uint y,uint dest[3],
+													const uint size) const
+{
+	const uint beg_x=(x < size/2) ? 0 : (x - size/2);
+	const uint end_x=min(beg_x + size,img.columns());
+
+	const uint beg_y=(y < size/2) ? 0 : (y - size/2);
+	const uint end_y=min(beg_y + size,img.rows());
+
+	const uint N=(end_x - beg_x) * (end_y - beg_y);
+
+	uint sum[3];
+	double squares_sum;
+	spot_sums.get_sums(img,beg_x,beg_y,end_x,end_y,sum,squares_sum);
+
+	double population_variance=squares_sum;
+	for (uint i=0;i < 3;i++) {
+		dest[i]=(sum[i] + N/2) / N;
+		population_variance-=sum[i]*(double)sum[i]/N;
+		}
+
+	return (float)(population_variance / (N-1));
+	}
+
+/***************************************************************************/
+/**************************                       **************************/
+/************************** processing_phase1_t:: **************************/
+/**************************                       **************************/
+/***************************************************************************/
+
+processing_phase1_t::processing_phase1_t(image_reader_t &_image_reader,
+										const uint _undo_enh_shadows) :
+		image_reader(_image_reader), undo_enh_shadows(_undo_enh_shadows),
+		linear_line(new float [_image_reader.img.columns() * 3 + 1]),
+		planar_line(new quantum_type [_image_reader.img.columns() * 3 + 1]),
+		cur_row(0),
+		output_line(new quantum_type [_image_reader.img.columns() * 3 + 1]),
+		output_line_end(output_line + _image_reader.img.columns() * 3) {}
+
+processing_phase1_t::~processing_phase1_t(void)
+{
+	delete [] linear_line;
+	delete [] planar_line;
+	delete [] output_line;
+	}
+
+#if PHOTOPROC_QUANTUM_BITS == 8
+
+/* The 8-bit sqrt optimization tables are calculated by this Perl script:
+
+#!/usr/bin/perl
+
+use POSIX;
+$FIXED_POINT_BITS=24;
+
+sub calc_output_value($$$)
+{
+	my $i=shift;
+	my $highest_bit_nr=shift;
+	my $table_size_bits=shift;
+
+	my $input_float_value=
+			(2**($highest_bit_nr-$FIXED_POINT_BITS)) + 
+			(2**($highest_bit_nr-$FIXED_POINT_BITS-$table_size_bits)) * $i;
+	my $output_value=sqrt($input_float_value) * 255;
+	$output_value=255 if ($output_value > 255);
+	return $output_value;
+	}
+
+my $total_table_len=0;
+$sqrt_data_string='';
+
+for my $highest_bit_nr (0..31) {
+	$avgerror=0;
+	$table_string='';
+
+	TABLESIZEBITS: for ($table_size_bits=0;
+				$table_size_bits < $FIXED_POINT_BITS;$table_size_bits++) {
+
+		$table_string="\n\n";
+		$avgerror=0;
+		my $tablesize=1 << $table_size_bits;
 		my $min_output_value=calc_output_value(0,
 										$highest_bit_nr,$table_size_bits);
 		my $values_printed=0;
@@ -927,7 +1991,8 @@ const processing_phase1_t::sqrt_data_t processing_phase1_t::sqrt_data[32]={
 					};
 #endif
 
-quantum_type processing_phase1_t::process_value(float value)
+quantum_type processing_phase1_t::process_value(float value,
+												const uint undo_enh_shadows)
 {
 	if (value < 0)
 		value = 0;
@@ -960,25 +2025,210 @@ quantum_type processing_phase1_t::process_value(float value)
 			}
 		}
 
-	return float_sqrt_to_quantum(value);
+	return float_sqrt_to_quantum(value);
+	}
+
+#if AVX2_KERNELS
+
+static inline AVX2_FUNCTION __m256 undo_enh_shadows_vec(const __m256 value)
+{			// same approximation as in process_value(), in float
+	const __m256 one=_mm256_set1_ps(1.0f);
+	const __m256 x=_mm256_div_ps(value,_mm256_set1_ps(0.83f));
+	const __m256 x1=_mm256_sub_ps(one,x);
+	const __m256 x1_cubed=_mm256_mul_ps(_mm256_mul_ps(x1,x1),x1);
+	const __m256 z=_mm256_sub_ps(_mm256_sub_ps(_mm256_set1_ps(1.0f/3),
+							_mm256_mul_ps(x1,_mm256_set1_ps(0.08f))),
+							_mm256_mul_ps(x1_cubed,_mm256_set1_ps(0.19f)));
+	const __m256 result=_mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(0.83f),x),
+							_mm256_add_ps(x,_mm256_mul_ps(z,x1)));
+	return _mm256_blendv_ps(value,result,
+					_mm256_cmp_ps(x1,_mm256_setzero_ps(),_CMP_GT_OQ));
+	}
+
+static inline AVX2_FUNCTION __m256i sqrt_to_quantums_vec(__m256 value,
+												const uint undo_enh_shadows)
+{			// returns 32-bit quantums
+	value=_mm256_max_ps(value,_mm256_setzero_ps());
+	if (undo_enh_shadows)
+		value=undo_enh_shadows_vec(value);
+
+	const __m256 maxval=_mm256_set1_ps((float)QUANTUM_MAXVAL);
+	const __m256 q=_mm256_min_ps(
+					_mm256_mul_ps(_mm256_sqrt_ps(value),maxval),maxval);
+#if PHOTOPROC_QUANTUM_BITS == 8
+	return _mm256_cvtps_epi32(q);		// rounds, like sqrt_table
+#else
+	return _mm256_cvttps_epi32(q);		// truncates, like the scalar code
+#endif
+	}
+
+#endif
+
+#if defined(__SSE2__)
+
+static inline __m128 undo_enh_shadows_vec(const __m128 value)
+{			// same approximation as in process_value(), in float
+	const __m128 one=_mm_set1_ps(1.0f);
+	const __m128 x=_mm_div_ps(value,_mm_set1_ps(0.83f));
+	const __m128 x1=_mm_sub_ps(one,x);
+	const __m128 x1_cubed=_mm_mul_ps(_mm_mul_ps(x1,x1),x1);
+	const __m128 z=_mm_sub_ps(_mm_sub_ps(_mm_set1_ps(1.0f/3),
+							_mm_mul_ps(x1,_mm_set1_ps(0.08f))),
+							_mm_mul_ps(x1_cubed,_mm_set1_ps(0.19f)));
+	const __m128 result=_mm_mul_ps(_mm_mul_ps(_mm_set1_ps(0.83f),x),
+							_mm_add_ps(x,_mm_mul_ps(z,x1)));
+	const __m128 mask=_mm_cmpgt_ps(x1,_mm_setzero_ps());
+	return _mm_or_ps(_mm_and_ps(mask,result),_mm_andnot_ps(mask,value));
+	}
+
+static inline __m128i sqrt_to_quantums_vec(__m128 value,
+												const uint undo_enh_shadows)
+{			// returns 32-bit quantums
+	value=_mm_max_ps(value,_mm_setzero_ps());
+	if (undo_enh_shadows)
+		value=undo_enh_shadows_vec(value);
+
+	const __m128 maxval=_mm_set1_ps((float)QUANTUM_MAXVAL);
+	const __m128 q=_mm_min_ps(_mm_mul_ps(_mm_sqrt_ps(value),maxval),maxval);
+#if PHOTOPROC_QUANTUM_BITS == 8
+	return _mm_cvtps_epi32(q);			// rounds, like sqrt_table
+#else
+	return _mm_cvttps_epi32(q);			// truncates, like the scalar code
+#endif
+	}
+
+#endif
+
+#if AVX2_KERNELS
+
+static AVX2_FUNCTION uint process_values_avx2(quantum_type * const dest,
+						const float * const src,const uint count,
+						const uint undo_enh_shadows)
+{			// the vector loop of processing_phase1_t::process_values();
+			//   returns the number of values processed, a multiple of 16
+	uint i=0;
+
+	for (;i+16 <= count;i+=16) {
+		const __m256i a=sqrt_to_quantums_vec(
+								_mm256_loadu_ps(src + i),undo_enh_shadows);
+		const __m256i b=sqrt_to_quantums_vec(
+								_mm256_loadu_ps(src + i + 8),undo_enh_shadows);
+		const __m256i words=_mm256_permute4x64_epi64(		// undo lane split
+								_mm256_packus_epi32(a,b),0xd8);
+#if PHOTOPROC_QUANTUM_BITS == 8
+		_mm_storeu_si128((__m128i *)(dest + i),
+					_mm_packus_epi16(_mm256_castsi256_si128(words),
+									_mm256_extracti128_si256(words,1)));
+#else
+		_mm256_storeu_si256((__m256i *)(dest + i),words);
+#endif
+		}
+
+	return i;
+	}
+
+#endif
+
+void processing_phase1_t::process_values(quantum_type * const dest,
+						const float * const src,const uint count,
+						const uint undo_enh_shadows)
+{			// the vector code may differ from process_value() by one
+			//   quantum, see get_max_vector_error()
+	uint i=0;
+
+#if AVX2_KERNELS
+	if (has_avx2())
+		i=process_values_avx2(dest,src,count,undo_enh_shadows);
+#endif
+#if defined(__SSE2__)
+	for (;i+8 <= count;i+=8) {
+		const __m128i a=sqrt_to_quantums_vec(
+								_mm_loadu_ps(src + i),undo_enh_shadows);
+		const __m128i b=sqrt_to_quantums_vec(
+								_mm_loadu_ps(src + i + 4),undo_enh_shadows);
+#if PHOTOPROC_QUANTUM_BITS == 8
+		const __m128i words=_mm_packs_epi32(a,b);
+		_mm_storel_epi64((__m128i *)(dest + i),_mm_packus_epi16(words,words));
+#else
+			// SSE2 has no unsigned 32->16 bit pack; shift into signed range
+		const __m128i bias32=_mm_set1_epi32(0x8000);
+		const __m128i words=_mm_packs_epi32(
+					_mm_sub_epi32(a,bias32),_mm_sub_epi32(b,bias32));
+		_mm_storeu_si128((__m128i *)(dest + i),
+							_mm_xor_si128(words,_mm_set1_epi16((short)0x8000)));
+#endif
+		}
+#endif
+
+	for (;i < count;i++)
+		dest[i]=process_value(src[i],undo_enh_shadows);
+	}
+
+uint processing_phase1_t::get_max_vector_error(void)
+{			// compares process_values() with process_value() over the input
+			//   range; returns the largest difference in quantums
+
+	const uint count=100000;
+	float * const src=new float [count];
+	quantum_type * const dest=new quantum_type [count];
+
+	for (uint i=0;i < count;i++)		// quadratic, as quantums are sqrt
+		src[i]=(i / (float)(count-1)) * (i / (float)(count-1)) * 1.1f - 0.01f;
+
+	uint max_error=0;
+	for (uint undo_enh_shadows=0;undo_enh_shadows <= 1;undo_enh_shadows++) {
+		process_values(dest,src,count,undo_enh_shadows);
+		for (uint i=0;i < count;i++) {
+			const sint error=(sint)dest[i] -
+								(sint)process_value(src[i],undo_enh_shadows);
+			if (max_error < (uint)abs(error))
+				max_error = (uint)abs(error);
+			}
+		}
+
+	delete [] src;
+	delete [] dest;
+
+	return max_error;
 	}
 
 void processing_phase1_t::get_line(void)
 {			// outputs a line of 2.0-gamma RGB quantums
 
-	for (quantum_type *p=output_line;p < output_line_end;p+=3) {
-		float rgb[3];		// red, green, blue
-		image_reader.get_linear_RGB(rgb);
+	get_line(cur_row++);
+	}
+
+void processing_phase1_t::get_line(const uint y)
+{
+	get_line_part(y,0,(output_line_end - output_line) / 3);
+	}
+
+void processing_phase1_t::get_line_part(const uint y,const uint beg_x,
+												const uint nr_of_pixels)
+{			// outputs pixels beg_x..beg_x+nr_of_pixels-1 of line y
+
+	const quantum_type * const r=planar_line;
+	const quantum_type * const g=planar_line + nr_of_pixels;
+	const quantum_type * const b=planar_line + 2*nr_of_pixels;
+
+	if (!image_reader.get_linear_RGB_row(y,linear_line,
+						linear_line + nr_of_pixels,linear_line + 2*nr_of_pixels,
+						beg_x,nr_of_pixels))
+		memset(linear_line,'\0',3 * nr_of_pixels * sizeof(*linear_line));
 
-		p[0]=process_value(rgb[0]);
-		p[1]=process_value(rgb[1]);
-		p[2]=process_value(rgb[2]);
+	process_values(planar_line,linear_line,3*nr_of_pixels,undo_enh_shadows);
+
+	quantum_type *p=output_line;
+	for (uint i=0;i < nr_of_pixels;i++,p+=3) {
+		p[0]=r[i];
+		p[1]=g[i];
+		p[2]=b[i];
 		}
 	}
 
 void processing_phase1_t::skip_lines(const uint nr_of_lines)
 {
-	image_reader.skip_pixels(nr_of_lines * image_reader.img.columns());
+	cur_row+=nr_of_lines;
 	}
 
 /***************************************************************************/
@@ -989,70 +2239,196 @@ void processing_phase1_t::skip_lines(const uint nr_of_lines)
 
 color_and_levels_processing_t::color_and_levels_processing_t(
 												const params_t &_params) :
-					buf(new ushort [4 * (QUANTUM_MAXVAL+1)]), params(_params)
-{
+					buf(new ushort [4 * (QUANTUM_MAXVAL+1) + 2]), params(_params)
+{			// buf has 2 entries of slack for gathers in process_pixels()
+
 	const float   gain_errors[3]={0,0,0};	// {0,		+0.03,		+0.12   };
 	const float static_errors[3]={0,0,0};	// {+17/255.0,+15/255.0,	-5/255.0};
 
 	const float white_clipping_density=
 								params.white_clipping_stops * log10(2.0);
-	const float after_contrast_density_shift=
-								params.convert_to_grayscale ? log10(3.0) : 0;
+	float after_contrast_density_shifts[3]={0,0,0};
+	if (params.convert_to_grayscale) {
+		const float weight_sum=params.grayscale_weights[0] +
+					params.grayscale_weights[1] + params.grayscale_weights[2];
+		for (uint c=0;c < 3;c++)		// multiplies linear value by weight
+			after_contrast_density_shifts[c]=(weight_sum > 0) ?
+					log10(weight_sum / max(params.grayscale_weights[c],
+											weight_sum * 1e-6f)) : log10(3.0);
+		}
 
 	for (uint c=0;c < 3;c++) {
+		const float after_contrast_density_shift=
+										after_contrast_density_shifts[c];
 		uint table_nr=0;
 		for (;table_nr < c;table_nr++)
-			if (params.color_coeffs[c] == params.color_coeffs[table_nr])
+			if (params.color_coeffs[c] == params.color_coeffs[table_nr] &&
+						after_contrast_density_shift ==
+									after_contrast_density_shifts[table_nr])
 				break;
 
 		translation_tables[c]=buf + table_nr*(QUANTUM_MAXVAL+1);
 		if (table_nr != c)
 			continue;
 
-		float multiply_coeff=pow(2,params.exposure_shift) *
+		curve_params_t curve;
+		memset(&curve,'\0',sizeof(curve));		// keys are compared by memcmp
+		curve.gain_error=gain_errors[c];
+		curve.static_error=static_errors[c];
+		curve.contrast=params.contrast;
+		curve.multiply_coeff=pow(2,params.exposure_shift) *
 													params.color_coeffs[c];
+		curve.after_contrast_density_shift=after_contrast_density_shift;
+		curve.black_level=params.black_level;
+		curve.white_clipping_density=
+						white_clipping_density + after_contrast_density_shift;
+		curve.convert_to_grayscale=params.convert_to_grayscale;
+
+		get_translation_table(translation_tables[c],curve);
+		}
 
-		for (uint i=0;i <= QUANTUM_MAXVAL;i++) {
-			float value=i / (float)QUANTUM_MAXVAL;
-			value*=value;
+	grayscale_postprocessing_table=NULL;
+	if (params.convert_to_grayscale) {
+		grayscale_postprocessing_table=buf + 3*(QUANTUM_MAXVAL+1);
+		calc_table(grayscale_postprocessing_table,NULL);
+		}
+	}
 
-			value=process_value(value,gain_errors[c],static_errors[c],
-					params.contrast,multiply_coeff,
-					after_contrast_density_shift,params.black_level,
-					white_clipping_density + after_contrast_density_shift);
-			if (value < 0)
-				value = 0;
+color_and_levels_processing_t::table_cache_entry_t
+				color_and_levels_processing_t::table_cache[TABLE_CACHE_SIZE];
+uint color_and_levels_processing_t::table_cache_use_count=0;
+static pthread_mutex_t table_cache_mutex=PTHREAD_MUTEX_INITIALIZER;
 
-			if (params.convert_to_grayscale)
-				value=sqrt(value);
-			  else
-				value=pow(value,1/2.2);
+void color_and_levels_processing_t::get_translation_table(
+						ushort * const table,const curve_params_t &curve)
+{
+	const uint table_size=(QUANTUM_MAXVAL+1) * sizeof(*table);
 
-			sint sint_value=(sint)(value * 0xff00U);
-			if (sint_value > 0xff00)
-				sint_value = 0xff00;
+	pthread_mutex_lock(&table_cache_mutex);
 
-			translation_tables[c][i]=(ushort)sint_value;
+	for (uint i=0;i < TABLE_CACHE_SIZE;i++)
+		if (table_cache[i].table != NULL &&
+				!memcmp(&table_cache[i].curve,&curve,sizeof(curve))) {
+			memcpy(table,table_cache[i].table,table_size);
+			table_cache[i].last_use=++table_cache_use_count;
+			pthread_mutex_unlock(&table_cache_mutex);
+			return;
 			}
+
+	pthread_mutex_unlock(&table_cache_mutex);
+
+	calc_table(table,&curve);
+
+	pthread_mutex_lock(&table_cache_mutex);
+
+	uint lru_idx=0;
+	for (uint i=1;i < TABLE_CACHE_SIZE;i++)
+		if (table_cache[i].table == NULL ||
+				(table_cache[lru_idx].table != NULL &&
+						table_cache[lru_idx].last_use > table_cache[i].last_use))
+			lru_idx=i;
+
+	table_cache_entry_t &entry=table_cache[lru_idx];
+	if (entry.table == NULL)
+		entry.table=new ushort [QUANTUM_MAXVAL+1];
+	memcpy(entry.table,table,table_size);
+	entry.curve=curve;
+	entry.last_use=++table_cache_use_count;
+
+	pthread_mutex_unlock(&table_cache_mutex);
+	}
+
+ushort color_and_levels_processing_t::calc_table_value(const uint i,
+										const curve_params_t * const curve)
+{			// curve is NULL for grayscale_postprocessing_table
+
+	float value=i / (float)QUANTUM_MAXVAL;
+	value*=value;
+
+	if (curve != NULL) {
+		value=process_value(value,curve->gain_error,curve->static_error,
+					curve->contrast,curve->multiply_coeff,
+					curve->after_contrast_density_shift,curve->black_level,
+					curve->white_clipping_density);
+		if (value < 0)
+			value = 0;
 		}
 
-	grayscale_postprocessing_table=NULL;
-	if (params.convert_to_grayscale) {
-		grayscale_postprocessing_table=buf + 3*(QUANTUM_MAXVAL+1);
+	if (curve != NULL && curve->convert_to_grayscale)
+		value=sqrt(value);
+	  else
+		value=pow(value,1/2.2);
 
-		for (uint i=0;i <= QUANTUM_MAXVAL;i++) {
-			float value=i / (float)QUANTUM_MAXVAL;
-			value*=value;
+	sint sint_value=(sint)(value * 0xff00U);
+	if (sint_value > 0xff00)
+		sint_value = 0xff00;
 
-			value=pow(value,1/2.2);
+	return (ushort)sint_value;
+	}
 
-			sint sint_value=(sint)(value * 0xff00U);
-			if (sint_value > 0xff00)
-				sint_value = 0xff00;
+#if PHOTOPROC_QUANTUM_BITS == 8
+#define TABLE_SPARSE_STEP		1	// 8-bit tables are calculated in full
+#else
+#define TABLE_SPARSE_STEP		64
+#endif
+#define TABLE_MAX_INTERP_ERROR	8	// in 0..0xff00 units, 1/32 of 8-bit code
 
-			grayscale_postprocessing_table[i]=(ushort)sint_value;
-			}
+void color_and_levels_processing_t::calc_table(ushort * const table,
+										const curve_params_t * const curve)
+{
+		// The curves are smooth apart from the black and white clipping
+		//   points, so they are evaluated at every TABLE_SPARSE_STEP'th
+		//   entry and interpolated linearly in between. Segments around
+		//   clipping points, and segments where the midpoint is off by more
+		//   than TABLE_MAX_INTERP_ERROR, are split
+
+	table[0]=calc_table_value(0,curve);
+	for (uint beg=0;beg < QUANTUM_MAXVAL;beg+=TABLE_SPARSE_STEP) {
+		const uint end=min(beg + TABLE_SPARSE_STEP,(uint)QUANTUM_MAXVAL);
+		table[end]=calc_table_value(end,curve);
+		calc_table_segment(table,beg,end,curve);
+		}
+	}
+
+void color_and_levels_processing_t::calc_table_segment(ushort * const table,
+						const uint beg,const uint end,
+						const curve_params_t * const curve)
+{			// table[beg] and table[end] have been calculated
+
+	if (end - beg < 2)
+		return;
+
+	const uint mid=(beg + end) / 2;
+	table[mid]=calc_table_value(mid,curve);
+
+	const sint beg_value=table[beg],end_value=table[end];
+	const sint interp_value=beg_value +
+				(end_value - beg_value) * (sint)(mid - beg) / (sint)(end - beg);
+
+		// a segment which leaves the clipped range at black or white may
+		//   start steeply anywhere inside, so it is split in any case
+
+	const uint is_clipping_inside=
+						(beg_value == 0) != (end_value == 0) ||
+						(beg_value == 0xff00) != (end_value == 0xff00);
+
+	if (is_clipping_inside ||
+				abs(table[mid] - interp_value) > TABLE_MAX_INTERP_ERROR) {
+		calc_table_segment(table,beg,mid,curve);
+		calc_table_segment(table,mid,end,curve);
+		return;
 		}
+
+	for (uint i=beg+1;i < end;i++)
+		if (i != mid) {
+			const uint seg_beg=(i < mid) ? beg : mid;
+			const uint seg_end=(i < mid) ? mid : end;
+			const sint seg_beg_value=table[seg_beg];
+			const sint seg_end_value=table[seg_end];
+			table[i]=(ushort)(seg_beg_value + ((seg_end_value - seg_beg_value) *
+						(sint)(i - seg_beg) + (sint)(seg_end - seg_beg)/2) /
+												(sint)(seg_end - seg_beg));
+			}
 	}
 
 color_and_levels_processing_t::~color_and_levels_processing_t(void)
@@ -1166,51 +2542,1046 @@ float color_and_levels_processing_t::process_value(float linear_value,
 	return apply_white_soft_clipping(density_value,white_clipping_density);
 	}
 
+static void get_dither_thresholds(uint * const dest,const uint y)
+{		// sets dest[0..31] to the ordered dither thresholds 0..0xff of row
+		//   y, for columns 0..31; the 16x16 Bayer matrix repeats, so pixels
+		//   can be dithered by position in any order, and the noise has the
+		//   same amplitude as with the error diffusion used before
+
+	for (uint x=0;x < 16;x++) {
+		uint value=0;
+		for (uint bit=0;bit < 4;bit++) {
+			value|=(((x ^ y) >> bit) & 1) << (7 - 2*bit);
+			value|=(( y      >> bit) & 1) << (6 - 2*bit);
+			}
+		dest[x]=dest[x + 16]=value;
+		}
+	}
+
+#if AVX2_KERNELS
+
+static inline AVX2_FUNCTION __m256i gather_table_values(const ushort * const table,
+				const quantum_type * const src,const __m256i src_offsets)
+{			// returns the table values of the quantums at src + src_offsets;
+			//   32 bits are read at each quantum and table entry, so the
+			//   next 2 bytes after them have to be readable
+	const __m256i q=_mm256_and_si256(_mm256_set1_epi32(QUANTUM_MAXVAL),
+				_mm256_i32gather_epi32((const int *)src,src_offsets,
+													sizeof(quantum_type)));
+	return _mm256_and_si256(_mm256_set1_epi32(0xffff),
+				_mm256_i32gather_epi32((const int *)table,q,2));
+	}
+
+static inline AVX2_FUNCTION void store_pixels_vec(uchar * const dest,const __m256i pixels,
+										const uint dest_bytes_per_pixel)
+{			// pixels have their 3 bytes in the low bytes of each 32 bits;
+			//   with 3 bytes per pixel, 4 bytes after the 8 pixels are
+			//   overwritten, and with 4 the fourth bytes are kept
+	if (dest_bytes_per_pixel == 4) {
+		__m256i * const p=(__m256i *)dest;
+		_mm256_storeu_si256(p,_mm256_or_si256(pixels,_mm256_and_si256(
+				_mm256_set1_epi32(0xff000000),_mm256_loadu_si256(p))));
+		return;
+		}
+
+	const __m256i packed=_mm256_shuffle_epi8(pixels,_mm256_setr_epi8(
+					0,1,2,4,5,6,8,9,10,12,13,14,-1,-1,-1,-1,
+					0,1,2,4,5,6,8,9,10,12,13,14,-1,-1,-1,-1));
+	_mm_storeu_si128((__m128i *)dest,_mm256_castsi256_si128(packed));
+	_mm_storeu_si128((__m128i *)(dest + 12),
+									_mm256_extracti128_si256(packed,1));
+	}
+
+#endif
+
+void histogram_t::add(const histogram_t &histogram)
+{
+	for (uint c=0;c < 3;c++)
+		for (uint i=0;i < NR_OF_BINS;i++)
+			channels[c][i]+=histogram.channels[c][i];
+	for (uint i=0;i < NR_OF_BINS;i++)
+		luminance[i]+=histogram.luminance[i];
+
+	nr_of_pixels+=histogram.nr_of_pixels;
+	white_clipped_pixels+=histogram.white_clipped_pixels;
+	black_clipped_pixels+=histogram.black_clipped_pixels;
+	}
+
+#if AVX2_KERNELS
+
+static inline AVX2_FUNCTION void add_to_histogram_vec(histogram_t &histogram,
+							const __m256i r,const __m256i g,const __m256i b)
+{			// adds 8 pixels of output values 0..0xff00, as add_pixel()
+			//   does; only the bin increments are not vectorized
+	const __m256i c[3]={_mm256_srli_epi32(r,8),_mm256_srli_epi32(g,8),
+												_mm256_srli_epi32(b,8)};
+	const __m256i luminance=_mm256_srli_epi32(_mm256_add_epi32(
+				_mm256_add_epi32(_mm256_mullo_epi32(c[0],_mm256_set1_epi32(54)),
+							_mm256_mullo_epi32(c[1],_mm256_set1_epi32(183))),
+							_mm256_mullo_epi32(c[2],_mm256_set1_epi32(19))),8);
+
+	const __m256i white=_mm256_set1_epi32(0xff),black=_mm256_setzero_si256();
+	const uint white_mask=_mm256_movemask_ps(_mm256_castsi256_ps(
+				_mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi32(c[0],white),
+												_mm256_cmpeq_epi32(c[1],white)),
+												_mm256_cmpeq_epi32(c[2],white))));
+	const uint black_mask=_mm256_movemask_ps(_mm256_castsi256_ps(
+				_mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi32(c[0],black),
+												_mm256_cmpeq_epi32(c[1],black)),
+												_mm256_cmpeq_epi32(c[2],black))));
+	histogram.white_clipped_pixels+=__builtin_popcount(white_mask);
+	histogram.black_clipped_pixels+=__builtin_popcount(black_mask);
+
+	uint values[4][8];
+	for (uint k=0;k < 3;k++)
+		_mm256_storeu_si256((__m256i *)values[k],c[k]);
+	_mm256_storeu_si256((__m256i *)values[3],luminance);
+
+	for (uint j=0;j < 8;j++) {
+		histogram.channels[0][values[0][j]]++;
+		histogram.channels[1][values[1][j]]++;
+		histogram.channels[2][values[2][j]]++;
+		histogram.luminance[values[3][j]]++;
+		}
+	}
+
+#endif
+
+#if AVX2_KERNELS
+
+static AVX2_FUNCTION uint process_pixels_avx2(uchar * &dest,
+				const quantum_type * &src,const uint nr_of_pixels,
+				const ushort * const * const translation_tables,
+				const ushort * const grayscale_postprocessing_table,
+				const uint convert_to_grayscale,
+				const uint dest_r_idx,const uint dest_b_idx,
+				const uint dest_bytes_per_pixel,const uint * const thresholds,
+				histogram_t * const histogram,const uint show_clipping,
+				const uint white_marker,const uint black_marker)
+{			// the vector loops of color_and_levels_processing_t::
+			//   process_pixels(); returns the number of pixels processed,
+			//   and advances dest and src past them. The markers are
+			//   pixels in dest byte order, as store_pixels_vec() takes them
+	uint i=0;
+
+	const __m256i src_offsets=_mm256_setr_epi32(0,3,6,9,12,15,18,21);
+	const __m256i white_markers=_mm256_set1_epi32(white_marker);
+	const __m256i black_markers=_mm256_set1_epi32(black_marker);
+	const __m256i white_limit=_mm256_set1_epi32(0xff00 - 1);
+	const __m256i black_limit=_mm256_set1_epi32(0x100);
+
+	if (convert_to_grayscale) {
+		const __m256 scale=_mm256_set1_ps(1 / ((float)0xff00U*0xff00U));
+		for (;i+10 <= nr_of_pixels;i+=8,src+=3*8) {
+			__m256 sum=_mm256_setzero_ps();
+			for (uint c=0;c < 3;c++) {
+				const __m256 value=_mm256_cvtepi32_ps(gather_table_values(
+								translation_tables[c],src + c,src_offsets));
+				sum=_mm256_add_ps(sum,_mm256_mul_ps(value,value));
+				}
+			const __m256i gray_value=_mm256_and_si256(
+					_mm256_set1_epi32(0xffff),_mm256_i32gather_epi32(
+							(const int *)grayscale_postprocessing_table,
+							sqrt_to_quantums_vec(
+									_mm256_mul_ps(sum,scale),0),2));
+			if (histogram != NULL)
+				add_to_histogram_vec(*histogram,
+									gray_value,gray_value,gray_value);
+			const __m256i gray=_mm256_srli_epi32(_mm256_add_epi32(
+					_mm256_loadu_si256(
+							(const __m256i *)(thresholds + (i & 15))),
+					gray_value),8);
+			__m256i pixels=_mm256_mullo_epi32(gray,
+											_mm256_set1_epi32(0x010101));
+			if (show_clipping) {
+				pixels=_mm256_blendv_epi8(pixels,black_markers,
+							_mm256_cmpgt_epi32(black_limit,gray_value));
+				pixels=_mm256_blendv_epi8(pixels,white_markers,
+							_mm256_cmpgt_epi32(gray_value,white_limit));
+				}
+			store_pixels_vec(dest,pixels,dest_bytes_per_pixel);
+			dest+=8*dest_bytes_per_pixel;
+			}
+		}
+	  else {
+		const __m128i shift_r=_mm_cvtsi32_si128(8*dest_r_idx);
+		const __m128i shift_b=_mm_cvtsi32_si128(8*dest_b_idx);
+		for (;i+10 <= nr_of_pixels;i+=8,src+=3*8) {
+			const __m256i threshold=_mm256_loadu_si256(
+							(const __m256i *)(thresholds + (i & 15)));
+			__m256i c[3];
+			for (uint k=0;k < 3;k++)
+				c[k]=gather_table_values(translation_tables[k],
+											src + k,src_offsets);
+			if (histogram != NULL)
+				add_to_histogram_vec(*histogram,c[0],c[1],c[2]);
+			__m256i white_clipped=_mm256_setzero_si256();
+			__m256i black_clipped=_mm256_setzero_si256();
+			if (show_clipping)
+				for (uint k=0;k < 3;k++) {
+					white_clipped=_mm256_or_si256(white_clipped,
+								_mm256_cmpgt_epi32(c[k],white_limit));
+					black_clipped=_mm256_or_si256(black_clipped,
+								_mm256_cmpgt_epi32(black_limit,c[k]));
+					}
+			for (uint k=0;k < 3;k++)
+				c[k]=_mm256_srli_epi32(_mm256_add_epi32(threshold,c[k]),8);
+			__m256i pixels=_mm256_or_si256(_mm256_or_si256(
+							_mm256_sll_epi32(c[0],shift_r),
+							_mm256_slli_epi32(c[1],8)),
+							_mm256_sll_epi32(c[2],shift_b));
+			if (show_clipping) {
+				pixels=_mm256_blendv_epi8(pixels,black_markers,black_clipped);
+				pixels=_mm256_blendv_epi8(pixels,white_markers,white_clipped);
+				}
+			store_pixels_vec(dest,pixels,dest_bytes_per_pixel);
+			dest+=8*dest_bytes_per_pixel;
+			}
+		}
+
+	return i;
+	}
+
+#endif
+
 void color_and_levels_processing_t::process_pixels(
 				uchar *dest,const quantum_type *src,const uint nr_of_pixels,
 				const uint output_in_BGR_format,
-				const uint dest_bytes_per_pixel) const
+				const uint dest_bytes_per_pixel,const uint y,
+				histogram_t * const histogram) const
 {								//  src: 2.0-gamma quantum_type RGB
 								// dest: 2.2-gamma 8-bit RGB
-	const uchar * const dest_end=dest + dest_bytes_per_pixel*nr_of_pixels;
+	uint thresholds[32];
+	get_dither_thresholds(thresholds,y);
+
+	const uint dest_r_idx=output_in_BGR_format ? 2 : 0;
+	const uint dest_b_idx=output_in_BGR_format ? 0 : 2;
+
+	uint i=0;
+
+		// The vector loops handle 8 pixels at a time with gathers; they
+		//   leave at least 2 pixels for the scalar loops, so that reading
+		//   past the last quantum and writing past the 8 pixels stay
+		//   within the rows. The clipping overlay is blended into the
+		//   vector loops' pixels by compares on the table values, which
+		//   are clipped exactly when histogram_t counts them so
+
+	const uint show_clipping=params.show_clipping;
+	uchar white_marker[3],black_marker[3];		// in dest byte order
+	white_marker[dest_r_idx]=(uchar)(WHITE_CLIPPING_MARKER >> 16);
+	white_marker[1         ]=(uchar)(WHITE_CLIPPING_MARKER >> 8);
+	white_marker[dest_b_idx]=(uchar) WHITE_CLIPPING_MARKER;
+	black_marker[dest_r_idx]=(uchar)(BLACK_CLIPPING_MARKER >> 16);
+	black_marker[1         ]=(uchar)(BLACK_CLIPPING_MARKER >> 8);
+	black_marker[dest_b_idx]=(uchar) BLACK_CLIPPING_MARKER;
+
+#if AVX2_KERNELS
+	if (has_avx2() && (dest_bytes_per_pixel == 3 || dest_bytes_per_pixel == 4))
+		i=process_pixels_avx2(dest,src,nr_of_pixels,translation_tables,
+					grayscale_postprocessing_table,params.convert_to_grayscale,
+					dest_r_idx,dest_b_idx,dest_bytes_per_pixel,thresholds,
+					histogram,show_clipping,
+					white_marker[0] | (white_marker[1] << 8) |
+												(white_marker[2] << 16),
+					black_marker[0] | (black_marker[1] << 8) |
+												(black_marker[2] << 16));
+#endif
 
-#define DO_PROCESS_PIXELS(i,dest_c) \
-		{const uint c=translation_tables[i][src[i]] + remainder[i]; \
-		remainder[i]=c & 0xff; dest[dest_c]=(uchar)(c >> 8);} \
+	if (params.convert_to_grayscale) {
+		for (;i < nr_of_pixels;i++,dest+=dest_bytes_per_pixel,src+=3) {
+			float sum;
+			{ const float c=translation_tables[0][src[0]]; sum =c*c; }
+			{ const float c=translation_tables[1][src[1]]; sum+=c*c; }
+			{ const float c=translation_tables[2][src[2]]; sum+=c*c; }
 
-	if (!params.convert_to_grayscale) {
-		uint remainder[3]={0,0,0};
-		if (output_in_BGR_format)
-			for (;dest < dest_end;dest+=dest_bytes_per_pixel,src+=3) {
-				DO_PROCESS_PIXELS(0,2);
-				DO_PROCESS_PIXELS(1,1);
-				DO_PROCESS_PIXELS(2,0);
+			const uint gray_value=grayscale_postprocessing_table[
+					processing_phase1_t::float_sqrt_to_quantum(
+						sum * (1 / ((float)0xff00U*0xff00U))) ];
+			if (histogram != NULL)
+				histogram->add_pixel(gray_value >> 8,gray_value >> 8,
+														gray_value >> 8);
+			const uint value=gray_value + thresholds[i & 15];
+			dest[0]=dest[1]=dest[2]=(uchar)(value >> 8);
+			if (show_clipping && (gray_value >= 0xff00 || gray_value < 0x100)) {
+				const uchar * const marker=(gray_value >= 0xff00) ?
+												white_marker : black_marker;
+				dest[0]=marker[0];
+				dest[1]=marker[1];
+				dest[2]=marker[2];
 				}
-		  else
-			for (;dest < dest_end;dest+=dest_bytes_per_pixel,src+=3) {
-				DO_PROCESS_PIXELS(0,0);
-				DO_PROCESS_PIXELS(1,1);
-				DO_PROCESS_PIXELS(2,2);
+			}
+		if (histogram != NULL)
+			histogram->nr_of_pixels+=nr_of_pixels;
+		return;
+		}
+
+	for (;i < nr_of_pixels;i++,dest+=dest_bytes_per_pixel,src+=3) {
+		const uint threshold=thresholds[i & 15];
+		const uint r=translation_tables[0][src[0]];
+		const uint g=translation_tables[1][src[1]];
+		const uint b=translation_tables[2][src[2]];
+		if (histogram != NULL)
+			histogram->add_pixel(r >> 8,g >> 8,b >> 8);
+		dest[dest_r_idx]=(uchar)((r + threshold) >> 8);
+		dest[1         ]=(uchar)((g + threshold) >> 8);
+		dest[dest_b_idx]=(uchar)((b + threshold) >> 8);
+		if (show_clipping) {
+			const uchar *marker=NULL;
+			if (r >= 0xff00 || g >= 0xff00 || b >= 0xff00)
+				marker=white_marker;
+			  else if (r < 0x100 || g < 0x100 || b < 0x100)
+				marker=black_marker;
+			if (marker != NULL) {
+				dest[0]=marker[0];
+				dest[1]=marker[1];
+				dest[2]=marker[2];
 				}
+			}
+		}
+	if (histogram != NULL)
+		histogram->nr_of_pixels+=nr_of_pixels;
+	}
+
+void color_and_levels_processing_t::get_output_values(ushort *dest,
+				const quantum_type *src,const uint nr_of_pixels) const
+{								//  src: 2.0-gamma quantum_type RGB
+								// dest: 2.2-gamma RGB 0..0xff00
+
+	const ushort * const dest_end=dest + 3*nr_of_pixels;
+
+	if (!params.convert_to_grayscale) {
+		for (;dest < dest_end;dest+=3,src+=3) {
+			dest[0]=translation_tables[0][src[0]];
+			dest[1]=translation_tables[1][src[1]];
+			dest[2]=translation_tables[2][src[2]];
+			}
 		return;
 		}
-#undef DO_PROCESS_PIXELS
 
-	uint remainder=0;
-	for (;dest < dest_end;dest+=dest_bytes_per_pixel,src+=3) {
+	for (;dest < dest_end;dest+=3,src+=3) {
 		float sum;
 		{ const float c=translation_tables[0][src[0]]; sum =c*c; }
 		{ const float c=translation_tables[1][src[1]]; sum+=c*c; }
 		{ const float c=translation_tables[2][src[2]]; sum+=c*c; }
 
-		const uint value=grayscale_postprocessing_table[
+		dest[0]=dest[1]=dest[2]=grayscale_postprocessing_table[
 					processing_phase1_t::float_sqrt_to_quantum(
-						sum * (1 / ((float)0xff00U*0xff00U))) ] + remainder;
-		remainder=value & 0xff;
-		dest[0]=dest[1]=dest[2]=(uchar)(value >> 8);
+						sum * (1 / ((float)0xff00U*0xff00U))) ];
+		}
+	}
+
+/***************************************************************************/
+/****************************                  *****************************/
+/**************************** pipeline_lut_t:: *****************************/
+/****************************                  *****************************/
+/***************************************************************************/
+
+pipeline_lut_t::pipeline_lut_t(const image_reader_t &image_reader,
+					const uint _undo_enh_shadows,
+					const color_and_levels_processing_t &pass2,
+					const uint _grid_size) :
+		grid_size(max(_grid_size,2U)),
+		grid_coords(new float [0x10000]),
+		table(new float [4 * grid_size*grid_size*grid_size]),
+		output_curves(new float [3 * OUTPUT_CURVE_SIZE]),
+		undo_enh_shadows(_undo_enh_shadows), pass2_params(pass2.params)
+{
+	image_reader.get_conversion_coeffs(conversion_coeffs);
+
+	const float max_coord=grid_size - 1;
+	for (uint i=0;i < 0x10000;i++)
+		grid_coords[i]=min(max_coord,max(0.0f,
+								image_reader.get_linear_value(i) * max_coord));
+
+		// 3D table: linear sRGB at every node, one plane of nodes at a time
+
+	{ const uint nr_of_nodes=grid_size * grid_size;
+	float * const linear=new float [3 * nr_of_nodes];
+
+	float *p=table;
+	for (uint z=0;z < grid_size;z++) {
+		for (uint y=0;y < grid_size;y++)
+			for (uint x=0;x < grid_size;x++) {
+				const uint i=x + y*grid_size;
+				linear[i                ]=x / max_coord;
+				linear[i +   nr_of_nodes]=y / max_coord;
+				linear[i + 2*nr_of_nodes]=z / max_coord;
+				}
+
+		image_reader.convert_to_sRGB(linear,linear + nr_of_nodes,
+										linear + 2*nr_of_nodes,nr_of_nodes);
+
+		for (uint i=0;i < nr_of_nodes;i++,p+=4) {
+			p[0]=linear[i];
+			p[1]=linear[i +   nr_of_nodes];
+			p[2]=linear[i + 2*nr_of_nodes];
+			p[3]=0;
+			}
+		}
+
+	delete [] linear; }
+
+		// output curves: phase 1 and color and levels processing of
+		//   grays, which are processed like any other color per channel
+
+	{ const uint n=OUTPUT_CURVE_SIZE;
+	float * const linear=new float [3 * n];
+	quantum_type * const planar=new quantum_type [3 * n];
+	quantum_type * const quantums=new quantum_type [3 * n];
+	ushort * const values=new ushort [3 * n];
+
+	for (uint i=0;i < n;i++) {
+		const float sqrt_value=i / (float)(n-1);
+		linear[i]=linear[i + n]=linear[i + 2*n]=sqrt_value * sqrt_value;
+		}
+	processing_phase1_t::process_values(planar,linear,3*n,undo_enh_shadows);
+	for (uint i=0;i < n;i++) {
+		quantums[3*i  ]=planar[i];
+		quantums[3*i+1]=planar[i +   n];
+		quantums[3*i+2]=planar[i + 2*n];
+		}
+	pass2.get_output_values(values,quantums,n);
+
+	for (uint i=0;i < n;i++)
+		for (uint c=0;c < 3;c++)
+			output_curves[c*n + i]=values[3*i + c];
+
+	delete [] linear;
+	delete [] planar;
+	delete [] quantums;
+	delete [] values; }
+	}
+
+pipeline_lut_t::~pipeline_lut_t(void)
+{
+	delete [] grid_coords;
+	delete [] table;
+	delete [] output_curves;
+	}
+
+uint pipeline_lut_t::is_built_for(const image_reader_t &image_reader,
+				const uint _undo_enh_shadows,
+				const color_and_levels_processing_t::params_t &params) const
+{
+	float coeffs[image_reader_t::NR_OF_CONVERSION_COEFFS];
+	image_reader.get_conversion_coeffs(coeffs);
+
+	return !memcmp(coeffs,conversion_coeffs,sizeof(coeffs)) &&
+				_undo_enh_shadows == undo_enh_shadows &&
+				!memcmp(&params,&pass2_params,sizeof(params));
+	}
+
+#if AVX2_KERNELS
+
+static AVX2_FUNCTION uint interpolate_avx2(float * const dest_r,
+				float * const dest_g,float * const dest_b,
+				const ushort * const src_r,const ushort * const src_g,
+				const ushort * const src_b,const uint src_step,
+				const uint nr_of_pixels,const float * const grid_coords,
+				const float * const table,const uint grid_size,
+				const float * const output_curves,const uint curve_size)
+{			// the vector loop of pipeline_lut_t::interpolate(); returns
+			//   the number of pixels interpolated, a multiple of 8
+
+	const uint step_x=4,step_y=4*grid_size,step_z=4*grid_size*grid_size;
+	uint i=0;
+
+	const __m256i offsets=_mm256_setr_epi32(0,6,12,18,24,30,36,42);
+	const __m256i low_mask=_mm256_set1_epi32(0xffff);
+	const __m256i max_idx=_mm256_set1_epi32(grid_size - 2);
+	const __m256i v_step_x=_mm256_set1_epi32(step_x);
+	const __m256i v_step_y=_mm256_set1_epi32(step_y);
+	const __m256i v_step_z=_mm256_set1_epi32(step_z);
+	const __m256i all_mask=_mm256_set1_epi32(-1);
+	const __m256 curve_max_coord=_mm256_set1_ps(curve_size-1);
+	const __m256i curve_max_idx=_mm256_set1_epi32(curve_size-2);
+
+	for (;i+8 <= nr_of_pixels;i+=8) {
+		__m256i r,g,b;
+		if (src_step == 1) {
+			r=_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(src_r + i)));
+			g=_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(src_g + i)));
+			b=_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(src_b + i)));
+			}
+		  else {		// interleaved, rows have slack at the end
+			r=_mm256_and_si256(low_mask,_mm256_i32gather_epi32(
+							(const int *)(src_r + i*3),offsets,1));
+			g=_mm256_and_si256(low_mask,_mm256_i32gather_epi32(
+							(const int *)(src_g + i*3),offsets,1));
+			b=_mm256_and_si256(low_mask,_mm256_i32gather_epi32(
+							(const int *)(src_b + i*3),offsets,1));
+			}
+
+		const __m256 x=_mm256_i32gather_ps(grid_coords,r,4);
+		const __m256 y=_mm256_i32gather_ps(grid_coords,g,4);
+		const __m256 z=_mm256_i32gather_ps(grid_coords,b,4);
+
+		const __m256i ix=_mm256_min_epi32(_mm256_cvttps_epi32(x),max_idx);
+		const __m256i iy=_mm256_min_epi32(_mm256_cvttps_epi32(y),max_idx);
+		const __m256i iz=_mm256_min_epi32(_mm256_cvttps_epi32(z),max_idx);
+		const __m256 fx=_mm256_sub_ps(x,_mm256_cvtepi32_ps(ix));
+		const __m256 fy=_mm256_sub_ps(y,_mm256_cvtepi32_ps(iy));
+		const __m256 fz=_mm256_sub_ps(z,_mm256_cvtepi32_ps(iz));
+
+		const __m256i base=_mm256_add_epi32(_mm256_add_epi32(
+						_mm256_mullo_epi32(ix,v_step_x),
+						_mm256_mullo_epi32(iy,v_step_y)),
+						_mm256_mullo_epi32(iz,v_step_z));
+
+		const __m256i x_ge_y=_mm256_castps_si256(_mm256_cmp_ps(fx,fy,_CMP_GE_OQ));
+		const __m256i x_ge_z=_mm256_castps_si256(_mm256_cmp_ps(fx,fz,_CMP_GE_OQ));
+		const __m256i y_ge_z=_mm256_castps_si256(_mm256_cmp_ps(fy,fz,_CMP_GE_OQ));
+
+		const __m256i x_largest=_mm256_and_si256(x_ge_y,x_ge_z);
+		const __m256i y_largest=_mm256_andnot_si256(x_ge_y,y_ge_z);
+		const __m256i z_largest=_mm256_xor_si256(all_mask,
+								_mm256_or_si256(x_largest,y_largest));
+		const __m256i x_smallest=_mm256_xor_si256(all_mask,
+								_mm256_or_si256(x_ge_y,x_ge_z));
+		const __m256i y_smallest=_mm256_andnot_si256(y_ge_z,x_ge_y);
+		const __m256i z_smallest=_mm256_xor_si256(all_mask,
+								_mm256_or_si256(x_smallest,y_smallest));
+
+		const __m256i idx_0=base;
+		const __m256i idx_1=_mm256_add_epi32(base,
+						_mm256_set1_epi32(step_x + step_y + step_z));
+		const __m256i idx_A=_mm256_add_epi32(base,_mm256_or_si256(
+						_mm256_or_si256(_mm256_and_si256(x_largest,v_step_x),
+										_mm256_and_si256(y_largest,v_step_y)),
+										_mm256_and_si256(z_largest,v_step_z)));
+		const __m256i idx_B=_mm256_sub_epi32(idx_1,_mm256_or_si256(
+						_mm256_or_si256(_mm256_and_si256(x_smallest,v_step_x),
+										_mm256_and_si256(y_smallest,v_step_y)),
+										_mm256_and_si256(z_smallest,v_step_z)));
+
+		const __m256 w1=_mm256_max_ps(_mm256_max_ps(fx,fy),fz);
+		const __m256 w3=_mm256_min_ps(_mm256_min_ps(fx,fy),fz);
+		const __m256 w2=_mm256_sub_ps(_mm256_sub_ps(
+							_mm256_add_ps(_mm256_add_ps(fx,fy),fz),w1),w3);
+
+		float * const dest[3]={dest_r,dest_g,dest_b};
+		for (uint c=0;c < 3;c++) {
+			const float * const t=table + c;
+			const __m256 c_0=_mm256_i32gather_ps(t,idx_0,4);
+			const __m256 c_A=_mm256_i32gather_ps(t,idx_A,4);
+			const __m256 c_B=_mm256_i32gather_ps(t,idx_B,4);
+			const __m256 c_1=_mm256_i32gather_ps(t,idx_1,4);
+			const __m256 linear=_mm256_add_ps(_mm256_add_ps(
+						_mm256_add_ps(c_0,
+							_mm256_mul_ps(w1,_mm256_sub_ps(c_A,c_0))),
+							_mm256_mul_ps(w2,_mm256_sub_ps(c_B,c_A))),
+							_mm256_mul_ps(w3,_mm256_sub_ps(c_1,c_B)));
+
+			const __m256 u=_mm256_mul_ps(_mm256_sqrt_ps(_mm256_min_ps(
+						_mm256_max_ps(linear,_mm256_setzero_ps()),
+						_mm256_set1_ps(1.0f))),curve_max_coord);
+			const __m256i iu=_mm256_min_epi32(_mm256_cvttps_epi32(u),
+															curve_max_idx);
+			const __m256 fu=_mm256_sub_ps(u,_mm256_cvtepi32_ps(iu));
+			const float * const curve=output_curves + c*curve_size;
+			const __m256 v_0=_mm256_i32gather_ps(curve,iu,4);
+			const __m256 v_1=_mm256_i32gather_ps(curve + 1,iu,4);
+			_mm256_storeu_ps(dest[c] + i,_mm256_add_ps(v_0,
+							_mm256_mul_ps(fu,_mm256_sub_ps(v_1,v_0))));
+			}
+		}
+	return i;
+	}
+
+#endif
+
+void pipeline_lut_t::interpolate(float * const dest_r,float * const dest_g,
+				float * const dest_b,const ushort * const src_r,
+				const ushort * const src_g,const ushort * const src_b,
+				const uint src_step,const uint nr_of_pixels) const
+{
+		// Tetrahedral interpolation: with the fractions sorted as
+		//   w1 >= w2 >= w3, the value is
+		//   c0 + w1*(cA-c0) + w2*(cB-cA) + w3*(c1-cB), where cA is the
+		//   node one step along the axis of w1 and cB one more step along
+		//   the axis of w2. The result goes through the output curves,
+		//   interpolated linearly. The vector loop computes the same as
+		//   the scalar loop, which also handles the leftover pixels
+
+	const uint step_x=4,step_y=4*grid_size,step_z=4*grid_size*grid_size;
+	uint i=0;
+
+#if AVX2_KERNELS
+	if (has_avx2())
+		i=interpolate_avx2(dest_r,dest_g,dest_b,src_r,src_g,src_b,src_step,
+						nr_of_pixels,grid_coords,table,grid_size,
+						output_curves,OUTPUT_CURVE_SIZE);
+#endif
+
+	for (uint k=i*src_step;i < nr_of_pixels;i++,k+=src_step) {
+		const float x=grid_coords[src_r[k]];
+		const float y=grid_coords[src_g[k]];
+		const float z=grid_coords[src_b[k]];
+
+		const uint ix=min((uint)x,grid_size-2);
+		const uint iy=min((uint)y,grid_size-2);
+		const uint iz=min((uint)z,grid_size-2);
+		const float fx=x - ix,fy=y - iy,fz=z - iz;
+
+		const uint x_ge_y=(fx >= fy),x_ge_z=(fx >= fz),y_ge_z=(fy >= fz);
+
+		uint step_A,step_smallest;
+		if (x_ge_y && x_ge_z)
+			step_A=step_x;
+		  else if (!x_ge_y && y_ge_z)
+			step_A=step_y;
+		  else
+			step_A=step_z;
+		if (!x_ge_y && !x_ge_z)
+			step_smallest=step_x;
+		  else if (x_ge_y && !y_ge_z)
+			step_smallest=step_y;
+		  else
+			step_smallest=step_z;
+
+		const float w1=max(max(fx,fy),fz);
+		const float w3=min(min(fx,fy),fz);
+		const float w2=fx + fy + fz - w1 - w3;
+
+		const float * const c_0=table + ix*step_x + iy*step_y + iz*step_z;
+		const float * const c_1=c_0 + step_x + step_y + step_z;
+		const float * const c_A=c_0 + step_A;
+		const float * const c_B=c_1 - step_smallest;
+
+		float * const dest[3]={dest_r,dest_g,dest_b};
+		for (uint c=0;c < 3;c++) {
+			const float linear=c_0[c] + w1*(c_A[c]-c_0[c]) +
+						w2*(c_B[c]-c_A[c]) + w3*(c_1[c]-c_B[c]);
+
+			const float u=(float)sqrt(min(max(linear,0.0f),1.0f)) *
+												(OUTPUT_CURVE_SIZE-1);
+			const uint iu=min((uint)u,(uint)OUTPUT_CURVE_SIZE-2);
+			const float fu=u - iu;
+			const float * const curve=output_curves + c*OUTPUT_CURVE_SIZE;
+			dest[c][i]=curve[iu] + fu*(curve[iu+1] - curve[iu]);
+			}
+		}
+	}
+
+void pipeline_lut_t::process_pixels(uchar *dest,const ushort * const src_r,
+				const ushort * const src_g,const ushort * const src_b,
+				const uint src_step,const uint nr_of_pixels,
+				const uint output_in_BGR_format,
+				const uint dest_bytes_per_pixel,const uint y) const
+{			//  src: file values, as in image_buffer_t rows
+			// dest: 2.2-gamma 8-bit RGB
+
+	const uint dest_r_idx=output_in_BGR_format ? 2 : 0;
+	const uint dest_b_idx=output_in_BGR_format ? 0 : 2;
+
+	uint thresholds[32];		// same dithering as in
+	get_dither_thresholds(thresholds,y);	//   color_and_levels_processing_t
+	enum {CHUNK_SIZE=256};
+	float values[3][CHUNK_SIZE];
+	for (uint beg=0;beg < nr_of_pixels;beg+=CHUNK_SIZE) {
+		const uint n=min((uint)CHUNK_SIZE,nr_of_pixels - beg);
+		const uint k=beg * src_step;
+		interpolate(values[0],values[1],values[2],
+						src_r + k,src_g + k,src_b + k,src_step,n);
+
+		for (uint i=0;i < n;i++,dest+=dest_bytes_per_pixel) {
+			const uint threshold=thresholds[(beg + i) & 15];
+			const uint r=(uint)(values[0][i] + 0.5f) + threshold;
+			const uint g=(uint)(values[1][i] + 0.5f) + threshold;
+			const uint b=(uint)(values[2][i] + 0.5f) + threshold;
+			dest[dest_r_idx]=(uchar)(r >> 8);
+			dest[1         ]=(uchar)(g >> 8);
+			dest[dest_b_idx]=(uchar)(b >> 8);
+			}
+		}
+	}
+
+float pipeline_lut_t::get_max_error(const image_reader_t &image_reader,
+						const color_and_levels_processing_t &pass2) const
+{			// returns the largest difference from the exact pipeline in
+			//   8-bit codes, over a sample of colors
+
+	const uint count=0x10000;
+	ushort * const src=new ushort [3 * count + 2];	// slack for gathers
+	float * const linear=new float [3 * count];
+	quantum_type * const planar=new quantum_type [3 * count];
+	quantum_type * const quantums=new quantum_type [3 * count];
+	ushort * const exact=new ushort [3 * count];
+	float * const interpolated=new float [3 * count];
+
+	uint seed=1;
+	for (uint i=0;i < 3*count;i++) {
+		seed=seed * 1103515245U + 12345;
+		src[i]=(ushort)(seed >> 16);
+		}
+	for (uint i=0;i < count/16;i++)		// include grays
+		src[3*i+1]=src[3*i+2]=src[3*i];
+
+	for (uint i=0;i < count;i++) {
+		linear[i          ]=image_reader.get_linear_value(src[3*i  ]);
+		linear[i +   count]=image_reader.get_linear_value(src[3*i+1]);
+		linear[i + 2*count]=image_reader.get_linear_value(src[3*i+2]);
+		}
+	image_reader.convert_to_sRGB(linear,linear + count,linear + 2*count,count);
+	processing_phase1_t::process_values(planar,linear,3*count,
+															undo_enh_shadows);
+	for (uint i=0;i < count;i++) {
+		quantums[3*i  ]=planar[i];
+		quantums[3*i+1]=planar[i +   count];
+		quantums[3*i+2]=planar[i + 2*count];
+		}
+	pass2.get_output_values(exact,quantums,count);
+
+	interpolate(interpolated,interpolated + count,interpolated + 2*count,
+									src,src + 1,src + 2,3,count);
+
+	float max_error=0;
+	for (uint i=0;i < count;i++)
+		for (uint c=0;c < 3;c++) {
+			const float error=fabs(interpolated[i + c*count] - exact[3*i + c]);
+			if (max_error < error)
+				max_error = error;
+			}
+
+	delete [] src;
+	delete [] linear;
+	delete [] planar;
+	delete [] quantums;
+	delete [] exact;
+	delete [] interpolated;
+
+	return max_error / 0x100;
+	}
+
+/***************************************************************************/
+/******************************               ******************************/
+/****************************** resampler_t:: ******************************/
+/******************************               ******************************/
+/***************************************************************************/
+
+void resampler_t::axis_t::init(const uint src_size,const uint dest_size,
+														const kernel_t kernel)
+{
+	const double scale=src_size / (double)dest_size;	// src pixels per dest
+	const double filter_scale=max(scale,1.0);			// kernel widening
+	const double support=(kernel == LANCZOS3) ? 3.0 :
+								(kernel == TRIANGLE) ? 1.0 : 0.5;
+
+	taps=(uint)ceil(2 * support * filter_scale) + 3;
+	first=new uint [dest_size];
+	count=new uint [dest_size];
+	weights=new short [dest_size * taps];
+	memset(weights,'\0',dest_size * taps * sizeof(*weights));
+
+	double * const values=new double [taps];
+	for (uint i=0;i < dest_size;i++) {
+		const double beg=i * scale,end=(i+1) * scale;	// in src pixel edges
+		const double center=(beg + end) / 2;
+
+		sint lo,hi;
+		if (kernel == BOX) {
+			lo=(sint)floor(beg);
+			hi=(sint)ceil(end) - 1;
+			}
+		  else {
+			lo=(sint)floor(center - 0.5 - support*filter_scale);
+			hi=(sint) ceil(center - 0.5 + support*filter_scale);
+			}
+		lo=max(lo,0);
+		hi=min(hi,(sint)src_size - 1);
+		hi=min(hi,lo + (sint)taps - 1);
+
+		double sum=0;
+		for (sint j=lo;j <= hi;j++) {
+			double value;
+			if (kernel == BOX)				// overlap of pixel j and beg..end
+				value=max(0.0,min(j + 1.0,end) - max((double)j,beg));
+			  else {
+				const double x=fabs(j + 0.5 - center) / filter_scale;
+				if (kernel == TRIANGLE)
+					value=max(0.0,1 - x);
+				  else
+				if (x < 1e-9)
+					value=1;
+				  else
+				if (x >= 3)
+					value=0;
+				  else {
+					const double pi_x=3.14159265358979 * x;
+					value=3 * sin(pi_x) * sin(pi_x / 3) / (pi_x * pi_x);
+					}
+				}
+			values[j - lo]=value;
+			sum+=value;
+			}
+
+		while (lo < hi && values[0] == 0) {		// trim zero weights
+			memmove(values,values + 1,(hi - lo) * sizeof(*values));
+			lo++;
+			}
+		while (hi > lo && values[hi - lo] == 0)
+			hi--;
+
+		if (sum <= 0) {					// nearest source pixel
+			lo=hi=min(max((sint)center,0),(sint)src_size - 1);
+			values[0]=sum=1;
+			}
+
+			// rounding errors go to the largest weight, so that the
+			//   weights add up exactly
+
+		first[i]=lo;
+		count[i]=hi - lo + 1;
+		short * const w=weights + i*taps;
+		sint total=0;
+		uint largest=0;
+		for (uint k=0;k < count[i];k++) {
+			w[k]=(short)floor(values[k] / sum * (1 << WEIGHT_BITS) + 0.5);
+			total+=w[k];
+			if (values[k] > values[largest])
+				largest=k;
+			}
+		w[largest]=(short)(w[largest] + (1 << WEIGHT_BITS) - total);
+		}
+
+	delete [] values;
+	}
+
+void resampler_t::axis_t::free(void)
+{
+	delete [] first;
+	delete [] count;
+	delete [] weights;
+	}
+
+resampler_t::resampler_t(const vec<uint> &_src_size,
+				const vec<uint> &_dest_size,const kernel_t kernel) :
+						src_size(_src_size), dest_size(_dest_size)
+{
+	horizontal.init(src_size.x,dest_size.x,kernel);
+	vertical.init(src_size.y,dest_size.y,kernel);
+	}
+
+resampler_t::~resampler_t(void)
+{
+	horizontal.free();
+	vertical.free();
+	}
+
+template <class T> inline T resampler_t::weighted_sum_to_sample(
+															const sint sum)
+{
+	const sint value=(sum + (1 << (WEIGHT_BITS-1))) >> WEIGHT_BITS;
+	return (value < 0) ? 0 : (value > (sint)(T)~0U) ? (T)~0U : (T)value;
+	}
+
+#if AVX2_KERNELS
+
+static inline AVX2_FUNCTION __m128i load_4_samples(const uchar * const p)
+{
+	sint value;
+	memcpy(&value,p,sizeof(value));
+	return _mm_cvtepu8_epi32(_mm_cvtsi32_si128(value));
+	}
+
+static inline AVX2_FUNCTION __m128i load_4_samples(const ushort * const p)
+			{ return _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i *)p)); }
+
+static inline AVX2_FUNCTION void store_4_samples(uchar * const p,const __m128i value)
+{
+	const __m128i words=_mm_packus_epi32(value,value);
+	const sint bytes=_mm_cvtsi128_si32(_mm_packus_epi16(words,words));
+	memcpy(p,&bytes,sizeof(bytes));
+	}
+
+static inline AVX2_FUNCTION void store_4_samples(ushort * const p,const __m128i value)
+			{ _mm_storel_epi64((__m128i *)p,_mm_packus_epi32(value,value)); }
+
+static inline AVX2_FUNCTION __m256i load_8_samples(const uchar * const p)
+		{ return _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)p)); }
+
+static inline AVX2_FUNCTION __m256i load_8_samples(const ushort * const p)
+		{ return _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)p)); }
+
+static inline AVX2_FUNCTION void store_8_samples(uchar * const p,const __m256i value)
+{
+	const __m128i words=_mm_packus_epi32(_mm256_castsi256_si128(value),
+										_mm256_extracti128_si256(value,1));
+	_mm_storel_epi64((__m128i *)p,_mm_packus_epi16(words,words));
+	}
+
+static inline AVX2_FUNCTION void store_8_samples(ushort * const p,const __m256i value)
+{
+	_mm_storeu_si128((__m128i *)p,_mm_packus_epi32(
+										_mm256_castsi256_si128(value),
+										_mm256_extracti128_si256(value,1)));
+	}
+
+template <class T> static AVX2_FUNCTION uint resample_pixels_avx2(
+				T * const dest,const T * const src,const uint * const first,
+				const uint * const count,const short * const weights,
+				const uint taps,const uint dest_size_x,const uint src_size_x,
+				const uint weight_bits)
+{			// the vector code of resampler_t::resample_row(); returns the
+			//   number of pixels resampled, and stops at the first one
+			//   after which one sample cannot be read and written
+
+	uint x=0;
+	const short *w=weights;
+	for (;x+1 < dest_size_x && first[x] + count[x] < src_size_x;
+														x++,w+=taps) {
+		const T * const s=src + 3*first[x];
+		const uint n=count[x];
+		__m128i sum=_mm_setzero_si128();
+		for (uint k=0;k < n;k++)
+			sum=_mm_add_epi32(sum,_mm_mullo_epi32(
+						load_4_samples(s + 3*k),_mm_set1_epi32(w[k])));
+		store_4_samples(dest + 3*x,_mm_srai_epi32(_mm_add_epi32(sum,
+					_mm_set1_epi32(1 << (weight_bits-1))),weight_bits));
+		}
+
+	return x;
+	}
+
+template <class T> static AVX2_FUNCTION uint combine_samples_avx2(
+				T * const dest,const T * const * const rows,
+				const short * const w,const uint n,const uint len,
+				const uint weight_bits)
+{			// the vector loop of resampler_t::combine_rows(); returns the
+			//   number of samples written, a multiple of 8
+
+	uint i=0;
+	for (;i+8 <= len;i+=8) {
+		__m256i sum=_mm256_setzero_si256();
+		for (uint k=0;k < n;k++)
+			sum=_mm256_add_epi32(sum,_mm256_mullo_epi32(
+							load_8_samples(rows[k] + i),_mm256_set1_epi32(w[k])));
+		store_8_samples(dest + i,_mm256_srai_epi32(_mm256_add_epi32(sum,
+					_mm256_set1_epi32(1 << (weight_bits-1))),weight_bits));
+		}
+
+	return i;
+	}
+
+#endif
+
+template <class T> void resampler_t::resample_row(T * const dest,
+											const T * const src) const
+{			// the vector code computes the same sums as the scalar code,
+			//   with all 3 channels of a pixel in one register; it reads
+			//   and writes one sample past the pixels, so the last ones
+			//   are left for the scalar code
+
+	uint x=0;
+
+#if AVX2_KERNELS
+	if (has_avx2())
+		x=resample_pixels_avx2(dest,src,horizontal.first,horizontal.count,
+						horizontal.weights,horizontal.taps,dest_size.x,
+						src_size.x,WEIGHT_BITS);
+#endif
+
+	const short *w=horizontal.weights + x*horizontal.taps;
+	for (;x < dest_size.x;x++,w+=horizontal.taps) {
+		const T * const s=src + 3*horizontal.first[x];
+		const uint n=horizontal.count[x];
+		T * const d=dest + 3*x;
+
+		sint r=0,g=0,b=0;
+		for (uint k=0;k < n;k++) {
+			r+=s[3*k  ] * w[k];
+			g+=s[3*k+1] * w[k];
+			b+=s[3*k+2] * w[k];
+			}
+		d[0]=weighted_sum_to_sample<T>(r);
+		d[1]=weighted_sum_to_sample<T>(g);
+		d[2]=weighted_sum_to_sample<T>(b);
+		}
+	}
+
+template <class T> void resampler_t::combine_rows(T * const dest,
+				const T * const * const rows,const uint dest_y) const
+{
+	const short * const w=vertical.weights + dest_y*vertical.taps;
+	const uint n=vertical.count[dest_y];
+	const uint len=dest_size.x * 3;
+
+	uint i=0;
+
+#if AVX2_KERNELS
+	if (has_avx2())
+		i=combine_samples_avx2(dest,rows,w,n,len,WEIGHT_BITS);
+#endif
+
+	for (;i < len;i++) {
+		sint sum=0;
+		for (uint k=0;k < n;k++)
+			sum+=rows[k][i] * w[k];
+		dest[i]=weighted_sum_to_sample<T>(sum);
+		}
+	}
+
+template <class T> uint resampler_t::resample_rows(T * const dest,
+				row_source_t<T> &source,
+				const uint beg_dest_y,const uint end_dest_y) const
+{			// returns 0 if source stopped it early
+
+		// horizontally resampled source rows are kept in a ring of
+		//   vertical.taps rows, so rows shared by consecutive dest rows
+		//   are resampled only once
+
+	const uint row_len=dest_size.x * 3;
+	const uint nr_of_slots=vertical.taps;
+	T * const ring=new T [nr_of_slots * row_len];
+	uint * const slot_rows=new uint [nr_of_slots];	// source row in slot
+	const T ** const rows=new const T * [nr_of_slots];
+	for (uint i=0;i < nr_of_slots;i++)
+		slot_rows[i]=UINT_MAX;
+
+	uint is_complete=1;
+	for (uint dest_y=beg_dest_y;dest_y < end_dest_y && is_complete;dest_y++) {
+		uint first,count;
+		get_source_rows(dest_y,first,count);
+
+		for (uint k=0;k < count;k++) {
+			const uint y=first + k;
+			T * const row=ring + (y % nr_of_slots) * row_len;
+			if (slot_rows[y % nr_of_slots] != y) {
+				const T * const src=source.get_row(y);
+				if (src == NULL) {
+					is_complete=0;
+					break;
+					}
+				resample_row(row,src);
+				slot_rows[y % nr_of_slots]=y;
+				}
+			rows[k]=row;
+			}
+
+		if (is_complete)
+			combine_rows(dest + dest_y*row_len,rows,dest_y);
 		}
+
+	delete [] ring;
+	delete [] slot_rows;
+	delete [] rows;
+
+	return is_complete;
 	}
 
+template void resampler_t::resample_row(uchar * const,
+												const uchar * const) const;
+template void resampler_t::resample_row(ushort * const,
+												const ushort * const) const;
+template void resampler_t::combine_rows(uchar * const,
+						const uchar * const * const,const uint) const;
+template void resampler_t::combine_rows(ushort * const,
+						const ushort * const * const,const uint) const;
+template uint resampler_t::resample_rows(uchar * const,
+				row_source_t<uchar> &,const uint,const uint) const;
+template uint resampler_t::resample_rows(ushort * const,
+				row_source_t<ushort> &,const uint,const uint) const;
+
 /***************************************************************************/
 /************************                           ************************/
 /************************ transfer matrix optimizer ************************/
@@ -2,9 +2,35 @@
    Licensing conditions are described in the file LICENSE
 */
 
+#include <pthread.h>
 #include <Magick++.h>
 #include "vec.hpp"
 
+	// for flags and counters shared between threads without a mutex
+
+#if defined(__ATOMIC_ACQUIRE)
+static inline uint load_acquire(const volatile uint &v)
+				{ return __atomic_load_n(&v,__ATOMIC_ACQUIRE); }
+static inline void store_release(volatile uint &v,const uint value)
+				{ __atomic_store_n(&v,value,__ATOMIC_RELEASE); }
+static inline void full_barrier(void)
+				{ __atomic_thread_fence(__ATOMIC_SEQ_CST); }
+static inline uint exchange(volatile uint &v,const uint value)
+				{ return __atomic_exchange_n(&v,value,__ATOMIC_ACQ_REL); }
+static inline uint add_and_fetch(volatile uint &v,const uint value)
+				{ return __atomic_add_fetch(&v,value,__ATOMIC_ACQ_REL); }
+#else
+static inline uint load_acquire(const volatile uint &v)
+				{ const uint value=v; __sync_synchronize(); return value; }
+static inline void store_release(volatile uint &v,const uint value)
+				{ __sync_synchronize(); v=value; }
+static inline void full_barrier(void) { __sync_synchronize(); }
+static inline uint exchange(volatile uint &v,const uint value)
+				{ __sync_synchronize(); return __sync_lock_test_and_set(&v,value); }
+static inline uint add_and_fetch(volatile uint &v,const uint value)
+				{ return __sync_add_and_fetch(&v,value); }
+#endif
+
 class Lab_to_sRGB_converter_t {
 
 	struct L_entry_t {
@@ -25,10 +51,225 @@ class Lab_to_sRGB_converter_t {
 					const uchar scaled_L,const schar a,const schar b) const;
 	};
 
+class image_buffer_t {
+	public:
+
+	enum layout_t {INTERLEAVED=0,PLANAR};
+
+	private:
+
+	ushort *buf;				// NULL if no image allocated
+	uint x_size,y_size;
+	layout_t layout;
+	uint row_stride;			// in ushorts; rows start at 64-byte boundary
+	void *mapped_addr;			// NULL if buf is not in a mapped file
+	uint mapped_len;
+	volatile uint *share_count;	// NULL unless buf has been shared; then
+								//   the number of image_buffer_t's using it
+
+	public:
+
+	image_buffer_t(void) : buf(NULL), x_size(0), y_size(0),
+								layout(INTERLEAVED), row_stride(0),
+								mapped_addr(NULL), mapped_len(0),
+								share_count(NULL) {}
+	~image_buffer_t(void) { release(); }
+
+	void allocate(const uint _x_size,const uint _y_size,
+										const layout_t _layout=INTERLEAVED);
+			// contents of the allocated image are undefined
+	void attach_mapped_file(void * const addr,const uint len,
+				const uint data_offset,const uint _x_size,const uint _y_size,
+				const layout_t _layout,const uint _row_stride);
+			// uses image data in memory-mapped file without copying;
+			//   the mapping is unmapped by release()
+	void share(image_buffer_t &other);
+			// makes this use the image of other without copying; the
+			//   image is freed when the last user releases it, possibly
+			//   in another thread. Shared images must not be written to
+	void release(void);
+	void swap(image_buffer_t &other);
+
+	uint columns(void) const { return x_size; }
+	uint rows(void) const { return y_size; }
+	uint get_size_in_bytes(void) const
+			{ return sizeof(*buf) * row_stride * y_size *
+										((layout == PLANAR) ? 3 : 1); }
+	layout_t get_layout(void) const { return layout; }
+	uint get_row_stride(void) const { return row_stride; }
+	const ushort *get_data(void) const { return buf; }
+			// rows are stored one after another, for all channels
+	uint pixel_step(void) const { return (layout == PLANAR) ? 1 : 3; }
+			// distance between adjacent pixels of a channel, in ushorts
+
+	ushort *channel_row(const uint c,const uint y) const
+		{		// c is 0..2 for red, green, blue
+			if (layout == PLANAR)
+				return buf + (c*y_size + y)*row_stride;
+			  else
+				return buf + y*row_stride + c;
+			}
+	};
+
+class image_cache_t {
+		// optional on-disk cache of decoded images, in the directory given
+		//   by PHOTOPROC_CACHE_DIR environment variable. Cache files hold
+		//   uncompressed image rows, so that they can be used via mmap.
+		//   The least recently used files are deleted when the cache grows
+		//   over PHOTOPROC_CACHE_MAX_MB megabytes (default 4096)
+	public:
+
+	enum {KEY_SIZE=1000};
+
+	private:
+
+	struct header_t {
+		char magic[8];
+		uint x_size,y_size;
+		uint layout;
+		uint row_stride;
+		uint data_len;			// in bytes
+		char key[KEY_SIZE];
+		};
+
+	static const char *get_dir(void);
+		// returns NULL if cache is not in use
+	static uint get_fname(char * const dest,const uint dest_size,
+												const char * const key);
+	static sint open_entry(const char * const key,header_t &header);
+		// returns -1 if there is no valid entry for key
+	static void prune(const double size_to_add);
+		// deletes the least recently used files, so that size_to_add
+		//   more bytes fit under the size limit
+
+	public:
+
+	static uint make_key(char * const dest,const char * const fname,
+										const char * const decode_flags);
+		// dest has to have KEY_SIZE bytes; the key identifies fname by its
+		//   absolute path, size and modification time. Returns 0 if cache
+		//   is not in use or fname is not accessible
+	static uint contains(const char * const key);
+	static uint load(image_buffer_t &img,const char * const key);
+		// returns 0 if there is no valid entry for key
+	static void save(const image_buffer_t &img,const char * const key);
+	};
+
+class ppm_stream_parser_t {
+	public:
+
+	struct receiver_t {
+		virtual uint ppm_header_parsed(const uint x_size,const uint y_size,
+													const uint maxval)=0;
+			// returns 0 if the image cannot be received
+		virtual void ppm_row_parsed(const uint y,const uchar * const data)=0;
+			// data has x_size*3 samples of 1 byte each if maxval < 256,
+			//   otherwise 2 bytes each in big-endian byte order
+		};
+
+	private:
+
+	receiver_t * const receiver;
+	uint header_pos,header_field_nr,header_field_value;
+	uint is_in_header_token,is_in_header_comment;
+	uint is_invalid;		// 0 or 1
+	uchar *row_buf;
+	uint row_len,row_buf_used_len;
+
+	uint parse_header_char(const uchar c);
+		// returns 0 if c is not valid at this point of header
+
+	public:
+
+	uint x_size,y_size,maxval;
+	uint nr_of_rows_parsed;
+
+	ppm_stream_parser_t(receiver_t * const _receiver);
+	~ppm_stream_parser_t(void) { delete [] row_buf; }
+
+	uint feed(const void *data,uint len);
+		// returns 0 if the stream is not a valid P6 PPM image;
+		//   data after the last row is ignored
+	uint is_header_parsed(void) const { return row_len != 0; }
+	};
+
+class ppm_image_decoder_t : private ppm_stream_parser_t::receiver_t {
+		// decodes a PPM stream into image_buffer_t, as the data arrives
+
+	image_buffer_t *img;
+	ppm_stream_parser_t parser;
+	ushort *sample_conversion_table;	// indexed by PPM sample; NULL if
+										//   samples need no conversion
+
+	virtual uint ppm_header_parsed(const uint x_size,const uint y_size,
+														const uint maxval);
+	virtual void ppm_row_parsed(const uint y,const uchar * const data);
+
+	public:
+
+	ppm_image_decoder_t(image_buffer_t &_img) : img(&_img), parser(this),
+											sample_conversion_table(NULL) {}
+	virtual ~ppm_image_decoder_t(void) { delete [] sample_conversion_table; }
+
+	uint feed(const void * const data,const uint len)
+									{ return parser.feed(data,len); }
+		// returns 0 if the stream is not a valid P6 PPM image
+	uint is_header_parsed(void) const { return parser.is_header_parsed(); }
+	uint nr_of_rows_decoded(void) const { return parser.nr_of_rows_parsed; }
+	uint is_complete(void) const
+					{ return is_header_parsed() &&
+								parser.nr_of_rows_parsed >= parser.y_size; }
+	void clear_missing_rows(void);
+		// sets rows not received to black
+	void move_image_to(image_buffer_t &dest) { dest.swap(*img); img=&dest; }
+		// rows decoded later go to dest; the previous contents of dest
+		//   are left in the old buffer
+	};
+
+class summed_area_tables_t {
+		// sums of pixel values and of their squares over rectangles of
+		//   image_buffer_t, in constant time. The tables are kept in tiles,
+		//   and a tile is built when it is first used
+
+	enum {TILE_SIZE=64,TILE_STRIDE=TILE_SIZE+1};
+
+	struct tile_t {		// sums of all pixels above and left of a position
+		uint sums[TILE_STRIDE*TILE_STRIDE][3];
+		double squares_sums[TILE_STRIDE*TILE_STRIDE];	// of all channels
+		};
+
+	tile_t **tiles;		// NULL entries for tiles not yet built
+	uint nr_of_tiles_x,nr_of_tiles_y;
+
+	static tile_t *build_tile(const image_buffer_t &img,
+										const uint tile_x,const uint tile_y);
+	public:
+
+	summed_area_tables_t(void) : tiles(NULL),
+									nr_of_tiles_x(0), nr_of_tiles_y(0) {}
+	~summed_area_tables_t(void) { clear(); }
+
+	void clear(void);
+		// has to be called when image contents change
+	void get_sums(const image_buffer_t &img,
+						const uint beg_x,const uint beg_y,
+						const uint end_x,const uint end_y,
+						uint sums[3],double &squares_sum);
+		// for pixels beg_x <= x < end_x, beg_y <= y < end_y
+	};
+
 class image_reader_t {
-	const Magick::PixelPacket *img_buf;
-	const Magick::PixelPacket *p;
-	const Magick::PixelPacket *end_p;
+	public:
+
+	struct stream_source_t {
+		virtual uint read_stream_data(const void * &data)=0;
+			// waits until data is available; returns data length,
+			//   or 0 if the stream has ended
+		virtual void release_stream_data(const void * const data)=0;
+		};
+
+	private:
+
 	double gamma;
 
 	Lab_to_sRGB_converter_t *Lab_converter;
@@ -37,12 +278,38 @@ class image_reader_t {
 	float B_nonlinear_transfer_coeff,B_nonlinear_scaling;
 	float R_nonlinear_transfer_coeff,R_nonlinear_scaling;
 
+	mutable summed_area_tables_t spot_sums;
+	stream_source_t *stream_source;	// NULL if image is completely loaded;
+									//   only used by the loading thread
+	ppm_image_decoder_t *ppm_decoder;
+	volatile uint loading_complete;	// 0 while rows of img may still be
+									//   written; read by other threads
+	image_buffer_t stream_img;	// image whose header has been read by
+								//   read_stream_header(), until it is
+								//   taken over by load_from_stream()
+	char stream_cache_key[image_cache_t::KEY_SIZE];
+							// where to save the image when it has been
+							//   completely loaded; empty if not to save
+	pthread_t cache_save_thread;	// writes img to image_cache_t, so that
+	uint is_cache_save_running;		//   the several hundred megabytes are
+	char cache_save_key[image_cache_t::KEY_SIZE];	//   not written by the
+													//   loading thread
+	image_buffer_t cache_save_img;	// shares the image being written with
+									//   img, which may be replaced before
+									//   the thread has finished
+
 	float get_spot_averages(uint x,uint y,uint dest[3],const uint size) const;
 	void load_postprocess(const char * const shooting_info_fname=NULL);
+	uint read_stream_chunk(void);
+		// returns 0 at the end of stream
+	void end_stream_loading(void);
+	void start_cache_save(const char * const cache_key);
+	void wait_for_cache_save(void);
+	static void *cache_save_thread_main(void * const arg);
 
 	public:
 
-	Magick::Image img;
+	image_buffer_t img;		// 16-bit RGB, as in the file
 
 	struct shooting_info_t {
 		uint ISO_speed;
@@ -66,17 +333,59 @@ class image_reader_t {
 	image_reader_t(void);
 	image_reader_t(const char * const fname);
 	void load_file(const char * const fname);
-	void load_from_memory(const void * const buf,const uint len,
+	uint read_stream_header(stream_source_t * const source,
+								const char * const cache_key=NULL);
+		// returns after reading the PPM header into a separate buffer;
+		//   img is not touched, so the caller need not lock out readers
+		//   of img while waiting for the header. Returns 0 if the stream
+		//   does not start with a valid PPM header. If cache_key is not
+		//   NULL, the image is saved to image_cache_t once it is complete
+	void load_from_stream(const char * const shooting_info_fname=NULL);
+		// makes the image whose header was read by read_stream_header()
+		//   the current one; image rows are read from the stream later,
+		//   as they are needed
+	void load_decoded_image(image_buffer_t &decoded_img,
+								const char * const shooting_info_fname=NULL,
+								const char * const cache_key=NULL);
+		// takes over the contents of decoded_img and gives the previous
+		//   image to decoded_img in return
+	uint load_from_cache(const char * const cache_key,
 								const char * const shooting_info_fname=NULL);
-		// buf must be allocated using malloc(); load_from_memory() will
-		//  take it under it's own management, it must NOT be freed by caller
+		// returns 0 if the image is not in image_cache_t
+	void finish_loading(void);
+		// reads the rest of the stream, if any. Only the loading thread
+		//   may call this; is_loading_complete() may be called by any
+		//   thread, and img rows may be read once it returns nonzero
+	void continue_loading(void);
+		// reads the next chunk of the stream, if any, waiting for it to
+		//   arrive; lets the loading thread read the stream a little at
+		//   a time between other work
+	void ensure_rows_loaded(const uint nr_of_rows);
+		// reads the stream until the first nr_of_rows rows of img are
+		//   there. Called by the loading thread, after which any thread
+		//   may read those rows until the loading thread reads further
+	uint is_loading_complete(void) const
+								{ return load_acquire(loading_complete); }
 
 	~image_reader_t(void);
 
-	void reset_read_pointer(void);
-	uint get_linear_RGB(float dest_rgb[3]);
-			// returns 0 when image data ends
-	void skip_pixels(const uint nr_of_pixels);
+	uint get_linear_RGB_row(const uint y,float * const dest_r,
+							float * const dest_g,float * const dest_b,
+							const uint beg_x=0,uint nr_of_pixels=0);
+			// converts row y, or nr_of_pixels of it from beg_x on, to
+			//   planar linear sRGB floats; returns 0 if there is no such
+			//   row. nr_of_pixels 0 means up to the end of row. Several
+			//   threads may read rows at the same time once
+			//   is_loading_complete() is nonzero
+	float get_linear_value(const ushort file_value) const
+								{ return gamma_table[file_value]; }
+	void convert_to_sRGB(float * const r,float * const g,float * const b,
+										const uint nr_of_pixels) const;
+			// corrects sensor bleed and remaps linear camera RGB to linear
+			//   sRGB, in place
+	enum {NR_OF_CONVERSION_COEFFS=14};
+	void get_conversion_coeffs(float dest[NR_OF_CONVERSION_COEFFS]) const;
+			// everything that get_linear_RGB_row() depends on besides img
 	void get_spot_values(const float x_fraction,const float y_fraction,
 														uint dest[3]) const;
 	};
@@ -110,7 +419,13 @@ class processing_phase1_t {
 	static const uchar sqrt_table[];
 #endif
 
-	quantum_type process_value(float value);
+	float * const linear_line;		// planar R, G, B rows of floats
+	quantum_type * const planar_line;	// linear_line as quantums
+	uint cur_row;
+
+	static quantum_type process_value(float value,
+										const uint undo_enh_shadows);
+		// scalar reference for process_values()
 
 	public:
 	quantum_type * const output_line;
@@ -122,8 +437,46 @@ class processing_phase1_t {
 	void skip_lines(const uint nr_of_lines);
 	void get_line(void);
 			// outputs a line of 2.0-gamma RGB quantums
+	void get_line(const uint y);
+			// outputs line y; instances with separate image rows may work
+			//   in separate threads once image loading is complete
+	void get_line_part(const uint y,const uint beg_x,
+											const uint nr_of_pixels);
+			// outputs pixels beg_x..beg_x+nr_of_pixels-1 of line y to the
+			//   start of output_line; they must be within the image
 	static inline quantum_type float_sqrt_to_quantum(const float value) throw();
 			// value must be >=0 and < 256.0
+	static void process_values(quantum_type * const dest,
+							const float * const src,const uint count,
+							const uint undo_enh_shadows);
+			// converts linear sRGB values to 2.0-gamma quantums
+	static uint get_max_vector_error(void);
+		// compares process_values() with process_value() over the input
+		//   range; returns the largest difference in quantums
+	};
+
+struct histogram_t {
+		// of the 8-bit output values of color_and_levels_processing_t,
+		//   before dithering
+
+	enum {NR_OF_BINS=256};
+	uint channels[3][NR_OF_BINS];		// R,G,B
+	uint luminance[NR_OF_BINS];			// Rec. 709 weighted sum of R,G,B
+	uint nr_of_pixels;
+	uint white_clipped_pixels;			// with some channel at 0xff
+	uint black_clipped_pixels;			// with some channel at 0
+
+	void clear(void) { memset(this,'\0',sizeof(*this)); }
+	void add(const histogram_t &histogram);
+	inline void add_pixel(const uint r,const uint g,const uint b)
+		{
+			channels[0][r]++;
+			channels[1][g]++;
+			channels[2][b]++;
+			luminance[(r*54 + g*183 + b*19) >> 8]++;
+			white_clipped_pixels+=(r == 0xff || g == 0xff || b == 0xff);
+			black_clipped_pixels+=(!r || !g || !b);
+			}
 	};
 
 class color_and_levels_processing_t {
@@ -131,12 +484,43 @@ class color_and_levels_processing_t {
 
 	ushort * translation_tables[3];
 			//  input: 0..QUANTUM_MAXVAL, gamma 2.0
-			// output: 0..0xff00, gamma 2.2 for color, 2.0 for grayscale
+			// output: 0..0xff00, gamma 2.2 for color, 2.0 for grayscale;
+			//   grayscale outputs are weighted so that their squares
+			//   add up to the linear gray value
 
 	ushort * grayscale_postprocessing_table;
 			//  input: 0..QUANTUM_MAXVAL, gamma 2.0
 			// output: 0..0xff00, gamma 2.2
 
+	struct curve_params_t {		// everything one translation table depends on
+		float gain_error,static_error;
+		float contrast,multiply_coeff,after_contrast_density_shift;
+		float black_level,white_clipping_density;
+		uint convert_to_grayscale;
+		};
+
+	enum {TABLE_CACHE_SIZE=8};
+	struct table_cache_entry_t {
+		curve_params_t curve;
+		ushort *table;			// NULL if the entry is unused
+		uint last_use;
+		};
+	static table_cache_entry_t table_cache[TABLE_CACHE_SIZE];
+	static uint table_cache_use_count;
+		// recently built translation tables, so that moving one slider
+		//   does not rebuild the tables it does not affect
+
+	static ushort calc_table_value(const uint i,
+									const curve_params_t * const curve);
+		// curve is NULL for grayscale_postprocessing_table
+	static void calc_table(ushort * const table,
+									const curve_params_t * const curve);
+	static void calc_table_segment(ushort * const table,
+						const uint beg,const uint end,
+						const curve_params_t * const curve);
+	static void get_translation_table(ushort * const table,
+									const curve_params_t &curve);
+
 	static float apply_shoulders(float value,float delta);
 	static float apply_soft_limit(const float x,const float derivative);
 	static float apply_soft_limits(const float value,
@@ -159,17 +543,175 @@ class color_and_levels_processing_t {
 		float black_level,white_clipping_stops;
 		float color_coeffs[3];		// 1.0 for no change
 		uint convert_to_grayscale;	// 0 or 1
+		float grayscale_weights[3];	// relative linear R,G,B weights, for
+									//   filter effects; all 1.0 for none
+		uint show_clipping;			// 0 or 1; pixels that histogram_t counts
+									//   as clipped are output in the
+									//   WHITE_CLIPPING_MARKER and
+									//   BLACK_CLIPPING_MARKER colors, for
+									//   previews only
 		};
 
+	enum {WHITE_CLIPPING_MARKER=0xff0000,BLACK_CLIPPING_MARKER=0x0000ff};
+			// 0xRRGGBB; a pixel with channels clipped at both ends gets the
+			//   white clipping marker
+
 	const params_t params;
 
 	color_and_levels_processing_t(const params_t &_params);
 	~color_and_levels_processing_t(void);
 	void process_pixels(uchar *dest,const quantum_type *src,
 			const uint nr_of_pixels,const uint output_in_BGR_format=0,
-									const uint dest_bytes_per_pixel=3) const;
+			const uint dest_bytes_per_pixel=3,const uint y=0,
+			histogram_t * const histogram=NULL) const;
 		//  src: 2.0-gamma quantum_type RGB
 		// dest: 2.2-gamma 8-bit RGB
+		// pixels are dithered by position, as columns 0.. of row y, so
+		//   rows can be processed separately and in any order. If
+		//   histogram is not NULL, the pixels are added to it as they are
+		//   written, so that no separate pass over them is needed.
+		//   With params.show_clipping, the markers are written in the same
+		//   loops as the pixels
+	void get_output_values(ushort *dest,const quantum_type *src,
+										const uint nr_of_pixels) const;
+		//  src: 2.0-gamma quantum_type RGB
+		// dest: 2.2-gamma RGB 0..0xff00, as process_pixels() has them
+		//   before dithering
+	};
+
+class pipeline_lut_t {
+		// image_reader_t's conversion, processing_phase1_t and
+		//   color_and_levels_processing_t baked into tables, for rendering
+		//   many pixels with unchanged parameters: a 3D table, indexed by
+		//   linear camera RGB and interpolated tetrahedrally, for the parts
+		//   which mix channels, followed by 1D output curves, indexed by
+		//   the square root of linear sRGB, for the rest. The mixing parts
+		//   are linear apart from sensor bleed correction. Before
+		//   dithering, the output differs from the exact pipeline by less
+		//   than 0.5 8-bit codes with 16-bit quantums; with 8-bit quantums
+		//   it differs by up to the exact pipeline's own quantization steps,
+		//   about 7 codes at high contrast, so it is then not used for
+		//   saving. get_max_error() measures it; see -verify-lut.
+		//   Grayscale conversion mixes channels after the output curves
+		//   and is not supported
+
+	enum {OUTPUT_CURVE_SIZE=4096};
+
+	const uint grid_size;		// nodes per axis
+	float *grid_coords;			// 0x10000 entries: file value -> 0..grid_size-1
+	float *table;				// grid_size^3 nodes of 4 floats: linear
+								//   sRGB R,G,B and padding
+	float *output_curves;		// 3 * OUTPUT_CURVE_SIZE: output values
+								//   0..0xff00 at sqrt(linear) 0..1
+
+	float conversion_coeffs[image_reader_t::NR_OF_CONVERSION_COEFFS];
+	uint undo_enh_shadows;
+	color_and_levels_processing_t::params_t pass2_params;
+
+	void interpolate(float * const dest_r,float * const dest_g,
+				float * const dest_b,const ushort * const src_r,
+				const ushort * const src_g,const ushort * const src_b,
+				const uint src_step,const uint nr_of_pixels) const;
+		// dest: output values 0..0xff00
+
+	public:
+
+	static uint is_supported(
+					const color_and_levels_processing_t::params_t &params)
+						{ return !params.convert_to_grayscale; }
+
+	pipeline_lut_t(const image_reader_t &image_reader,
+					const uint _undo_enh_shadows,
+					const color_and_levels_processing_t &pass2,
+					const uint _grid_size=33);
+	~pipeline_lut_t(void);
+
+	uint is_built_for(const image_reader_t &image_reader,
+				const uint _undo_enh_shadows,
+				const color_and_levels_processing_t::params_t &params) const;
+	void process_pixels(uchar *dest,const ushort * const src_r,
+				const ushort * const src_g,const ushort * const src_b,
+				const uint src_step,const uint nr_of_pixels,
+				const uint output_in_BGR_format=0,
+				const uint dest_bytes_per_pixel=3,const uint y=0) const;
+		//  src: file values, as in image_buffer_t rows
+		// dest: 2.2-gamma 8-bit RGB, as from color_and_levels_processing_t,
+		//   with the same dithering
+	float get_max_error(const image_reader_t &image_reader,
+				const color_and_levels_processing_t &pass2) const;
+		// returns the largest difference from the exact pipeline in 8-bit
+		//   codes, over a sample of colors
+	};
+
+class resampler_t {
+		// resizes RGB images with separable kernels, in either direction;
+		//   each destination sample is a fixed-point weighted sum of
+		//   source samples, first along rows and then down columns, with
+		//   the weights calculated once in the constructor
+	public:
+
+	enum kernel_t {BOX=0,TRIANGLE,LANCZOS3};
+		// BOX averages the source area of each destination pixel
+
+	template <class T> struct row_source_t {
+		virtual const T *get_row(const uint y)=0;
+			// returns source row y as RGB samples, valid until the next
+			//   call, or NULL to stop resample_rows(); rows are asked for
+			//   in increasing order
+		};
+
+	template <class T> struct image_row_source_t : public row_source_t<T> {
+		const T * const img;		// first pixel of the source rectangle
+		const uint row_len;			// samples between rows in img
+
+		image_row_source_t(const T * const _img,const uint _row_len) :
+											img(_img), row_len(_row_len) {}
+		virtual const T *get_row(const uint y) { return img + y*row_len; }
+		};
+
+	private:
+
+	enum {WEIGHT_BITS=14};		// weights of a destination sample add up
+								//   to 1 << WEIGHT_BITS
+	struct axis_t {
+		uint *first;			// first source index of each dest index
+		uint *count;			// nr of source indexes of each dest index
+		short *weights;			// taps per dest index
+		uint taps;				// largest count
+
+		void init(const uint src_size,const uint dest_size,
+												const kernel_t kernel);
+		void free(void);
+		};
+
+	axis_t horizontal,vertical;
+
+	template <class T> static T weighted_sum_to_sample(const sint sum);
+		// rounds and clamps to the range of T
+
+	public:
+
+	const vec<uint> src_size,dest_size;
+
+	resampler_t(const vec<uint> &_src_size,const vec<uint> &_dest_size,
+											const kernel_t kernel=BOX);
+	~resampler_t(void);
+
+	template <class T> void resample_row(T * const dest,
+										const T * const src) const;
+		// horizontal pass of one row, src_size.x to dest_size.x pixels
+	template <class T> void combine_rows(T * const dest,
+						const T * const * const rows,const uint dest_y) const;
+		// vertical pass of one row: rows are the horizontally resampled
+		//   source rows get_source_rows() returns for dest_y
+	void get_source_rows(const uint dest_y,uint &first,uint &count) const
+			{ first=vertical.first[dest_y]; count=vertical.count[dest_y]; }
+	template <class T> uint resample_rows(T * const dest,
+				row_source_t<T> &source,
+				const uint beg_dest_y,const uint end_dest_y) const;
+		// writes dest rows beg_dest_y..end_dest_y-1, dest_size.x*3 samples
+		//   apart from dest; separate threads may resample separate rows.
+		//   Returns 0 if source stopped it early
 	};
 
 void optimize_transfer_matrix(FILE * const input_file);
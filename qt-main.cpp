@@ -28,12 +28,16 @@
 #include <qmessagebox.h>
 #include <qsettings.h>
 #include <qevent.h>
+#include <qmap.h>
 
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/resource.h>
 
 #include "processing.hpp"
 #include "interactive-processor.hpp"
 #include "color-patches-detector.hpp"
+#include "shm-display.hpp"
 
 #define PHOTOPROC_VERSION			"0.96"
 
@@ -42,6 +46,11 @@
 
 #define NR_OF_IMAGES_TO_REMEMBER	20
 
+#define BACKGROUND_DECODER_NICE_VALUE	19
+#define NR_OF_IMAGES_TO_PREFETCH		2
+#define DECODED_IMAGE_CACHE_MAX_ENTRIES	8
+#define DECODED_IMAGE_CACHE_MAX_MB		600
+
 #if QT_VERSION < 0x030100
 #define POST_EVENT QThread::postEvent
 #else
@@ -55,10 +64,9 @@ class external_reader_process_t : public Q3Process {
 	QObject * const notification_receiver;
 	const interactive_image_processor_t::operation_type_t operation_type;
 	QString shooting_info_fname;
-
-	void *buf;
-	uint buf_len;
-	uint buf_used_len;
+	const sint input_fd;		// -1 or file descriptor to be closed when
+								//   the process object is deleted
+	char *cache_key;			// new []'d; NULL if none or given to processor
 
 	public slots:
 
@@ -68,22 +76,13 @@ class external_reader_process_t : public Q3Process {
 			if (!array.count())
 				return;
 
-			if (buf_used_len + array.count() > buf_len) {
-				buf_len=buf_used_len + array.count() + (4U << 20);
-				buf=realloc(buf,buf_len);
-				}
-
-			memcpy(((char *)buf) + buf_used_len,array.data(),array.count());
-			buf_used_len+=array.count();
+			processor->write_stream_data(array.data(),array.count());
 			}
 
 	void process_finished(void)
 		{
 			read_more_data();
-
-			processor->start_operation(operation_type,
-								shooting_info_fname.latin1(),buf,buf_used_len);
-			buf=NULL;
+			processor->end_stream();
 			is_finished=1;
 
 			if (notification_receiver != NULL)
@@ -94,26 +93,19 @@ class external_reader_process_t : public Q3Process {
 
 	uint is_finished;
 
-	virtual ~external_reader_process_t(void)
-		{
-			if (buf != NULL) {
-				free(buf);
-				buf=NULL;
-				}
-			}
-
 	external_reader_process_t(interactive_image_processor_t * const _processor,
 				QObject * const _notification_receiver,const QStringList &args,
 				interactive_image_processor_t::operation_type_t
 															_operation_type=
-							interactive_image_processor_t::LOAD_FROM_MEMORY,
-				const QString &_shooting_info_fname=(const char *)NULL) :
+							interactive_image_processor_t::LOAD_FROM_STREAM,
+				const QString &_shooting_info_fname=(const char *)NULL,
+				const sint _input_fd=-1,char * const _cache_key=NULL) :
 
 				Q3Process(args,NULL,"external image reader process"),
 				processor(_processor),
 				notification_receiver(_notification_receiver),
-				operation_type(_operation_type),
-				buf(NULL), buf_len(0), buf_used_len(0), is_finished(0)
+				operation_type(_operation_type), input_fd(_input_fd),
+				cache_key(_cache_key), is_finished(0)
 		{
 			if (!_shooting_info_fname.isNull())
 				shooting_info_fname=_shooting_info_fname;
@@ -124,13 +116,119 @@ class external_reader_process_t : public Q3Process {
 			connect(this,SIGNAL(processExited()),SLOT(process_finished()));
 			}
 
-	uint launch(void) { return Q3Process::launch(QString("")); }
+	virtual ~external_reader_process_t(void)
+		{
+			if (input_fd >= 0)
+				::close(input_fd);
+			if (cache_key != NULL)
+				delete [] cache_key;
+			}
+
+	uint launch(void)
+		{
+			if (!Q3Process::launch(QString("")))
+				return 0;
+
+				// image data is passed to processor as it arrives, so that
+				//   parsing and PASS1 can proceed while dcraw is still
+				//   writing its output
+
+			processor->start_operation(operation_type,
+									shooting_info_fname.latin1(),cache_key);
+			cache_key=NULL;			// now owned by processor
+			return 1;
+			}
+	};
+
+class background_decoder_process_t : public Q3Process {
+	Q_OBJECT
+
+	QObject * const notification_receiver;
+	decoded_image_t *decoded;	// NULL after decoded->finish() has been
+								//   called; its owner may then delete it
+	const sint input_fd;		// -1 or file descriptor to be closed when
+								//   the process object is deleted
+
+	void finish_decoding(void)
+		{
+			if (decoded != NULL) {
+				decoded->finish();
+				decoded=NULL;
+				}
+			}
+
+	public slots:
+
+	void read_more_data(void)
+		{
+			const QByteArray array=readStdout();
+			if (array.count() && decoded != NULL)
+				decoded->feed(array.data(),array.count());
+			}
+
+	void process_finished(void)
+		{
+			read_more_data();
+			finish_decoding();
+
+			if (notification_receiver != NULL)
+				POST_EVENT(notification_receiver,new QEvent(QEvent::User));
+			}
+
+	public:
+
+	background_decoder_process_t(QObject * const _notification_receiver,
+				const QStringList &args,decoded_image_t * const _decoded,
+				const sint _input_fd=-1) :
+
+				Q3Process(args,NULL,"background image decoder process"),
+				notification_receiver(_notification_receiver),
+				decoded(_decoded), input_fd(_input_fd)
+		{
+			setCommunication(Q3Process::Stdout | Q3Process::Stderr);
+
+			connect(this,SIGNAL(readyReadStdout()),SLOT(read_more_data()));
+			connect(this,SIGNAL(processExited()),SLOT(process_finished()));
+			}
+
+	virtual ~background_decoder_process_t(void)
+		{			// an unfinished decoding is cancelled
+			if (isRunning())
+				kill();
+			finish_decoding();
+
+			if (input_fd >= 0)
+				::close(input_fd);
+			}
+
+	uint launch(void)
+		{
+			if (!Q3Process::launch(QString("")))
+				return 0;
+
+				// decoding should only use CPU time which would otherwise
+				//   be idle
+
+			setpriority(PRIO_PROCESS,(id_t)processIdentifier(),
+											BACKGROUND_DECODER_NICE_VALUE);
+			return 1;
+			}
 	};
 
 class processor_t : private interactive_image_processor_t::notification_receiver_t {
 	QObject * const notification_receiver;
 	external_reader_process_t *external_reader_process;
 							// NULL if no external_reader_process in progress
+	background_decoder_process_t *background_decoder;
+							// NULL if no background decoding started for
+							//   the current image
+	decoded_image_t *fullres_image;		// image being decoded by
+										//   background_decoder; NULL if
+										//   none or given to processor
+	uint is_fullres_decoding_started;	// 0 or 1, for the current image
+	QString image_file_fname;			// of the current image
+	QString fullres_size_fname;			// image whose fullres_size is known
+	vec<uint> fullres_size;				// from its full-res decoding
 
 	virtual void operation_completed(void)
 		{			// called in interactive_image_processor_t's thread
@@ -143,11 +241,28 @@ class processor_t : private interactive_image_processor_t::notification_receiver
 	interactive_image_processor_t processor;
 
 #ifndef PHOTOPROC_ALWAYS_USE_HALFRES
-	QByteArray image_file_data;		// only nonempty if the currently loaded
-									//   image was loaded with half-res;
-									//   in this case we need image_file_data
-									//   for later full-res loading
+	sint image_file_fd;		// -1 unless the currently loaded image was
+							//   loaded with half-res; in this case the file
+							//   is kept open for later full-res loading,
+							//   which then works even if the file has been
+							//   renamed or deleted meanwhile
 #endif
+	uint is_loading_fullres_image;	// 0 or 1; while the LOAD_DECODED_IMAGE
+									//   operation started by
+									//   load_background_decoded_image() is
+									//   pending. The half-res image, with
+									//   its divisor and image_file_fd,
+									//   remains until the operation succeeds
+
+	void close_image_file(void)
+		{
+#ifndef PHOTOPROC_ALWAYS_USE_HALFRES
+			if (image_file_fd >= 0) {
+				::close(image_file_fd);
+				image_file_fd=-1;
+				}
+#endif
+			}
 
 	uint is_external_reader_process_running(void) const
 		{
@@ -164,15 +279,113 @@ class processor_t : private interactive_image_processor_t::notification_receiver
 				}
 			}
 
+	static QStringList get_dcraw_args(void)
+		{
+			QStringList args;
+			args << "dcraw";
+			args << "-4";			// 48-bit .PPM output
+			args << "-c";			// output to stdout
+			// args << "-b" << "3.8";	// 3.8x brightness
+			args << "-M";			// don't use embedded color matrix
+			args << "-o" << "0";	// don't convert camera RGB to sRGB
+			return args;
+			}
+
+	static char *make_cache_key(const QString &fname,
+												const QString &decode_flags)
+		{		// returns new []'d image_cache_t key, or NULL if the cache
+				//   is not in use
+			char key[image_cache_t::KEY_SIZE];
+			if (!image_cache_t::make_key(key,QFile::encodeName(fname),
+													decode_flags.latin1()))
+				return NULL;
+
+			char * const dest=new char [strlen(key)+1];
+			strcpy(dest,key);
+			return dest;
+			}
+
+	static uint is_in_image_cache(const QString &fname,
+												const QString &decode_flags)
+		{
+			char * const cache_key=make_cache_key(fname,decode_flags);
+			if (cache_key == NULL)
+				return 0;
+
+			const uint is_in_cache=image_cache_t::contains(cache_key);
+			delete [] cache_key;
+			return is_in_cache;
+			}
+
+	uint start_loading_from_cache(const QString &fname,
+							const QString &decode_flags,const uint is_fullres)
+		{		// returns 0 if fname is not in image_cache_t
+			char * const cache_key=make_cache_key(fname,decode_flags);
+			if (cache_key == NULL)
+				return 0;
+
+			if (!image_cache_t::contains(cache_key)) {
+				delete [] cache_key;
+				return 0;
+				}
+
+			processor.set_loaded_image_divisor(is_fullres ? 1 : 2);
+			processor.start_operation(
+						interactive_image_processor_t::LOAD_FROM_CACHE,
+												fname.latin1(),cache_key);
+			return 1;
+			}
+
+	static QString get_fd_fname(const sint fd)
+		{		// returns a name by which an external process can open the
+				//   same file as fd, or null string if not possible
+
+				// The /proc name refers to the open file itself rather
+				//   than to the directory entry
+			QString fd_fname;
+			fd_fname.sprintf("/proc/%u/fd/%d",(uint)getpid(),(int)fd);
+			if (!QFileInfo(fd_fname).exists())
+				return QString::null;
+			return fd_fname;
+			}
+
 	processor_t(QObject * const _notification_receiver=NULL) :
 							notification_receiver(_notification_receiver),
-							external_reader_process(NULL), processor(this) {}
-	virtual ~processor_t(void) { delete_external_reader_process(); }
+							external_reader_process(NULL),
+							background_decoder(NULL), fullres_image(NULL),
+							is_fullres_decoding_started(0), processor(this),
+							is_loading_fullres_image(0)
+		{
+#ifndef PHOTOPROC_ALWAYS_USE_HALFRES
+			image_file_fd=-1;
+#endif
+			}
+
+	virtual ~processor_t(void)
+		{
+			delete_external_reader_process();
+			cancel_background_decoding();
+			close_image_file();
+			}
 
 	QString start_loading_image(const QString &fname,const uint load_fullres,
-									const QString &temp_fname=QString::null);
+													const sint source_fd=-1);
 		// returns error text, or null string if no error
 
+	void start_loading_decoded_image(const QString &fname,
+				decoded_image_t * const decoded_image,const uint is_fullres,
+				background_decoder_process_t * const decoder_process);
+		// takes ownership of decoded_image and decoder_process
+	void start_background_decoding(void);
+	void cancel_background_decoding(void);
+	uint load_background_decoded_image(const uint wait_for_decoding);
+		// returns nonzero if LOAD_DECODED_IMAGE operation was started;
+		//   the caller switches to the full-res image when it succeeds
+	vec<uint> get_fullres_image_size(void);
+		// of the current image. A half-res image from dcraw -h has odd
+		//   sizes rounded up, so until the full-res image has been decoded,
+		//   twice its size may be one pixel too large
+
 	static QString get_image_save_basename(const QString fname,const QString save_extension)
 		{
 			QString save_fname=fname;
@@ -236,52 +449,78 @@ class processor_t : private interactive_image_processor_t::notification_receiver
 	};
 
 QString processor_t::start_loading_image(const QString &fname,
-						const uint load_fullres,const QString &temp_fname)
+						const uint load_fullres,const sint source_fd)
 {		// returns error text, or null string if no error
+		// If source_fd >= 0, image data is read from this open file instead
+		//   of opening fname again; source_fd is closed after reading
+
+	QString actual_fname_to_load=fname;
+	if (source_fd >= 0) {
+		const QString fd_fname=get_fd_fname(source_fd);
+		if (!fd_fname.isNull())
+			actual_fname_to_load=fd_fname;
+		}
 
-	const QString actual_fname_to_load=temp_fname.isEmpty() ?
-														fname : temp_fname;
 	const QFileInfo fileinfo(actual_fname_to_load);
 
 	if (actual_fname_to_load.isEmpty() || !fileinfo.exists()) {
+		if (source_fd >= 0)
+			::close(source_fd);
+
 		QString str;
 		return str.sprintf("File %s not found",
 										actual_fname_to_load.utf8().data());
 		}
 
-#ifndef PHOTOPROC_ALWAYS_USE_HALFRES
-	image_file_data.resize(0);
-#endif
+	cancel_background_decoding();
+	close_image_file();
+	image_file_fname=fname;
 
 		// start loading image
 
 	const QString ext=QFileInfo(fname).extension(FALSE).lower();
 	if (ext == "nef" || ext == "crw" || ext == "cr2" || ext == "x-canon-raw" ||
 						ext == "mrw" || ext == "orf" || ext == "dcr") {
-		QStringList args;
-		args << "dcraw";
-		args << "-4";			// 48-bit .PPM output
-		args << "-c";			// output to stdout
-		// args << "-b" << "3.8";	// 3.8x brightness
-		args << "-M";			// don't use embedded color matrix
-		args << "-o" << "0";	// don't convert camera RGB to sRGB
+		QStringList args=get_dcraw_args();
 
 #ifndef PHOTOPROC_ALWAYS_USE_HALFRES
 		if (!load_fullres) {
 			args << "-h";			// half-res image for fast processing
 
-			QFile f(actual_fname_to_load);
-			if (!f.open(QIODevice::Unbuffered|QIODevice::ReadOnly)) {
+			image_file_fd=::open(QFile::encodeName(actual_fname_to_load),
+																O_RDONLY);
+			if (image_file_fd < 0) {
+				if (source_fd >= 0)
+					::close(source_fd);
+
 				QString str;
 				return str.sprintf("Error opening file %s",
 										actual_fname_to_load.utf8().data());
 				}
-			image_file_data=f.readAll();
 			}
 #else
 		args << "-h";			// half-res image for fast processing
 #endif
 
+#ifndef PHOTOPROC_ALWAYS_USE_HALFRES
+		if (start_loading_from_cache(fname,get_dcraw_args().join(" "),1)) {
+			close_image_file();			// already in full-res
+			if (source_fd >= 0)
+				::close(source_fd);
+			return QString();
+			}
+#endif
+
+		const uint is_fullres=!args.contains("-h");
+
+		const QString decode_flags=args.join(" ");
+		if (!load_fullres &&
+				start_loading_from_cache(fname,decode_flags,is_fullres)) {
+			if (source_fd >= 0)
+				::close(source_fd);
+			return QString();
+			}
+
 		args << actual_fname_to_load;
 
 		/*	formula to convert exposure and white level values from old
@@ -294,15 +533,18 @@ QString processor_t::start_loading_image(const QString &fname,
 
 		external_reader_process=new external_reader_process_t(
 						&processor,notification_receiver,args,
-						temp_fname.isEmpty() ?
-							interactive_image_processor_t::LOAD_FROM_MEMORY :
-							interactive_image_processor_t::
-											LOAD_FROM_MEMORY_AND_DELETE_FILE,
-						actual_fname_to_load);
+						interactive_image_processor_t::LOAD_FROM_STREAM,
+						actual_fname_to_load,source_fd,
+						make_cache_key(fname,decode_flags));
+
+		const uint prev_divisor=processor.get_loaded_image_divisor();
+		processor.set_loaded_image_divisor(is_fullres ? 1 : 2);
 
 		if (!external_reader_process->launch()) {
 			delete external_reader_process;
 			external_reader_process=NULL;
+			close_image_file();
+			processor.set_loaded_image_divisor(prev_divisor);
 
 			return "Helper process (dcraw) could not be started.\n\n"
 				"dcraw is a program by Dave Coffin that reads digital camera \n"
@@ -313,25 +555,422 @@ QString processor_t::start_loading_image(const QString &fname,
 				"http://www.insflug.org/raw/";
 			}
 		}
-	  else
+	  else {
+		processor.set_loaded_image_divisor(1);
 		processor.start_operation(interactive_image_processor_t::LOAD_FILE,
 											actual_fname_to_load.latin1());
+		if (source_fd >= 0)
+			::close(source_fd);
+		}
 
 	return QString();
 	}
 
+void processor_t::start_loading_decoded_image(const QString &fname,
+				decoded_image_t * const decoded_image,const uint is_fullres,
+				background_decoder_process_t * const decoder_process)
+{		// takes ownership of decoded_image and decoder_process;
+		//   the image may still be being decoded by decoder_process
+
+	cancel_background_decoding();
+	close_image_file();
+	image_file_fname=fname;
+
+	background_decoder=decoder_process;	// deleted on next load
+
+#ifndef PHOTOPROC_ALWAYS_USE_HALFRES
+	if (!is_fullres)		// keep file for full-res loading, as usual
+		image_file_fd=::open(QFile::encodeName(fname),O_RDONLY);
+#endif
+
+	processor.set_loaded_image_divisor(is_fullres ? 1 : 2);
+	processor.start_operation(interactive_image_processor_t::
+									LOAD_DECODED_IMAGE,NULL,decoded_image);
+	}
+
+void processor_t::start_background_decoding(void)
+{		// if the current image was loaded with half-res, starts decoding it
+		//   in full resolution in a low-priority process, so that it is
+		//   ready by the time it is needed
+
+#ifndef PHOTOPROC_ALWAYS_USE_HALFRES
+	if (image_file_fd < 0 || is_fullres_decoding_started ||
+									is_external_reader_process_running())
+		return;
+
+	if (background_decoder != NULL) {
+		if (background_decoder->isRunning())
+			return;
+		delete background_decoder;		// finished prefetch of this image
+		background_decoder=NULL;
+		}
+
+	if (start_loading_from_cache(image_file_fname,
+										get_dcraw_args().join(" "),1)) {
+		is_fullres_decoding_started=1;
+		close_image_file();
+		return;
+		}
+
+	const sint fd=dup(image_file_fd);
+	if (fd < 0)
+		return;
+
+	const QString fd_fname=get_fd_fname(fd);
+	if (fd_fname.isNull()) {
+		::close(fd);
+		return;
+		}
+
+	QStringList args=get_dcraw_args();
+	char * const cache_key=make_cache_key(image_file_fname,args.join(" "));
+	args << fd_fname;
+
+	is_fullres_decoding_started=1;
+	fullres_image=new decoded_image_t(fd_fname.latin1(),cache_key);
+	if (cache_key != NULL)
+		delete [] cache_key;
+	background_decoder=new background_decoder_process_t(
+							notification_receiver,args,fullres_image,fd);
+
+	if (!background_decoder->launch()) {
+		cancel_background_decoding();
+		is_fullres_decoding_started=1;		// don't retry for this image
+		}
+#endif
+	}
+
+void processor_t::cancel_background_decoding(void)
+{
+	is_fullres_decoding_started=0;
+
+	if (background_decoder != NULL) {
+		delete background_decoder;
+		background_decoder=NULL;
+		}
+
+	if (fullres_image != NULL) {
+		delete fullres_image;
+		fullres_image=NULL;
+		}
+	}
+
+vec<uint> processor_t::get_fullres_image_size(void)
+{
+	if (fullres_image != NULL && fullres_image->is_finished() &&
+											fullres_image->is_valid()) {
+		fullres_size_fname=image_file_fname;
+		fullres_size.x=fullres_image->img.columns();
+		fullres_size.y=fullres_image->img.rows();
+		}
+
+	const uint divisor=processor.get_loaded_image_divisor();
+	if (divisor != 1 && !image_file_fname.isEmpty() &&
+									fullres_size_fname == image_file_fname)
+		return fullres_size;
+
+	const vec<uint> size=processor.get_uncropped_image_size();
+	const vec<uint> scaled_size={size.x * divisor,size.y * divisor};
+	return scaled_size;
+	}
+
+uint processor_t::load_background_decoded_image(const uint wait_for_decoding)
+{		// returns nonzero if LOAD_DECODED_IMAGE operation was started
+		// The operation waits for the background decoding to finish, so
+		//   that operations started later work on the full-res image;
+		//   fullres processing, whose crop depends on the divisor, is
+		//   started only after the result
+
+	if (fullres_image == NULL)
+		return 0;
+
+	if (fullres_image->is_finished()) {
+		if (!fullres_image->is_valid()) {
+			delete fullres_image;		// image remains in half-res until
+			fullres_image=NULL;			//   it is loaded in full-res again
+			return 0;
+			}
+		}
+	  else
+		if (!wait_for_decoding)
+			return 0;
+
+	processor.start_operation(interactive_image_processor_t::
+									LOAD_DECODED_IMAGE,NULL,fullres_image);
+	fullres_image=NULL;			// now owned by processor
+	is_loading_fullres_image=1;
+	return 1;
+	}
+
+class decoded_image_cache_t {
+		// images decoded in advance by low-priority background processes;
+		//   the least recently used ones are dropped when the memory limit
+		//   is exceeded
+
+	struct entry_t {
+		QString fname;			// absolute path; null if entry is unused
+		QDateTime mtime;
+		uint file_size;
+		uint is_fullres;		// 0 or 1
+		decoded_image_t *image;	// NULL if given away
+		background_decoder_process_t *process;	// NULL if none
+		uint last_use;
+
+		void clear(void)
+			{
+				if (process != NULL) {
+					delete process;		// an unfinished decoding of image
+					process=NULL;		//   is cancelled
+					}
+				if (image != NULL) {
+					delete image;
+					image=NULL;
+					}
+				fname=QString::null;
+				}
+		};
+
+	QObject * const notification_receiver;
+	entry_t entries[DECODED_IMAGE_CACHE_MAX_ENTRIES];
+	uint use_counter;
+	uint max_image_size;	// in bytes, of images decoded so far
+
+	entry_t *find(const QString &abs_fname)
+		{
+			for (uint i=0;i < DECODED_IMAGE_CACHE_MAX_ENTRIES;i++)
+				if (entries[i].fname == abs_fname && !abs_fname.isNull())
+					return entries + i;
+			return NULL;
+			}
+
+	uint get_total_size(void) const
+		{
+			uint total_size=0;
+			for (uint i=0;i < DECODED_IMAGE_CACHE_MAX_ENTRIES;i++)
+				if (entries[i].image != NULL)
+					total_size+=entries[i].image->get_size_in_bytes();
+			return total_size;
+			}
+
+	uint evict_least_recently_used(const uint min_last_use)
+		{		// returns 0 if there is no entry with last_use < min_last_use
+			entry_t *lru_entry=NULL;
+			for (uint i=0;i < DECODED_IMAGE_CACHE_MAX_ENTRIES;i++)
+				if (entries[i].image != NULL &&
+									entries[i].last_use < min_last_use)
+					if (lru_entry == NULL ||
+								lru_entry->last_use > entries[i].last_use)
+						lru_entry=entries + i;
+
+			if (lru_entry == NULL)
+				return 0;
+
+			lru_entry->clear();
+			return 1;
+			}
+
+	public:
+
+	decoded_image_cache_t(QObject * const _notification_receiver) :
+							notification_receiver(_notification_receiver),
+							use_counter(0), max_image_size(0)
+		{
+			for (uint i=0;i < DECODED_IMAGE_CACHE_MAX_ENTRIES;i++) {
+				entries[i].image=NULL;
+				entries[i].process=NULL;
+				}
+			}
+
+	~decoded_image_cache_t(void)
+		{
+			for (uint i=0;i < DECODED_IMAGE_CACHE_MAX_ENTRIES;i++)
+				entries[i].clear();
+			}
+
+	uint prefetch(const QString &fname,const uint is_fullres)
+		{		// starts decoding fname unless it is already in the cache;
+				//   returns 0 if this should be tried again later, as
+				//   another prefetch is in progress or there is no room
+
+			for (uint i=0;i < DECODED_IMAGE_CACHE_MAX_ENTRIES;i++)
+				if (entries[i].process != NULL &&
+										entries[i].process->isRunning())
+					return 0;			// one prefetch at a time
+
+			const QFileInfo fileinfo(fname);
+			if (!fileinfo.exists())
+				return 1;
+
+			const uint min_last_use=use_counter;
+
+			QStringList args=processor_t::get_dcraw_args();
+			if (!is_fullres)
+				args << "-h";			// half-res image for fast processing
+
+			const QString decode_flags=args.join(" ");
+			args << fname;
+
+			if (processor_t::is_in_image_cache(fname,decode_flags))
+				return 1;				// loading from there is fast anyway
+
+			entry_t *e=find(fileinfo.absFilePath());
+			if (e != NULL)
+				if (e->is_fullres < is_fullres ||
+									e->mtime != fileinfo.lastModified() ||
+									e->file_size != (uint)fileinfo.size())
+					e->clear();
+				  else {
+					e->last_use=++use_counter;
+					return 1;
+					}
+
+			entry_t *free_entry=NULL;
+			for (uint i=0;i < DECODED_IMAGE_CACHE_MAX_ENTRIES;i++) {
+				if (entries[i].process != NULL) {
+					delete entries[i].process;		// has finished
+					entries[i].process=NULL;
+					}
+
+				if (entries[i].image != NULL) {
+					const uint size=entries[i].image->get_size_in_bytes();
+					if (max_image_size < size)
+						max_image_size=size;
+					}
+				  else
+					if (free_entry == NULL)
+						free_entry=entries + i;
+				}
+
+				// make room for the new image, without evicting images
+				//   requested after this call began
+
+			while (get_total_size() + max_image_size >
+									DECODED_IMAGE_CACHE_MAX_MB*1024U*1024U)
+				if (!evict_least_recently_used(min_last_use))
+					return 0;
+
+			if (free_entry == NULL) {
+				if (!evict_least_recently_used(min_last_use))
+					return 0;
+				for (free_entry=entries;free_entry->image != NULL;free_entry++)
+					;
+				}
+
+			char * const cache_key=
+						processor_t::make_cache_key(fname,decode_flags);
+
+			free_entry->fname=fileinfo.absFilePath();
+			free_entry->mtime=fileinfo.lastModified();
+			free_entry->file_size=(uint)fileinfo.size();
+			free_entry->is_fullres=is_fullres;
+			free_entry->last_use=++use_counter;
+			free_entry->image=new decoded_image_t(fname.latin1(),cache_key);
+			if (cache_key != NULL)
+				delete [] cache_key;
+			free_entry->process=new background_decoder_process_t(
+							notification_receiver,args,free_entry->image);
+
+			if (!free_entry->process->launch())
+				free_entry->clear();
+			return 1;
+			}
+
+	decoded_image_t *take(const QString &fname,const uint min_is_fullres,
+					uint &is_fullres,background_decoder_process_t * &process)
+		{		// returns NULL if fname is not in the cache; otherwise the
+				//   caller becomes the owner of the returned image, and of
+				//   the process which might still be decoding it
+
+			const QFileInfo fileinfo(fname);
+			entry_t * const e=find(fileinfo.absFilePath());
+			if (e == NULL)
+				return NULL;
+
+			if (e->is_fullres < min_is_fullres ||
+									e->mtime != fileinfo.lastModified() ||
+									e->file_size != (uint)fileinfo.size() ||
+					(e->image->is_finished() && !e->image->is_valid())) {
+				e->clear();
+				return NULL;
+				}
+
+			decoded_image_t * const image=e->image;
+			is_fullres=e->is_fullres;
+			process=e->process;
+
+			e->image=NULL;
+			e->process=NULL;
+			e->fname=QString::null;
+			return image;
+			}
+
+	void evict(const QString &fname)
+		{
+			entry_t * const e=find(QFileInfo(fname).absFilePath());
+			if (e != NULL)
+				e->clear();
+			}
+	};
+
 class image_window_t;
 
 class image_widget_t : public QWidget {
     Q_OBJECT
 	image_window_t * const image_window;
-	QImage qimage;
+	enum {NR_OF_FRAMES=interactive_image_processor_t::NR_OF_OUTPUT_BUFS};
+	QImage qimages[NR_OF_FRAMES];	// the processor's output_bufs
 	QPixmap qpixmap;
+	shm_image_t shm_images[NR_OF_FRAMES];	// used instead of qimages and
+											//   qpixmap when created
+	uint use_shm_images;		// 0 or 1; cleared if they cannot be created
+	uint displayed_frame;		// index of the frame on screen
+
+	uint is_zoomed;					// 0 or 1; 1:1 view of full-res tiles
+	vec<sint> view_pos;				// uncropped image position at the top
+									//   left corner in zoomed view
+	uint is_dragging;				// 0 or 1
+	QPoint drag_start_pos;
+	vec<sint> drag_start_view_pos;
+
+	struct tile_t {
+		QPixmap pixmap;
+		uint params_serial;			// of the params it was rendered with
+		};
+	QMap<uint,tile_t> tiles;		// by RENDER_TILE position
+	struct tile_request_t {
+		uint tile_pos;
+		uchar *buf;					// new []'d; rendered into by processor
+		uint params_serial;
+		};
+	Q3ValueList<tile_request_t> tile_requests;	// in the order started
+	uint params_serial;				// incremented when tiles become stale
+	enum {MAX_TILE_REQUESTS=4,MAX_CACHED_TILES=192};
+
+	void get_crop_area(vec<uint> &beg,vec<uint> &end) const;
+	void get_visible_tiles(vec<uint> &beg,vec<uint> &end) const;
+	void clamp_view_pos(void);
+	void request_tiles(void);
+		// starts rendering visible tiles which are missing or stale,
+		//   nearest to the center first, unless other operations are
+		//   pending
+	void paint_tiles(void);
+
+	vec<uint> get_displayed_size(void) const
+		{
+			const shm_image_t &shm_image=shm_images[displayed_frame];
+			const vec<uint> size={
+				shm_image.is_created() ? shm_image.get_width()  :
+												(uint)qpixmap. width(),
+				shm_image.is_created() ? shm_image.get_height() :
+												(uint)qpixmap.height()};
+			return size;
+			}
 
 	vec<uint> get_image_offset(void) const
 		{
-			const vec<uint> offset={(uint)( width()-qpixmap. width()) / 2,
-									(uint)(height()-qpixmap.height()) / 2};
+			const vec<uint> size=get_displayed_size();
+			const vec<uint> offset={(uint)( width()-size.x) / 2,
+									(uint)(height()-size.y) / 2};
 			return offset;
 			}
 
@@ -402,35 +1041,111 @@ class image_widget_t : public QWidget {
 	void do_bitblt(void)
 		{
 			const vec<uint> offset=get_image_offset();
+			const vec<uint> size=get_displayed_size();
 
 			erase(QRegion(rect(),QRegion::Rectangle).subtract(
-					QRegion(offset.x,offset.y,qpixmap.width(),qpixmap.height(),
+					QRegion(offset.x,offset.y,size.x,size.y,
 											QRegion::Rectangle)));
-			bitBlt(this,offset.x,offset.y,&qpixmap);
+			if (shm_images[displayed_frame].is_created())
+				shm_images[displayed_frame].put(winId(),offset.x,offset.y);
+			  else
+				bitBlt(this,offset.x,offset.y,&qpixmap);
 
-			if (qpixmap.width() <= 1)
+			if (size.x <= 1)
 				draw_test_table(this);
 			}
 
 	protected:
 
-	virtual void paintEvent(QPaintEvent *) { do_bitblt(); }
+	virtual void paintEvent(QPaintEvent *)
+		{
+			if (is_zoomed)
+				paint_tiles();
+			  else
+				do_bitblt();
+			}
 
 	virtual void mousePressEvent(QMouseEvent *e);
+	virtual void mouseMoveEvent(QMouseEvent *e);
+	virtual void mouseReleaseEvent(QMouseEvent *) { is_dragging=0; }
 	virtual void resizeEvent(QResizeEvent *);
 
 	public:
 
 	image_widget_t(QWidget * const parent,
 									image_window_t * const _image_window) :
-			QWidget(parent), image_window(_image_window), qimage(1,1,32)
-			{ setEraseColor(Qt::black); }
+			QWidget(parent), image_window(_image_window),
+			use_shm_images(1), displayed_frame(0),
+			is_zoomed(0), is_dragging(0), params_serial(0)
+		{
+			setEraseColor(Qt::black);
+			for (uint i=0;i < NR_OF_FRAMES;i++)
+				qimages[i].create(1,1,32);
+			view_pos.x=view_pos.y=0;
+			}
 
 	void ensure_correct_size(void);
 
-	void refresh_image(void)
+	uint is_zoomed_view(void) const { return is_zoomed; }
+	void set_zoomed_view(const uint zoomed);
+	void tile_rendered(void);
+		// called for each RENDER_TILE result, in order
+	void clear_tiles(void) { tiles.clear(); }
+		// when the image is replaced
+	void view_changed(void)
+		{
+			if (!is_zoomed)
+				return;
+			clamp_view_pos();
+			request_tiles();
+			update();
+			}
+	void invalidate_tiles(void)
+		{			// when color and levels params change
+			params_serial++;
+			view_changed();
+			}
+
+	void refresh_image(void);
+	};
+
+class histogram_widget_t : public QWidget {
+		// luminance histogram of the latest preview frame, with the R,G,B
+		//   ones as lines; the bars at the ends show the shares of pixels
+		//   clipped to black and white, at full height from 5% on
+
+	histogram_t *histogram;		// NULL if there is none yet
+
+	protected:
+
+	virtual void paintEvent(QPaintEvent *);
+
+	public:
+
+	histogram_widget_t(QWidget * const parent) :
+								QWidget(parent), histogram(NULL)
 		{
-			qpixmap.convertFromImage(qimage);
+			setEraseColor(Qt::black);
+			setFixedWidth(histogram_t::NR_OF_BINS/2 + 2*4);
+			}
+	~histogram_widget_t(void)
+		{
+			if (histogram != NULL)
+				delete histogram;
+			}
+
+	void set_histogram(histogram_t * const _histogram)
+		{			// takes over _histogram
+			if (histogram != NULL)
+				delete histogram;
+			histogram=_histogram;
+
+			const float nr_of_pixels=max(histogram->nr_of_pixels,1U);
+			QString str;
+			setToolTip(str.sprintf("Clipped to black: %.2f%%\n"
+												"Clipped to white: %.2f%%",
+					histogram->black_clipped_pixels * 100 / nr_of_pixels,
+					histogram->white_clipped_pixels * 100 / nr_of_pixels));
 			update();
 			}
 	};
@@ -604,10 +1319,21 @@ class image_window_t : public Q3MainWindow, public processor_t {
 	uint fullres_processing_do_resize;		// 0 or 1
 	float fullres_processing_USM_radius;	// <=0 if no unsharp mask
 
+	decoded_image_cache_t decoded_image_cache;
+	uint is_loading_prefetched_image;		// 0 or 1
+	QString next_numbered_images_fname;		// image whose next numbered
+	QString next_numbered_images[NR_OF_IMAGES_TO_PREFETCH];	//   images
+	uint nr_of_next_numbered_images;		//   have been found
+	uint nr_of_next_images_prefetched;		// of next_numbered_images;
+											//   the rest are tried on idle
+
 	Q3ValueList<sint> file_menu_load_save_ids;
 
 	Q3PopupMenu file_menu;
+	Q3PopupMenu *view_menu;
+	sint show_clipping_menu_id;		// checked if the preview marks clipping
 	image_widget_t *image_widget;
+	histogram_widget_t *histogram_widget;
 
 	Q3HBox *normal_view_hbox;
 	slider_t *contrast_slider,*exposure_slider;
@@ -617,6 +1343,7 @@ class image_window_t : public Q3MainWindow, public processor_t {
 	two_color_balance_slider_t *red_blue_balance_slider;
 	slider_t *green_balance_slider;
 	QCheckBox *grayscale_checkbox;
+	QComboBox *grayscale_filter_combobox;
 
 	Q3HBox *crop_view_hbox;
 	QComboBox *crop_target_combobox;
@@ -644,6 +1371,11 @@ class image_window_t : public Q3MainWindow, public processor_t {
 				
 		} output_dimensions[];
 
+	static const struct grayscale_filter_t {
+		const char *name;
+		float weights[3];		// relative linear R,G,B weights
+		} grayscale_filters[];
+
 	void key_event(QKeyEvent * const e)
 		{
 			const uint shift_before=!!(e->state() & Qt::ShiftModifier);
@@ -789,39 +1521,72 @@ class image_window_t : public Q3MainWindow, public processor_t {
 				}
 			}
 
-	void open_next_numbered_image(void)
-		{
-			if (image_fname.isEmpty())
-				return;
+	static QString find_next_numbered_image(const QString &fname)
+		{		// returns null string if not found
+			if (fname.isEmpty())
+				return QString::null;
 
-			const sint number_idx=image_fname.find(QRegExp("[0-9][^\\\\/]*$"));
+			const sint number_idx=fname.find(QRegExp("[0-9][^\\\\/]*$"));
 
 			if (number_idx < 0)
-				return;
+				return QString::null;
 
-			QString number_str=image_fname.mid(number_idx);
+			QString number_str=fname.mid(number_idx);
 			number_str.replace(QRegExp("[^0-9].*$"),"");
 			const uint number=number_str.toUInt();
 
 			QString suffix;
-			const sint suffix_idx=image_fname.findRev(
-												QRegExp("\\.[^\\\\/]*$"));
+			const sint suffix_idx=fname.findRev(QRegExp("\\.[^\\\\/]*$"));
 			if (suffix_idx >= 0)
-				suffix=image_fname.mid(suffix_idx);
+				suffix=fname.mid(suffix_idx);
 
 			for (uint increment=1;increment < 500;increment++) {
 				QString new_number_str=QString::number(number + increment);
 				while (new_number_str.length() < number_str.length())
 					new_number_str="0" + new_number_str;
 
-				const QString new_fname=image_fname.left(number_idx) +
+				const QString new_fname=fname.left(number_idx) +
 												new_number_str + suffix;
 
-				if (QFileInfo(new_fname).exists()) {
-					load_image(new_fname);
-					break;
+				if (QFileInfo(new_fname).exists())
+					return new_fname;
+				}
+
+			return QString::null;
+			}
+
+	void open_next_numbered_image(void)
+		{
+			const QString new_fname=find_next_numbered_image(image_fname);
+			if (!new_fname.isNull())
+				load_image(new_fname);
+			}
+
+	void prefetch_next_numbered_images(void)
+		{		// called whenever the GUI is idle, so the next images are
+				//   looked up only once per loaded image
+			if (next_numbered_images_fname != image_fname) {
+				next_numbered_images_fname=image_fname;
+				nr_of_next_numbered_images=0;
+				nr_of_next_images_prefetched=0;
+
+				QString fname=image_fname;
+				while (nr_of_next_numbered_images < NR_OF_IMAGES_TO_PREFETCH) {
+					fname=find_next_numbered_image(fname);
+					if (fname.isNull())
+						break;
+					next_numbered_images[nr_of_next_numbered_images++]=fname;
 					}
 				}
+
+			for (;nr_of_next_images_prefetched < nr_of_next_numbered_images;
+											nr_of_next_images_prefetched++) {
+				const QString &fname=
+						next_numbered_images[nr_of_next_images_prefetched];
+				if (!decoded_image_cache.prefetch(fname,
+											should_load_fullres(fname)))
+					break;
+				}
 			}
 
 	void delete_file(void)
@@ -830,8 +1595,10 @@ class image_window_t : public Q3MainWindow, public processor_t {
 				"Delete current image file?",
 				QMessageBox::Yes,QMessageBox::No |
 							QMessageBox::Default | QMessageBox::Escape) ==
-													QMessageBox::Yes)
+													QMessageBox::Yes) {
+			decoded_image_cache.evict(image_fname);
 			QFile::remove(image_fname);
+			}
 		}
 
 	void update_crop_view_label(void)
@@ -841,7 +1608,16 @@ class image_window_t : public Q3MainWindow, public processor_t {
 				return;
 				}
 
-			const vec<uint> image_size=processor.get_image_size();
+				// in full-res pixels, also when a half-res image is loaded
+
+			const vec<uint> uncropped_size=get_fullres_image_size();
+			const sint xsize=(sint)uncropped_size.x -
+						(sint)(left_crop->get_value() + right_crop->get_value());
+			const sint ysize=(sint)uncropped_size.y -
+						(sint)(top_crop->get_value() + bottom_crop->get_value());
+			const vec<uint> image_size={
+					(uint)((xsize >= 1) ? xsize : 1),
+					(uint)((ysize >= 1) ? ysize : 1)};
 
 			vec<uint> target_size=output_dimensions[
 							crop_target_combobox->currentItem()].dimensions;
@@ -881,6 +1657,20 @@ class image_window_t : public Q3MainWindow, public processor_t {
 			crop_view_hbox->show();
 			}
 
+	void toggle_zoomed_view(void)
+		{
+			if (!image_widget->is_zoomed_view())
+				ensure_fullres_loaded_image();
+			image_widget->set_zoomed_view(!image_widget->is_zoomed_view());
+			}
+
+	void toggle_clipping_overlay(void)
+		{
+			view_menu->setItemChecked(show_clipping_menu_id,
+						!view_menu->isItemChecked(show_clipping_menu_id));
+			color_and_levels_params_changed();
+			}
+
 	void shooting_info_dialog(void)
 		{
 			QMessageBox::information(this,"Shooting info",
@@ -897,6 +1687,8 @@ class image_window_t : public Q3MainWindow, public processor_t {
 			}
 
 	void ensure_fullres_loaded_image(void);
+	void load_fullres_from_image_file(void);
+	uint should_load_fullres(const QString &fname);
 
 	void start_fullres_processing(const QString fname,const uint do_resize,const float unsharp_mask_radius)
 		{
@@ -906,12 +1698,15 @@ class image_window_t : public Q3MainWindow, public processor_t {
 			fullres_processing_do_resize=do_resize;
 			fullres_processing_USM_radius=unsharp_mask_radius;
 
-			if (is_external_reader_process_running())
+			if (is_external_reader_process_running() ||
+											is_loading_fullres_image)
 				return;		// if the process is running, then load operation
 							//   might not yet have started in processor_t,
 							//   and therefore we need to wait so that we
 							//   don't start our operation before the image
-							//   load operation
+							//   load operation. A full-res image from
+							//   background decoding needs the divisor
+							//   and crop set after its load succeeds
 
 			start_fullres_processing_fname=QString::null;
 
@@ -944,6 +1739,78 @@ const image_window_t::output_dimensions_t image_window_t::output_dimensions[]={
 		{NULL,				{640,480}},
 		};
 
+const image_window_t::grayscale_filter_t image_window_t::grayscale_filters[]={
+		{"No filter",		{1.0f,1.0f,1.0f}},
+		{"Yellow filter",	{1.0f,0.8f,0.25f}},
+		{"Orange filter",	{1.0f,0.55f,0.12f}},
+		{"Red filter",		{1.0f,0.2f,0.03f}},
+		{"Green filter",	{0.4f,1.0f,0.25f}},
+		{"Blue filter",		{0.25f,0.5f,1.0f}},
+		};
+
+void histogram_widget_t::paintEvent(QPaintEvent *)
+{
+	QPainter qp;
+	qp.begin(this);
+	qp.fillRect(rect(),Qt::black);
+
+	if (histogram == NULL) {
+		qp.end();
+		return;
+		}
+
+	const uint H=(uint)height();
+	const uint clip_bar_width=4;
+	const uint nr_of_columns=histogram_t::NR_OF_BINS / 2;
+
+		// bins 0 and 0xff hold the clipped pixels, which are shown by
+		//   the bars instead; the rest are scaled to the highest of them
+
+	uint max_count=1;
+	for (uint i=1;i < histogram_t::NR_OF_BINS-1;i++) {
+		max_count=max(max_count,histogram->luminance[i]);
+		for (uint c=0;c < 3;c++)
+			max_count=max(max_count,histogram->channels[c][i]);
+		}
+	max_count*=2;		// two bins per column
+
+	const float nr_of_pixels=max(histogram->nr_of_pixels,1U);
+	const uint black_bar_height=(uint)(H * min(1.0f,
+				histogram->black_clipped_pixels * 20 / nr_of_pixels));
+	const uint white_bar_height=(uint)(H * min(1.0f,
+				histogram->white_clipped_pixels * 20 / nr_of_pixels));
+	qp.fillRect(0,H - black_bar_height,clip_bar_width - 1,
+											black_bar_height,Qt::blue);
+	qp.fillRect(width() - clip_bar_width + 1,H - white_bar_height,
+						clip_bar_width - 1,white_bar_height,Qt::red);
+
+	qp.setPen(QColor(Qt::gray));
+	for (uint x=0;x < nr_of_columns;x++) {
+		const uint count=histogram->luminance[2*x] +
+											histogram->luminance[2*x + 1];
+		const uint h=min(H,(uint)((unsigned long long)count * H / max_count));
+		if (h)
+			qp.drawLine(clip_bar_width + x,H-1,clip_bar_width + x,H-h);
+		}
+
+	const QColor channel_colors[3]={Qt::red,Qt::green,Qt::blue};
+	for (uint c=0;c < 3;c++) {
+		qp.setPen(channel_colors[c]);
+		uint prev_y=0;
+		for (uint x=0;x < nr_of_columns;x++) {
+			const uint count=histogram->channels[c][2*x] +
+										histogram->channels[c][2*x + 1];
+			const uint y=H-1 - min(H-1,
+						(uint)((unsigned long long)count * H / max_count));
+			if (x)
+				qp.drawLine(clip_bar_width + x-1,prev_y,clip_bar_width + x,y);
+			prev_y=y;
+			}
+		}
+
+	qp.end();
+	}
+
 void image_widget_t::ensure_correct_size(void)
 {
 	const vec<uint> image_size=image_window->processor.get_image_size();
@@ -961,13 +1828,46 @@ void image_widget_t::ensure_correct_size(void)
 															image_size.y;
 		}
 
+	if (shm_images[0].is_created() &&
+						shm_images[0].get_width() == desired_size.x &&
+						shm_images[0].get_height() == desired_size.y)
+		return;
+
+	uchar *output_bufs[NR_OF_FRAMES];
+	uint i;
+
+	if (use_shm_images) {
+		for (i=0;i < NR_OF_FRAMES;i++) {
+			if (!shm_images[i].create(desired_size.x,desired_size.y))
+				break;
+			output_bufs[i]=shm_images[i].bits();
+			}
+
+		if (i == NR_OF_FRAMES) {
+			setAttribute(Qt::WA_PaintOnScreen);	// put() draws on window
+			displayed_frame=0;
+			image_window->processor.set_working_res(desired_size.x,
+							desired_size.y,output_bufs,1 /* BGR */,4);
+			return;
+			}
+
+		for (i=0;i < NR_OF_FRAMES;i++)
+			shm_images[i].destroy();
+		use_shm_images=0;		// the server has no usable MIT-SHM
+		setAttribute(Qt::WA_PaintOnScreen,false);
+		}
+
 	const QSize qdesired_size(desired_size.x,desired_size.y);
 
-	if (qimage.size() == qdesired_size)
+	if (qimages[0].size() == qdesired_size)
 		return;
 
-	qimage.create(qdesired_size,32);
-	qimage.fill(0);
+	for (i=0;i < NR_OF_FRAMES;i++) {
+		qimages[i].create(qdesired_size,32);
+		qimages[i].fill(0);
+		output_bufs[i]=qimages[i].bits();
+		}
+	displayed_frame=0;
 
 	union {
 		uchar chars[4];
@@ -976,18 +1876,40 @@ void image_widget_t::ensure_correct_size(void)
 	memset(&endian_test_union,0,sizeof(endian_test_union));
 	endian_test_union.chars[0]=1;
 
-	image_window->processor.set_working_res(qimage.width(),qimage.height(),
-							qimage.bits(),!!qBlue(endian_test_union.rgb),4);
+	image_window->processor.set_working_res(desired_size.x,desired_size.y,
+							output_bufs,!!qBlue(endian_test_union.rgb),4);
+	}
+
+void image_widget_t::refresh_image(void)
+{			// shows the latest frame completed by the processor, which does
+			//   not write to it until the next call
+
+	const uint frame=image_window->processor.get_output_buf_to_display();
+	if (frame == displayed_frame)
+		return;					// superseded processing left no new frame
+	displayed_frame=frame;
+
+	if (!shm_images[displayed_frame].is_created())
+		qpixmap.convertFromImage(qimages[displayed_frame]);
+	update();
 	}
 
 void image_widget_t::mousePressEvent(QMouseEvent *e)
 {
+	if (is_zoomed) {			// drag to pan
+		is_dragging=1;
+		drag_start_pos=e->pos();
+		drag_start_view_pos=view_pos;
+		return;
+		}
+
 	const vec<uint> image_offset=get_image_offset();
 	const vec<sint> pos={	e->x() - (sint)image_offset.x,
 							e->y() - (sint)image_offset.y};
 
-	const vec<float> pos_fraction={	pos.x / (float)qpixmap.width(),
-									pos.y / (float)qpixmap.height()};
+	const vec<uint> displayed_size=get_displayed_size();
+	const vec<float> pos_fraction={	pos.x / (float)displayed_size.x,
+									pos.y / (float)displayed_size.y};
 
 	if (pos.x < 0 || pos.y < 0 || pos_fraction.x >= 1 || pos_fraction.y >= 1)
 		return;
@@ -995,7 +1917,9 @@ void image_widget_t::mousePressEvent(QMouseEvent *e)
 	uint values_in_file[3];
 	image_window->processor.get_spot_values(pos_fraction,values_in_file);
 
-	const QRgb screen_rgb=qimage.pixel(pos.x,pos.y);
+	const QRgb screen_rgb=shm_images[displayed_frame].is_created() ?
+						shm_images[displayed_frame].get_pixel(pos.x,pos.y) :
+								qimages[displayed_frame].pixel(pos.x,pos.y);
 
 	if ((e->state() & Qt::ShiftModifier) != 0)
 		image_window->add_to_spot_values_clipboard(
@@ -1025,15 +1949,234 @@ void image_widget_t::mousePressEvent(QMouseEvent *e)
 		}
 	}
 
+void image_widget_t::mouseMoveEvent(QMouseEvent *e)
+{
+	if (!is_dragging)
+		return;
+
+	view_pos.x=drag_start_view_pos.x - (e->x() - drag_start_pos.x());
+	view_pos.y=drag_start_view_pos.y - (e->y() - drag_start_pos.y());
+	view_changed();
+	}
+
 void image_widget_t::resizeEvent(QResizeEvent *)
 {
+	view_changed();
 	image_window->check_processing();
 	}
 
+void image_widget_t::get_crop_area(vec<uint> &beg,vec<uint> &end) const
+{			// in uncropped image coordinates
+
+	const vec<uint> image_size=
+					image_window->processor.get_uncropped_image_size();
+	const vec<uint> cropped_size=image_window->processor.get_image_size();
+
+	uint top,bottom,left,right;
+	image_window->processor.get_crop(top,bottom,left,right);
+	beg.x=min(left,image_size.x);
+	beg.y=min(top ,image_size.y);
+	end.x=min(beg.x + cropped_size.x,image_size.x);
+	end.y=min(beg.y + cropped_size.y,image_size.y);
+	}
+
+void image_widget_t::clamp_view_pos(void)
+{			// centers the crop area if it is smaller than the widget
+
+	vec<uint> beg,end;
+	get_crop_area(beg,end);
+
+	const sint widget_size[2]={width(),height()};
+	sint * const pos[2]={&view_pos.x,&view_pos.y};
+	const uint area_beg[2]={beg.x,beg.y},area_end[2]={end.x,end.y};
+
+	for (uint i=0;i < 2;i++) {
+		const sint area_size=(sint)(area_end[i] - area_beg[i]);
+		if (area_size <= widget_size[i])
+			*pos[i]=(sint)area_beg[i] - (widget_size[i] - area_size) / 2;
+		  else
+			*pos[i]=max(min(*pos[i],(sint)area_end[i] - widget_size[i]),
+														(sint)area_beg[i]);
+		}
+	}
+
+void image_widget_t::get_visible_tiles(vec<uint> &beg,vec<uint> &end) const
+{			// tile columns and rows beg.. end-1
+
+	vec<uint> area_beg,area_end;
+	get_crop_area(area_beg,area_end);
+
+	const uint TILE_SIZE=interactive_image_processor_t::TILE_SIZE;
+	beg.x=max(view_pos.x,(sint)area_beg.x) / TILE_SIZE;
+	beg.y=max(view_pos.y,(sint)area_beg.y) / TILE_SIZE;
+	end.x=(min(view_pos.x + width(),(sint)area_end.x) + TILE_SIZE-1) /
+																TILE_SIZE;
+	end.y=(min(view_pos.y + height(),(sint)area_end.y) + TILE_SIZE-1) /
+																TILE_SIZE;
+	}
+
+void image_widget_t::set_zoomed_view(const uint zoomed)
+{
+	if (zoomed && !is_zoomed) {		// start at the center of crop area
+		vec<uint> beg,end;
+		get_crop_area(beg,end);
+		view_pos.x=(sint)(beg.x + end.x) / 2 - width()  / 2;
+		view_pos.y=(sint)(beg.y + end.y) / 2 - height() / 2;
+		}
+
+	is_zoomed=zoomed;
+	is_dragging=0;
+
+	view_changed();
+	update();
+	}
+
+void image_widget_t::request_tiles(void)
+{
+	interactive_image_processor_t &processor=image_window->processor;
+
+	if (!is_zoomed || !processor.is_file_loaded ||
+			processor.operation_pending_count != (uint)tile_requests.count())
+		return;		// requested again when the operations complete
+
+	const uint TILE_SIZE=interactive_image_processor_t::TILE_SIZE;
+	vec<uint> beg,end;
+	get_visible_tiles(beg,end);
+
+	const sint center_x=view_pos.x + width()/2;
+	const sint center_y=view_pos.y + height()/2;
+
+	while ((uint)tile_requests.count() < MAX_TILE_REQUESTS) {
+		uint best_pos=0,best_distance=~0U;
+
+		for (uint ty=beg.y;ty < end.y;ty++)
+			for (uint tx=beg.x;tx < end.x;tx++) {
+				const uint tile_pos=(ty << 16) | tx;
+
+				QMap<uint,tile_t>::const_iterator it=tiles.find(tile_pos);
+				if (it != tiles.end() &&
+								it.value().params_serial == params_serial)
+					continue;
+
+				uint is_requested=0;
+				{ Q3ValueList<tile_request_t>::const_iterator rit;
+				for (rit=tile_requests.begin();
+									rit != tile_requests.end();rit++)
+					if ((*rit).tile_pos == tile_pos)
+						is_requested=1; }
+				if (is_requested)
+					continue;
+
+				const sint dx=(sint)(tx*TILE_SIZE + TILE_SIZE/2) - center_x;
+				const sint dy=(sint)(ty*TILE_SIZE + TILE_SIZE/2) - center_y;
+				const uint distance=(uint)(dx*dx + dy*dy);
+				if (best_distance > distance) {
+					best_distance=distance;
+					best_pos=tile_pos;
+					}
+				}
+
+		if (best_distance == ~0U)
+			break;
+
+		tile_request_t request;
+		request.tile_pos=best_pos;
+		request.buf=new uchar [TILE_SIZE*TILE_SIZE*4];
+		memset(request.buf,0xff,TILE_SIZE*TILE_SIZE*4);	// opaque alpha
+		request.params_serial=params_serial;
+		tile_requests.append(request);
+
+		processor.start_operation(interactive_image_processor_t::RENDER_TILE,
+												NULL,request.buf,best_pos);
+		}
+	}
+
+void image_widget_t::tile_rendered(void)
+{
+	if (tile_requests.isEmpty())
+		return;
+
+	const tile_request_t request=tile_requests.first();
+	tile_requests.pop_front();
+
+	const uint TILE_SIZE=interactive_image_processor_t::TILE_SIZE;
+	const vec<uint> image_size=
+					image_window->processor.get_uncropped_image_size();
+	const vec<uint> tile_beg={	(request.tile_pos & 0xffff) * TILE_SIZE,
+								(request.tile_pos >> 16)    * TILE_SIZE};
+
+	if (tile_beg.x < image_size.x && tile_beg.y < image_size.y) {
+		const QImage tile_image(request.buf,TILE_SIZE,TILE_SIZE,
+													QImage::Format_RGB32);
+		tile_t &tile=tiles[request.tile_pos];
+		tile.pixmap.convertFromImage(tile_image.copy(0,0,
+								min((uint)TILE_SIZE,image_size.x - tile_beg.x),
+								min((uint)TILE_SIZE,image_size.y - tile_beg.y)));
+		tile.params_serial=request.params_serial;
+		}
+	delete [] request.buf;
+
+	if ((uint)tiles.count() > MAX_CACHED_TILES) {	// keep the ones around the view
+		vec<uint> beg,end;
+		get_visible_tiles(beg,end);
+
+		QMap<uint,tile_t>::iterator it=tiles.begin();
+		while (it != tiles.end()) {
+			const uint tx=it.key() & 0xffff,ty=it.key() >> 16;
+			if (tx+1 < beg.x || tx > end.x || ty+1 < beg.y || ty > end.y)
+				it=tiles.erase(it);
+			  else
+				it++;
+			}
+		}
+
+	update();
+	}
+
+void image_widget_t::paint_tiles(void)
+{			// stale tiles are shown until they have been rendered again
+
+	const uint TILE_SIZE=interactive_image_processor_t::TILE_SIZE;
+	vec<uint> area_beg,area_end;
+	get_crop_area(area_beg,area_end);
+	vec<uint> beg,end;
+	get_visible_tiles(beg,end);
+
+	QRegion background(rect(),QRegion::Rectangle);
+
+	for (uint ty=beg.y;ty < end.y;ty++)
+		for (uint tx=beg.x;tx < end.x;tx++) {
+			QMap<uint,tile_t>::const_iterator it=tiles.find((ty << 16) | tx);
+			if (it == tiles.end())
+				continue;
+
+				// the part of the tile within the crop area
+
+			const uint x0=max(tx*TILE_SIZE,area_beg.x);
+			const uint y0=max(ty*TILE_SIZE,area_beg.y);
+			const uint x1=min((tx+1)*TILE_SIZE,area_end.x);
+			const uint y1=min((ty+1)*TILE_SIZE,area_end.y);
+			if (x0 >= x1 || y0 >= y1)
+				continue;
+
+			const sint dest_x=(sint)x0 - view_pos.x;
+			const sint dest_y=(sint)y0 - view_pos.y;
+			bitBlt(this,dest_x,dest_y,&it.value().pixmap,
+						x0 - tx*TILE_SIZE,y0 - ty*TILE_SIZE,x1-x0,y1-y0);
+			background=background.subtract(QRegion(dest_x,dest_y,
+										x1-x0,y1-y0,QRegion::Rectangle));
+			}
+
+	erase(background);
+	}
+
 image_window_t::image_window_t(QApplication * const app) :
 			Q3MainWindow(NULL,"image_window"), processor_t(this),
 			fullres_processing_do_resize(0),
-			fullres_processing_USM_radius(-1.0f), file_menu(this)
+			fullres_processing_USM_radius(-1.0f),
+			decoded_image_cache(this), is_loading_prefetched_image(0),
+			nr_of_next_numbered_images(0), nr_of_next_images_prefetched(0),
+			file_menu(this), view_menu(NULL), show_clipping_menu_id(-1)
 {
 	Q3VBox * const qvbox=new Q3VBox(this);
 	setCentralWidget(qvbox);
@@ -1090,6 +2233,13 @@ image_window_t::image_window_t(QApplication * const app) :
 	connect(grayscale_checkbox,SIGNAL(toggled(bool)),
 									SLOT(color_and_levels_params_changed()));
 
+	grayscale_filter_combobox=new QComboBox((bool)0,color_balance_view_hbox);
+	for (uint i=0;i < lenof(grayscale_filters);i++)
+		grayscale_filter_combobox->insertItem(grayscale_filters[i].name);
+	grayscale_filter_combobox->setEnabled(false);
+	connect(grayscale_filter_combobox,SIGNAL(activated(int)),
+									SLOT(color_and_levels_params_changed()));
+
 		/*****************************/
 		/*****                   *****/
 		/***** crop view widgets *****/
@@ -1130,6 +2280,8 @@ image_window_t::image_window_t(QApplication * const app) :
 	connect(right_crop->spinbox,SIGNAL(valueChanged(int)),
 												SLOT(crop_params_changed()));
 
+	histogram_widget=new histogram_widget_t(qhbox);
+
 		/***********************/
 		/*****             *****/
 		/***** main window *****/
@@ -1140,6 +2292,7 @@ image_window_t::image_window_t(QApplication * const app) :
 	normal_view_hbox->setFixedHeight(fixed_height);
 	color_balance_view_hbox->setFixedHeight(fixed_height);
 	crop_view_hbox->setFixedHeight(fixed_height);
+	histogram_widget->setFixedHeight(fixed_height);
 
 	image_widget=new image_widget_t(qvbox,this);
 	qvbox->setStretchFactor(image_widget,1000);
@@ -1161,14 +2314,17 @@ image_window_t::image_window_t(QApplication * const app) :
 
 	connect(&file_menu,SIGNAL(activated(int)),SLOT(load_recent_image(int)));
 
-	{ Q3PopupMenu * const view_menu=new Q3PopupMenu(this);
+	view_menu=new Q3PopupMenu(this);
 	view_menu->insertItem("&Normal",this,SLOT(select_normal_view()),Qt::Key_F5);
 	view_menu->insertItem("Color &Balance",this,
 								SLOT(select_color_balance_view()),Qt::Key_F6);
 	view_menu->insertItem("&Crop",this,SLOT(select_crop_view()),Qt::Key_F7);
+	view_menu->insertItem("&Zoom 1:1",this,SLOT(toggle_zoomed_view()),Qt::Key_F8);
+	show_clipping_menu_id=view_menu->insertItem("Show C&lipping",this,
+								SLOT(toggle_clipping_overlay()),Qt::Key_F9);
 	view_menu->insertItem("Shooting &Info",this,SLOT(shooting_info_dialog()),Qt::CTRL + Qt::Key_I);
 
-	menuBar()->insertItem("&View",view_menu); }
+	menuBar()->insertItem("&View",view_menu);
 
 	{ Q3PopupMenu * const help_menu=new Q3PopupMenu(this);
 	help_menu->insertItem("&About",this,SLOT(display_help_about()));
@@ -1285,67 +2441,67 @@ void image_window_t::set_recent_images_in_file_menu(void)
 void image_window_t::ensure_fullres_loaded_image(void)
 {
 #ifndef PHOTOPROC_ALWAYS_USE_HALFRES
-	if (!image_file_data.count() || image_fname.isEmpty())
+	if (image_file_fd < 0 || image_fname.isEmpty() ||
+												is_loading_fullres_image)
 		return;
 
-	sint fd=-1;
-	char temp_fname[1000];
-
-	const char * const env_tmpdir=getenv("TMPDIR");
-	if (env_tmpdir != NULL) {
-		strcpy(temp_fname,env_tmpdir);
-		if (strlen(temp_fname))
-			if (temp_fname[strlen(temp_fname)-1] != '/')
-				strcat(temp_fname,"/");
-		strcat(temp_fname,"photoproc-temp-XXXXXX");
-		fd=mkstemp(temp_fname);
-		}
-#ifdef P_tmpdir
-	if (fd < 0) {
-		strcpy(temp_fname,P_tmpdir "/" "photoproc-temp-XXXXXX");
-		fd=mkstemp(temp_fname);
+	if (load_background_decoded_image(1)) {
+		set_caption();
+		return;
 		}
+
+	load_fullres_from_image_file();
 #endif
-	if (fd < 0) {
-		strcpy(temp_fname,"/tmp/" "photoproc-temp-XXXXXX");
-		fd=mkstemp(temp_fname);
-		}
+	}
 
-	if (fd >= 0) {
-		if (write(fd,image_file_data.data(),image_file_data.count()) ==
-											(sint)image_file_data.count()) {
-			::close(fd);
-			image_file_data.resize(0);
-			start_loading_image(image_fname,1,temp_fname);
-			set_caption();
-			return;
-			}
-		::close(fd);
-		}
+void image_window_t::load_fullres_from_image_file(void)
+{			// loads the half-res image again in full-res; it remains in
+			//   half-res, with a warning, if loading cannot be started
+#ifndef PHOTOPROC_ALWAYS_USE_HALFRES
+	const sint fd=image_file_fd;	// now owned by start_loading_image()
+	image_file_fd=-1;
+
+	const QString error_text=start_loading_image(image_fname,1,fd);
+	set_caption();
 
-	image_file_data.resize(0);
-	QMessageBox::warning(this,MESSAGE_BOX_CAPTION,
-						QString("Could not write temp file ") +
-							QString(temp_fname) +
-							" for re-loading the image in full resolution. "
-							"The image remains loaded in half resolution",
+	if (!error_text.isNull())
+		QMessageBox::warning(this,MESSAGE_BOX_CAPTION,error_text +
+							"\n\nThe image remains loaded in half resolution",
 							QMessageBox::Ok,QMessageBox::NoButton);
 #endif
 	}
 
+uint image_window_t::should_load_fullres(const QString &fname)
+{			// crops are in full-res pixels, and are applied to half-res
+			//   images scaled, so they do not need a full-res image
+	const uint window_pixels=size().width() * size().height();
+	const uint file_size=QFileInfo(fname).size();
+
+	return window_pixels > file_size/3;
+	}
+
 void image_window_t::load_image(const QString &fname)
 {
 	if (processor.operation_pending_count ||
 									is_external_reader_process_running())
 		return;
 
-	uint is_crop_active=(top_crop->get_value() || bottom_crop->get_value() ||
-						left_crop->get_value() || right_crop->get_value());
-	const uint window_pixels=size().width() * size().height();
-	const uint file_size=QFileInfo(fname).size();
+	const uint load_fullres=should_load_fullres(fname);
+
+	QString error_text;
+
+	uint is_fullres;
+	background_decoder_process_t *decoder_process;
+	decoded_image_t * const decoded_image=decoded_image_cache.take(
+						fname,load_fullres,is_fullres,decoder_process);
+	if (decoded_image != NULL) {
+		start_loading_decoded_image(fname,decoded_image,is_fullres,
+															decoder_process);
+		is_loading_prefetched_image=1;
+		}
+	  else
+		error_text=start_loading_image(fname,load_fullres);
 
-	const QString error_text=start_loading_image(fname,
-							is_crop_active || (window_pixels > file_size/3));
 	if (!error_text.isNull()) {
 		QMessageBox::warning(this,MESSAGE_BOX_CAPTION,error_text,
 								QMessageBox::Ok,QMessageBox::NoButton);
@@ -1353,6 +2509,7 @@ void image_window_t::load_image(const QString &fname)
 		}
 
 	image_fname=fname;
+	next_numbered_images_fname=QString::null;	// files may have changed
 	set_caption();
 
 		// update recent images list
@@ -1391,14 +2548,11 @@ void image_window_t::load_image(const QString &fname)
 
 void image_window_t::crop_params_changed(void)
 {
-	if (top_crop->get_value() || bottom_crop->get_value() ||
-						left_crop->get_value() || right_crop->get_value())
-		ensure_fullres_loaded_image();
-
 	processor.set_crop(	top_crop->get_value(),
 						bottom_crop->get_value(),
 						left_crop->get_value(),
 						right_crop->get_value());
+	image_widget->view_changed();
 	check_processing();
 	}
 
@@ -1417,8 +2571,18 @@ void image_window_t::color_and_levels_params_changed(void)
 	params.color_coeffs[2]=two_color_balance_slider_t::get_value2(
 									red_blue_balance_slider->get_value());
 	params.convert_to_grayscale=grayscale_checkbox->isChecked();
+	grayscale_filter_combobox->setEnabled(params.convert_to_grayscale);
+
+	{ const grayscale_filter_t &filter=
+			grayscale_filters[grayscale_filter_combobox->currentItem()];
+	for (uint c=0;c < 3;c++)
+		params.grayscale_weights[c]=filter.weights[c]; }
+
+	params.show_clipping=(view_menu != NULL &&
+							view_menu->isItemChecked(show_clipping_menu_id));
 
 	processor.set_color_and_levels_params(params);
+	image_widget->invalidate_tiles();
 	check_processing();
 	}
 
@@ -1443,17 +2607,34 @@ void image_window_t::set_caption(void)
 
 void image_window_t::check_processing(void)
 {
-	if (processor.operation_pending_count)
+	if (processor.operation_pending_count) {
+		if (processor.is_processing_necessary && processor.is_file_loaded &&
+								processor.is_processing_supersedable())
+			processor.start_operation(interactive_image_processor_t::PROCESSING);
+				// the stale one is cancelled; the widget is not resized
+				//   here, as output_bufs may still be in use
 		return;
+		}
 
-	if (!is_external_reader_process_running()) {
+	if (!is_external_reader_process_running())
 		delete_external_reader_process();
 
-		image_widget->ensure_correct_size();
+	if (load_background_decoded_image(0)) {
+		set_caption();
+		return;
+		}
+
+		// processing can start while the external reader process is still
+		//   running, as image rows are read from its output on demand
 
-		if (processor.is_processing_necessary && processor.is_file_loaded)
-			processor.start_operation(
-								interactive_image_processor_t::PROCESSING);
+	image_widget->ensure_correct_size();
+
+	if (processor.is_processing_necessary && processor.is_file_loaded)
+		processor.start_operation(interactive_image_processor_t::PROCESSING);
+	  else
+	if (processor.is_file_loaded) {		// image is on screen now
+		start_background_decoding();
+		prefetch_next_numbered_images();
 		}
 
 	set_caption();
@@ -1466,26 +2647,63 @@ bool image_window_t::event(QEvent *e)
 
 		// operation_completed() event
 
-	if (!start_fullres_processing_fname.isEmpty())
-		start_fullres_processing(start_fullres_processing_fname,
-				fullres_processing_do_resize,fullres_processing_USM_radius);
-	set_caption();
-
 	interactive_image_processor_t::operation_type_t operation_type;
 	char *error_text;
-	while (processor.get_operation_results(operation_type,error_text)) {
+	histogram_t *histogram;
+	while (processor.get_operation_results(operation_type,error_text,
+															&histogram)) {
+		if (histogram != NULL)
+			histogram_widget->set_histogram(histogram);
+
+		if (operation_type == interactive_image_processor_t::RENDER_TILE) {
+			image_widget->tile_rendered();
+			continue;
+			}
+		if (operation_type != interactive_image_processor_t::PROCESSING &&
+				operation_type !=
+							interactive_image_processor_t::FULLRES_PROCESSING)
+			image_widget->clear_tiles();		// the image is replaced
+
+		const uint is_prefetched_image_load=is_loading_prefetched_image &&
+			operation_type == interactive_image_processor_t::LOAD_DECODED_IMAGE;
+		if (is_prefetched_image_load)
+			is_loading_prefetched_image=0;
+		const uint is_fullres_image_load=is_loading_fullres_image &&
+			operation_type == interactive_image_processor_t::LOAD_DECODED_IMAGE;
+		if (is_fullres_image_load)
+			is_loading_fullres_image=0;
+
 		if (error_text != NULL) {
 			//!!!
 			delete [] error_text;
+
+			if (is_prefetched_image_load)		// load it in the usual way
+				start_loading_image(image_fname,
+									should_load_fullres(image_fname));
+			if (is_fullres_image_load)			// decode it again
+				load_fullres_from_image_file();
 			continue;
 			}
 
+		if (is_fullres_image_load) {
+			processor.set_loaded_image_divisor(1);
+			close_image_file();
+			}
+
 		update_crop_view_label();
 
 		if (operation_type == interactive_image_processor_t::PROCESSING)
 			image_widget->refresh_image();
 		}
 
+	if (!start_fullres_processing_fname.isEmpty())
+		start_fullres_processing(start_fullres_processing_fname,
+				fullres_processing_do_resize,fullres_processing_USM_radius);
+	set_caption();
+
+	image_widget->view_changed();		// requests tiles before other
+										//   processing, as the zoomed
+										//   view shows tiles only
 	check_processing();
 
 	return true;
@@ -1568,6 +2786,10 @@ class batch_process_images_t : public QObject, public processor_t {
 			params.color_coeffs[1]=1.0f;
 			params.color_coeffs[2]=1.0f;
 			params.convert_to_grayscale=0;
+			params.grayscale_weights[0]=1.0f;
+			params.grayscale_weights[1]=1.0f;
+			params.grayscale_weights[2]=1.0f;
+			params.show_clipping=0;
 			processor.set_color_and_levels_params(params); }
 
 			{ const vec<uint> resize_size={0,0};
@@ -1605,6 +2827,66 @@ int main(sint argc,char **argv)
 			return 0;
 			}
 
+		if (app.argv()[i] == QString("-verify-phase1")) {
+			const uint max_error=processing_phase1_t::get_max_vector_error();
+			printf("phase 1 vector code differs by up to %u quantum(s)\n",
+																max_error);
+			return (max_error <= 1) ? 0 : 1;
+			}
+
+		if (app.argv()[i] == QString("-verify-lut")) {
+				// with a RAW file, its camera's conversion is checked;
+				//   the image itself is not needed
+
+			image_reader_t image_reader;
+			{ image_buffer_t img;
+			img.allocate(1,1);
+			image_reader.load_decoded_image(img,
+						(i+1 < (uint)app.argc()) ? app.argv()[i+1] : NULL); }
+
+			static const float param_sets[][4]={
+							// contrast, exposure_shift, black_level
+							//   in 8-bit codes, white_clipping_stops
+					{1.0f ,0.0f  ,0.0f ,0.0f},
+					{1.15f,+2.63f,10.0f,0.0f},
+					{2.0f ,-1.0f ,30.0f,1.0f}};
+
+			float max_error=0;
+			for (uint k=0;k < sizeof(param_sets)/sizeof(*param_sets);k++)
+				for (uint undo_enh_shadows=0;undo_enh_shadows < 2;
+														undo_enh_shadows++) {
+					color_and_levels_processing_t::params_t params;
+					params.contrast=param_sets[k][0];
+					params.exposure_shift=param_sets[k][1];
+					params.black_level=pow(param_sets[k][2] / 255,2.2);
+					params.white_clipping_stops=param_sets[k][3];
+					params.color_coeffs[0]=1.0f;
+					params.color_coeffs[1]=1.0f;
+					params.color_coeffs[2]=1.0f;
+					params.convert_to_grayscale=0;
+					params.grayscale_weights[0]=1.0f;
+					params.grayscale_weights[1]=1.0f;
+					params.grayscale_weights[2]=1.0f;
+					params.show_clipping=0;
+
+					const color_and_levels_processing_t pass2(params);
+					const pipeline_lut_t lut(image_reader,undo_enh_shadows,
+																	pass2);
+					const float error=lut.get_max_error(image_reader,pass2);
+					if (max_error < error)
+						max_error=error;
+					}
+
+			printf("pipeline LUT differs by up to %.2f 8-bit code(s)\n",
+																max_error);
+			return (max_error < 0.5f) ? 0 : 1;
+			}
+
+		if (app.argv()[i] == QString("-queue-benchmark")) {
+			interactive_image_processor_t::benchmark_queues();
+			return 0;
+			}
+
 		if (app.argv()[i] == QString("-info"))
 			show_only_info=true;
 		  else if (app.argv()[i] == QString("-save"))
@@ -0,0 +1,186 @@
+/* Copyright (C) 2003-2005 Ahti Heinla
+   Licensing conditions are described in the file LICENSE
+*/
+
+#include <string.h>
+#include <qglobal.h>
+#include "vec.hpp"
+#include "shm-display.hpp"
+
+#if defined(Q_WS_X11) && !defined(PHOTOPROC_NO_MIT_SHM)
+
+#include <qx11info_x11.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+
+static volatile uint shm_attach_failed;		// set by shm_error_handler()
+
+static int shm_error_handler(Display *,XErrorEvent *)
+{			// XShmAttach() fails with an X error if the server cannot
+			//   access our shared memory, for example if it is remote
+
+	shm_attach_failed=1;
+	return 0;
+	}
+
+shm_image_t::shm_image_t(void) :
+			display(NULL), x_image(NULL), shm_info(NULL), gc(NULL),
+			width(0), height(0) {}
+
+shm_image_t::~shm_image_t(void)
+{
+	destroy();
+	if (gc != NULL)
+		XFreeGC((Display *)display,(GC)gc);
+	}
+
+uint shm_image_t::create(const uint _width,const uint _height)
+{
+	destroy();
+
+	if (display == NULL) {
+		display=QX11Info::display();
+		if (display == NULL || !XShmQueryExtension((Display *)display))
+			return 0;
+		}
+	Display * const dpy=(Display *)display;
+
+	{ const uint endian_test=1;
+	if (*(const uchar *)&endian_test != 1)
+		return 0;		// bits() would need a different byte order
+	}
+
+	const sint screen=DefaultScreen(dpy);
+	Visual * const visual=DefaultVisual(dpy,screen);
+	if (visual->red_mask != 0xff0000 || visual->green_mask != 0xff00 ||
+												visual->blue_mask != 0xff)
+		return 0;
+
+	XShmSegmentInfo * const info=new XShmSegmentInfo;
+	memset(info,'\0',sizeof(*info));
+	info->shmid=-1;
+
+	XImage * const img=XShmCreateImage(dpy,visual,
+				DefaultDepth(dpy,screen),ZPixmap,NULL,info,_width,_height);
+	if (img == NULL) {
+		delete info;
+		return 0;
+		}
+
+	if (img->bits_per_pixel != 32 || img->byte_order != LSBFirst ||
+						img->bytes_per_line != (sint)(4*_width) ||
+				(info->shmid=shmget(IPC_PRIVATE,
+						img->bytes_per_line * img->height,IPC_CREAT | 0600)) < 0) {
+		XDestroyImage(img);
+		delete info;
+		return 0;
+		}
+
+	info->shmaddr=img->data=(char *)shmat(info->shmid,NULL,0);
+	info->readOnly=False;
+	if (info->shmaddr == (char *)-1) {
+		shmctl(info->shmid,IPC_RMID,NULL);
+		XDestroyImage(img);
+		delete info;
+		return 0;
+		}
+
+	XSync(dpy,False);
+	shm_attach_failed=0;
+	int (* const prev_handler)(Display *,XErrorEvent *)=
+									XSetErrorHandler(shm_error_handler);
+	XShmAttach(dpy,info);
+	XSync(dpy,False);
+	XSetErrorHandler(prev_handler);
+
+		// the segment is freed when both we and the server have detached
+
+	shmctl(info->shmid,IPC_RMID,NULL);
+
+	if (shm_attach_failed) {
+		shmdt(info->shmaddr);
+		img->data=NULL;
+		XDestroyImage(img);
+		delete info;
+		return 0;
+		}
+
+	if (gc == NULL)
+		gc=XCreateGC(dpy,RootWindow(dpy,screen),0,NULL);
+
+	memset(img->data,'\0',img->bytes_per_line * img->height);
+
+	x_image=img;
+	shm_info=info;
+	width=_width;
+	height=_height;
+
+	return 1;
+	}
+
+void shm_image_t::destroy(void)
+{
+	if (x_image == NULL)
+		return;
+
+	Display * const dpy=(Display *)display;
+	XImage * const img=(XImage *)x_image;
+	XShmSegmentInfo * const info=(XShmSegmentInfo *)shm_info;
+
+	XShmDetach(dpy,info);
+	XSync(dpy,False);
+	shmdt(info->shmaddr);
+	img->data=NULL;
+	XDestroyImage(img);
+	delete info;
+
+	x_image=NULL;
+	shm_info=NULL;
+	width=height=0;
+	}
+
+uchar *shm_image_t::bits(void) const
+{
+	return (x_image == NULL) ? NULL : (uchar *)((XImage *)x_image)->data;
+	}
+
+uint shm_image_t::get_pixel(const uint x,const uint y) const
+{
+	const uchar * const p=bits() + (y*width + x)*4;
+	return 0xff000000U | (p[2] << 16) | (p[1] << 8) | p[0];
+	}
+
+void shm_image_t::put(const unsigned long window,
+							const sint dest_x,const sint dest_y) const
+{
+	if (x_image == NULL)
+		return;
+
+	Display * const dpy=(Display *)display;
+	XShmPutImage(dpy,(Window)window,(GC)gc,(XImage *)x_image,
+							0,0,dest_x,dest_y,width,height,False);
+	XSync(dpy,False);
+	}
+
+#else		// MIT-SHM is not available; image_widget_t uses QImage
+
+shm_image_t::shm_image_t(void) :
+			display(NULL), x_image(NULL), shm_info(NULL), gc(NULL),
+			width(0), height(0) {}
+
+shm_image_t::~shm_image_t(void) {}
+
+uint shm_image_t::create(const uint,const uint) { return 0; }
+
+void shm_image_t::destroy(void) {}
+
+uchar *shm_image_t::bits(void) const { return NULL; }
+
+uint shm_image_t::get_pixel(const uint,const uint) const { return 0; }
+
+void shm_image_t::put(const unsigned long,const sint,const sint) const {}
+
+#endif
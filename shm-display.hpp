@@ -0,0 +1,42 @@
+/* Copyright (C) 2003-2005 Ahti Heinla
+   Licensing conditions are described in the file LICENSE
+*/
+
+class shm_image_t {
+		// 32-bit image in X shared memory (MIT-SHM). Any thread may render
+		//   into bits(), as that is plain memory; put() is the only X call
+		//   and is made in the GUI thread, so the server reads the pixels
+		//   directly and no QImage to QPixmap conversion is needed
+
+	void *display;			// Display *
+	void *x_image;			// XImage *; NULL if no image has been created
+	void *shm_info;			// XShmSegmentInfo *
+	void *gc;				// GC
+	uint width,height;
+
+	public:
+
+	shm_image_t(void);
+	~shm_image_t(void);
+
+	uint create(const uint _width,const uint _height);
+		// returns 0 if the X server has no usable MIT-SHM, for example if
+		//   it is remote or its pixels are not 32-bit 0x00RRGGBB words in
+		//   host byte order; the caller then falls back to QImage
+	void destroy(void);
+
+	uint is_created(void) const { return x_image != NULL; }
+	uint get_width(void)  const { return width; }
+	uint get_height(void) const { return height; }
+	uchar *bits(void) const;
+		// rows of width 32-bit pixels, without padding; bytes are in the
+		//   B,G,R,unused order that QImage's 32-bit images have on
+		//   little-endian hosts
+	uint get_pixel(const uint x,const uint y) const;
+		// as a QRgb
+
+	void put(const unsigned long window,
+						const sint dest_x,const sint dest_y) const;
+		// blits the image to window and waits until the server has read
+		//   the pixels
+	};